@@ -146,6 +146,8 @@ testScripts = [
     'importprunedfunds.py',
     'signmessages.py',
     'p2p-compactblocks.py',
+    'p2p-slowpeers.py',
+    'p2p-shorttxrelay.py',
     # FIXME: Reenable and possibly fix once the BIP9 mining is activated.
     #'nulldummy.py',
 
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.script import CScript, OP_TRUE, OP_HASH160, OP_EQUAL, hash160
+
+'''
+ShortTxRelayTest -- test transaction relay with salted short ids.
+
+Node0 is connected to two p2p peers, listener and announcer, which both
+negotiate short id relay with sendshorttx.
+
+1. A transaction submitted to node0 is announced to the listener in a
+   shorttxinv, using the listener's salt, and served on getshorttx.
+
+2. The announcer announces a transaction in a shorttxinv, using node0's salt.
+   Node0 requests it with getshorttx and accepts it. Announcing it again does
+   not trigger another request.
+
+3. Node0 and node1 relay transactions to each other by short id.
+'''
+
+REDEEM_SCRIPT = CScript([OP_TRUE])
+P2SH_SCRIPT = CScript([OP_HASH160, hash160(REDEEM_SCRIPT), OP_EQUAL])
+
+class ShortTxPeer(SingleNodeConnCB):
+    def __init__(self, salt):
+        SingleNodeConnCB.__init__(self)
+        self.salt = salt
+        self.remote_salt = None
+        self.shortids_announced = []
+        self.shortids_requested = []
+        self.txs_received = {}
+        self.txs_to_serve = {}
+        self.invs = []
+
+    def on_sendshorttx(self, conn, message):
+        self.remote_salt = message.salt
+        conn.send_message(msg_sendshorttx(self.salt))
+
+    def on_shorttxinv(self, conn, message):
+        self.shortids_announced.extend(message.shorttxids.shortids)
+
+    def on_getshorttx(self, conn, message):
+        self.shortids_requested.extend(message.shorttxids.shortids)
+        for shortid in message.shorttxids.shortids:
+            if shortid in self.txs_to_serve:
+                conn.send_message(msg_tx(self.txs_to_serve[shortid]))
+
+    def on_tx(self, conn, message):
+        message.tx.calc_sha256()
+        self.txs_received[message.tx.sha256] = message.tx
+
+    def on_inv(self, conn, message):
+        self.invs.extend(message.inv)
+
+    def shortid(self, tx, salt):
+        [k0, k1] = get_shorttx_siphash_keys(salt)
+        return calculate_shortid(k0, k1, tx.sha256)
+
+
+class ShortTxRelayTest(BitcoinTestFramework):
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def setup_network(self):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir,
+                                 extra_args=[['-debug', '-whitelist=127.0.0.1'], ['-debug', '-whitelist=127.0.0.1']])
+        connect_nodes(self.nodes[0], 1)
+        self.is_network_split = False
+
+    def make_tx(self, coinbase):
+        tx = CTransaction()
+        tx.vin.append(CTxIn(COutPoint(coinbase.sha256, 0), CScript([REDEEM_SCRIPT])))
+        tx.vout.append(CTxOut(coinbase.vout[0].nValue - 100000, P2SH_SCRIPT))
+        tx.rehash()
+        return tx
+
+    def run_test(self):
+        address = self.nodes[0].decodescript(bytes_to_hex_str(REDEEM_SCRIPT))['p2sh']
+        hashes = self.nodes[0].generatetoaddress(110, address)
+        self.sync_all()
+        coinbases = []
+        for h in hashes[:4]:
+            block = FromHex(CBlock(), self.nodes[0].getblock(h, False))
+            block.vtx[0].rehash()
+            coinbases.append(block.vtx[0])
+
+        listener = ShortTxPeer(0x1122334455667788)
+        announcer = ShortTxPeer(0x0102030405060708)
+        connections = []
+        connections.append(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], listener))
+        listener.add_connection(connections[0])
+        connections.append(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], announcer))
+        announcer.add_connection(connections[1])
+        NetworkThread().start()
+        listener.wait_for_verack()
+        announcer.wait_for_verack()
+        assert(wait_until(lambda: listener.remote_salt is not None and announcer.remote_salt is not None, timeout=10))
+        listener.sync_with_ping()
+        announcer.sync_with_ping()
+        node_salt = listener.remote_salt
+        assert_equal(announcer.remote_salt, node_salt)
+
+        # 1. Announcements from node0 use the listener's salt.
+        tx1 = self.make_tx(coinbases[0])
+        self.nodes[0].sendrawtransaction(ToHex(tx1))
+        tx1_shortid = listener.shortid(tx1, listener.salt)
+        assert(wait_until(lambda: tx1_shortid in listener.shortids_announced, timeout=10))
+        with mininode_lock:
+            assert(not any(inv.hash == tx1.sha256 for inv in listener.invs))
+        listener.send_message(msg_getshorttx([tx1_shortid]))
+        assert(wait_until(lambda: tx1.sha256 in listener.txs_received, timeout=10))
+
+        # An id that was never announced is not served.
+        listener.send_message(msg_getshorttx([(tx1_shortid + 1) & 0xffffffffffff]))
+        listener.sync_with_ping()
+        with mininode_lock:
+            assert_equal(len(listener.txs_received), 1)
+
+        # 2. Announcements to node0 use node0's salt.
+        tx2 = self.make_tx(coinbases[1])
+        tx2_shortid = announcer.shortid(tx2, node_salt)
+        with mininode_lock:
+            announcer.txs_to_serve[tx2_shortid] = tx2
+        announcer.send_message(msg_shorttxinv([tx2_shortid]))
+        assert(wait_until(lambda: tx2.hash in self.nodes[0].getrawmempool(), timeout=10))
+        with mininode_lock:
+            assert_equal(announcer.shortids_requested, [tx2_shortid])
+
+        # Known transactions are not requested again.
+        announcer.send_message(msg_shorttxinv([tx2_shortid]))
+        announcer.sync_with_ping()
+        with mininode_lock:
+            assert_equal(announcer.shortids_requested, [tx2_shortid])
+
+        # ...and not announced back to the peer that announced them.
+        tx2_listener_shortid = listener.shortid(tx2, listener.salt)
+        assert(wait_until(lambda: tx2_listener_shortid in listener.shortids_announced, timeout=10))
+        announcer.sync_with_ping()
+        with mininode_lock:
+            assert(announcer.shortid(tx2, announcer.salt) not in announcer.shortids_announced)
+
+        # 3. Both nodes relay to each other by short id.
+        tx3 = self.make_tx(coinbases[2])
+        self.nodes[1].sendrawtransaction(ToHex(tx3))
+        sync_mempools(self.nodes)
+        assert(tx3.hash in self.nodes[0].getrawmempool())
+        peer = [p for p in self.nodes[0].getpeerinfo() if p['subver'] != MY_SUBVERSION.decode('ascii')][0]
+        assert('shorttxinv' in peer['bytesrecv_per_msg'])
+        assert('getshorttx' in peer['bytessent_per_msg'])
+
+        [c.disconnect_node() for c in connections]
+
+if __name__ == '__main__':
+    ShortTxRelayTest().main()
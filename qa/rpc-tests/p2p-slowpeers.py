@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import time
+
+'''
+SlowPeersTest -- test that block download routes around slow peers.
+
+Setup: node1 mines a short chain which node0 doesn't know about. Node0 has two
+p2p connections, slow_node and fast_node, which both serve node1's blocks.
+slow_node never answers a getdata, fast_node answers immediately.
+
+1. slow_node announces the headers. Node0 requests a batch of blocks from it.
+
+2. fast_node announces the same headers. Node0 requests the blocks that are
+   not in flight yet from it, and fast_node delivers them.
+
+3. Once the blocks from slow_node have taken long enough, node0 requests them
+   again from fast_node, and syncs the whole chain without waiting for
+   slow_node.
+'''
+
+CHAIN_LENGTH = 24
+MINE_ADDRESS = "mipcBbFg9gMiCh81Kj8tqqdgoZub1ZJRfn"
+
+class BlockServer(SingleNodeConnCB):
+    def __init__(self, blocks, fServe):
+        SingleNodeConnCB.__init__(self)
+        self.blocks = blocks
+        self.fServe = fServe
+        self.requested = set()
+
+    def on_getdata(self, conn, message):
+        for inv in message.inv:
+            if inv.hash in self.blocks:
+                self.requested.add(inv.hash)
+                if self.fServe:
+                    conn.send_message(msg_block(self.blocks[inv.hash]))
+
+    def announce(self, headers):
+        msg = msg_headers()
+        msg.headers = headers
+        self.send_message(msg)
+
+
+class SlowPeersTest(BitcoinTestFramework):
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def setup_network(self):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir,
+                                 extra_args=[['-debug', '-whitelist=127.0.0.1'], []])
+
+    def run_test(self):
+        hashes = self.nodes[1].generatetoaddress(CHAIN_LENGTH, MINE_ADDRESS)
+        blocks = {}
+        headers = []
+        for h in hashes:
+            block = FromHex(CBlock(), self.nodes[1].getblock(h, False))
+            block.rehash()
+            blocks[block.sha256] = block
+            headers.append(CBlockHeader(block))
+
+        slow_node = BlockServer(blocks, False)
+        fast_node = BlockServer(blocks, True)
+        connections = []
+        connections.append(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], slow_node))
+        slow_node.add_connection(connections[0])
+        connections.append(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], fast_node))
+        fast_node.add_connection(connections[1])
+        NetworkThread().start()
+        slow_node.wait_for_verack()
+        fast_node.wait_for_verack()
+
+        # 1. The slow peer gets the first batch.
+        slow_node.announce(headers)
+        assert(wait_until(lambda: len(slow_node.requested) > 0, timeout=10))
+        with mininode_lock:
+            slow_requested = set(slow_node.requested)
+        print("Requested %d blocks from the slow peer" % len(slow_requested))
+        assert(len(slow_requested) < CHAIN_LENGTH)
+
+        # 2. The fast peer gets the rest and delivers it.
+        fast_node.announce(headers)
+        assert(wait_until(lambda: len(fast_node.requested) > 0, timeout=10))
+
+        # 3. The blocks stuck at the slow peer are fetched again from the fast one.
+        start = time.time()
+        assert(wait_until(lambda: self.nodes[0].getblockcount() == CHAIN_LENGTH, timeout=30))
+        print("Synced %d blocks %.1fs after the fast peer connected" % (CHAIN_LENGTH, time.time() - start))
+        assert_equal(self.nodes[0].getbestblockhash(), hashes[-1])
+        with mininode_lock:
+            assert(slow_requested.issubset(fast_node.requested))
+
+        # Both peers are still connected, and the fast one has measured download stats.
+        peers = self.nodes[0].getpeerinfo()
+        assert_equal(len(peers), 2)
+        fast_peer = [p for p in peers if p['blockinterval'] > 0]
+        assert_equal(len(fast_peer), 1)
+        assert(fast_peer[0]['blockquota'] >= 2)
+        assert(fast_peer[0]['blockthroughput'] > 0)
+
+        [c.disconnect_node() for c in connections]
+
+if __name__ == '__main__':
+    SlowPeersTest().main()
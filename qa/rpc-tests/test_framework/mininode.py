@@ -39,7 +39,7 @@ import copy
 from test_framework.siphash import siphash256
 
 BIP0031_VERSION = 60000
-MY_VERSION = 110014  # past bip-31 for ping/pong
+MY_VERSION = 110015  # past bip-31 for ping/pong
 MY_SUBVERSION = b"/python-mininode-tester:0.0.3/"
 
 MAX_INV_SZ = 50000
@@ -1480,6 +1480,85 @@ class msg_blocktxn(object):
     def __repr__(self):
         return "msg_blocktxn(block_transactions=%s)" % (repr(self.block_transactions))
 
+# Salted short transaction ids, as used by shorttxinv and getshorttx
+def get_shorttx_siphash_keys(salt):
+    salt_hash = sha256(struct.pack("<Q", salt))
+    key0 = struct.unpack("<Q", salt_hash[0:8])[0]
+    key1 = struct.unpack("<Q", salt_hash[8:16])[0]
+    return [key0, key1]
+
+class ShortTxIDs(object):
+    def __init__(self, shortids=None):
+        self.shortids = shortids if shortids is not None else []
+
+    def deserialize(self, f):
+        self.shortids = []
+        for i in range(deser_compact_size(f)):
+            # shortids are defined to be 6 bytes in the spec, so append
+            # two zero bytes and read it in as an 8-byte number
+            self.shortids.append(struct.unpack("<Q", f.read(6) + b'\x00\x00')[0])
+
+    def serialize(self):
+        r = b""
+        r += ser_compact_size(len(self.shortids))
+        for x in self.shortids:
+            # We only want the first 6 bytes
+            r += struct.pack("<Q", x)[0:6]
+        return r
+
+    def __repr__(self):
+        return "ShortTxIDs(shortids=%s)" % repr(self.shortids)
+
+class msg_sendshorttx(object):
+    command = b"sendshorttx"
+
+    def __init__(self, salt=0):
+        self.version = 1
+        self.salt = salt
+
+    def deserialize(self, f):
+        self.version = struct.unpack("<Q", f.read(8))[0]
+        self.salt = struct.unpack("<Q", f.read(8))[0]
+
+    def serialize(self):
+        r = b""
+        r += struct.pack("<Q", self.version)
+        r += struct.pack("<Q", self.salt)
+        return r
+
+    def __repr__(self):
+        return "msg_sendshorttx(version=%lu, salt=%016x)" % (self.version, self.salt)
+
+class msg_shorttxinv(object):
+    command = b"shorttxinv"
+
+    def __init__(self, shortids=None):
+        self.shorttxids = ShortTxIDs(shortids)
+
+    def deserialize(self, f):
+        self.shorttxids.deserialize(f)
+
+    def serialize(self):
+        return self.shorttxids.serialize()
+
+    def __repr__(self):
+        return "msg_shorttxinv(%s)" % repr(self.shorttxids)
+
+class msg_getshorttx(object):
+    command = b"getshorttx"
+
+    def __init__(self, shortids=None):
+        self.shorttxids = ShortTxIDs(shortids)
+
+    def deserialize(self, f):
+        self.shorttxids.deserialize(f)
+
+    def serialize(self):
+        return self.shorttxids.serialize()
+
+    def __repr__(self):
+        return "msg_getshorttx(%s)" % repr(self.shorttxids)
+
 # This is what a callback should look like for NodeConn
 # Reimplement the on_* functions to provide handling for events
 class NodeConnCB(object):
@@ -1564,6 +1643,9 @@ class NodeConnCB(object):
     def on_cmpctblock(self, conn, message): pass
     def on_getblocktxn(self, conn, message): pass
     def on_blocktxn(self, conn, message): pass
+    def on_sendshorttx(self, conn, message): pass
+    def on_shorttxinv(self, conn, message): pass
+    def on_getshorttx(self, conn, message): pass
 
 # More useful callbacks and functions for NodeConnCB's which have a single NodeConn
 class SingleNodeConnCB(NodeConnCB):
@@ -1621,7 +1703,10 @@ class NodeConn(asyncore.dispatcher):
         b"sendcmpct": msg_sendcmpct,
         b"cmpctblock": msg_cmpctblock,
         b"getblocktxn": msg_getblocktxn,
-        b"blocktxn": msg_blocktxn
+        b"blocktxn": msg_blocktxn,
+        b"sendshorttx": msg_sendshorttx,
+        b"shorttxinv": msg_shorttxinv,
+        b"getshorttx": msg_getshorttx
     }
     MAGIC_BYTES = {
         "mainnet": b"\xf9\xbe\xb4\xd9",   # mainnet
@@ -0,0 +1,85 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bloom.h"
+#include "merkleblock.h"
+#include "random.h"
+
+#include <limits>
+#include <vector>
+
+static const int FILTERED_PEERS = 500;
+
+static std::vector<unsigned char> RandomBytes(size_t nSize)
+{
+    std::vector<unsigned char> vch(nSize);
+    GetRandBytes(vch.data(), vch.size());
+    return vch;
+}
+
+/** A block of 2000 transactions spending two outputs each to two pubkey hashes. */
+static CBlock MakeFilteredBlock()
+{
+    CBlock block;
+    for (int i = 0; i < 2000; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            tx.vin[j].scriptSig = CScript() << RandomBytes(72) << RandomBytes(33);
+        }
+        tx.vout.resize(2);
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << RandomBytes(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+            tx.vout[j].nValue = COIN;
+        }
+        block.vtx.push_back(CTransaction(tx));
+    }
+    return block;
+}
+
+/** Filters of SPV wallets with 20 keys each, at a typical light client false positive rate. */
+static std::vector<CBloomFilter> MakeFilters()
+{
+    std::vector<CBloomFilter> vFilters;
+    for (int i = 0; i < FILTERED_PEERS; i++) {
+        CBloomFilter filter(40, 0.0005, GetRand(std::numeric_limits<unsigned int>::max()), BLOOM_UPDATE_P2PUBKEY_ONLY);
+        for (int j = 0; j < 20; j++) {
+            filter.insert(RandomBytes(33));
+            filter.insert(RandomBytes(20));
+        }
+        vFilters.push_back(filter);
+    }
+    return vFilters;
+}
+
+// Every peer's filter parses every transaction of the block again.
+static void FilteredBlockPerFilter(benchmark::State& state)
+{
+    CBlock block = MakeFilteredBlock();
+    std::vector<CBloomFilter> vFilters = MakeFilters();
+    while (state.KeepRunning()) {
+        for (CBloomFilter& filter : vFilters)
+            CMerkleBlock merkleBlock(block, filter);
+    }
+}
+
+// The block's transactions are parsed once, and the elements shared by all filters.
+static void FilteredBlockShared(benchmark::State& state)
+{
+    CBlock block = MakeFilteredBlock();
+    std::vector<CBloomFilter> vFilters = MakeFilters();
+    while (state.KeepRunning()) {
+        std::vector<CBloomTxElements> vTxElements;
+        vTxElements.reserve(block.vtx.size());
+        for (const CTransaction& tx : block.vtx)
+            vTxElements.push_back(CBloomTxElements(tx));
+        for (CBloomFilter& filter : vFilters)
+            CMerkleBlock merkleBlock(block, filter, vTxElements);
+    }
+}
+
+BENCHMARK(FilteredBlockPerFilter);
+BENCHMARK(FilteredBlockShared);
@@ -0,0 +1,87 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "checkqueue.h"
+#include "crypto/sha256.h"
+#include "util.h"
+
+#include <iostream>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// About the number of inputs in a full block, added two per transaction
+static const size_t BLOCK_CHECKS = 5000;
+static const size_t CHECKS_PER_TX = 2;
+
+/** Stands in for a script check: hashes a buffer nRounds times. */
+struct SyntheticCheck
+{
+    unsigned int nRounds;
+
+    SyntheticCheck(unsigned int nRoundsIn = 0) : nRounds(nRoundsIn) {}
+
+    bool operator()()
+    {
+        unsigned char buf[64] = {0};
+        for (unsigned int i = 0; i < nRounds; i++)
+            CSHA256().Write(buf, sizeof(buf)).Finalize(buf);
+        return true;
+    }
+
+    void swap(SyntheticCheck& check) { std::swap(nRounds, check.nRounds); }
+};
+
+typedef CCheckQueue<SyntheticCheck> SyntheticCheckQueue;
+
+static void RunBlocks(benchmark::State& state, const char* pszName, unsigned int nRounds)
+{
+    int nWorkers = std::max(2, GetNumCores()) - 1;
+    SyntheticCheckQueue queue(128, nWorkers + 1);
+    boost::thread_group threads;
+    for (int i = 0; i < nWorkers; i++)
+        threads.create_thread(boost::bind(&SyntheticCheckQueue::Thread, &queue));
+
+    uint64_t nBlocks = 0;
+    while (state.KeepRunning()) {
+        CCheckQueueControl<SyntheticCheck> control(&queue);
+        for (size_t i = 0; i < BLOCK_CHECKS; i += CHECKS_PER_TX) {
+            std::vector<SyntheticCheck> vChecks(CHECKS_PER_TX, SyntheticCheck(nRounds));
+            control.Add(vChecks);
+        }
+        control.Wait();
+        nBlocks++;
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+
+    std::vector<CCheckQueueWorkerStats> vStats = queue.GetWorkerStats();
+    int64_t nIdleMicros = 0;
+    uint64_t nSteals = 0;
+    for (size_t i = 1; i < vStats.size(); i++) {
+        nIdleMicros += vStats[i].nIdleMicros;
+        nSteals += vStats[i].nSteals;
+    }
+    if (nBlocks > 0 && vStats.size() > 1)
+        std::cout << "# " << pszName << ": " << nWorkers << " workers, " << 0.001 * nIdleMicros / nBlocks / (vStats.size() - 1)
+                  << " ms idle per worker and " << (double)nSteals / nBlocks << " steals per block\n";
+}
+
+// Checks that cost next to nothing, so that the queue's own overhead dominates
+static void CheckQueueOverhead(benchmark::State& state)
+{
+    RunBlocks(state, "CheckQueueOverhead", 0);
+}
+
+// Checks of about the cost of a signature verification
+static void CheckQueueSignatureSized(benchmark::State& state)
+{
+    RunBlocks(state, "CheckQueueSignatureSized", 100);
+}
+
+BENCHMARK(CheckQueueOverhead);
+BENCHMARK(CheckQueueSignatureSized);
@@ -51,6 +51,65 @@ static void SHA256_32b(benchmark::State& state)
     }
 }
 
+/* Run the body with the named SHA-256 implementation selected, or report that this CPU lacks it */
+static bool UseSHA256(benchmark::State& state, const std::string& name)
+{
+    if (SHA256AutoDetect(name) == name)
+        return true;
+    std::cout << "# SHA256 implementation '" << name << "' is not available on this CPU\n";
+    while (state.KeepRunning()) {}
+    SHA256AutoDetect();
+    return false;
+}
+
+static void SHA256Implementation(benchmark::State& state, const std::string& name)
+{
+    if (!UseSHA256(state, name))
+        return;
+    uint8_t hash[CSHA256::OUTPUT_SIZE];
+    std::vector<uint8_t> in(BUFFER_SIZE,0);
+    while (state.KeepRunning())
+        CSHA256().Write(begin_ptr(in), in.size()).Finalize(hash);
+    SHA256AutoDetect();
+}
+
+/* Double SHA-256 of 1024 64-byte inputs at once, as when hashing a level of a merkle tree */
+static void SHA256D64Implementation(benchmark::State& state, const std::string& name)
+{
+    if (!UseSHA256(state, name))
+        return;
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 10; i++)
+            SHA256D64(begin_ptr(in), begin_ptr(in), 1024);
+    }
+    SHA256AutoDetect();
+}
+
+static void SHA256_standard(benchmark::State& state) { SHA256Implementation(state, "standard"); }
+static void SHA256_shani(benchmark::State& state) { SHA256Implementation(state, "shani"); }
+static void SHA256D64_1024_standard(benchmark::State& state) { SHA256D64Implementation(state, "standard"); }
+static void SHA256D64_1024_shani(benchmark::State& state) { SHA256D64Implementation(state, "shani"); }
+static void SHA256D64_1024_sse41(benchmark::State& state) { SHA256D64Implementation(state, "sse41"); }
+static void SHA256D64_1024_avx2(benchmark::State& state) { SHA256D64Implementation(state, "avx2"); }
+
+/* Hash160 of 1000 compressed public keys, one at a time and batched */
+static void Hash160_33b_Single(benchmark::State& state)
+{
+    std::vector<std::vector<unsigned char> > vKeys(1000, std::vector<unsigned char>(33, 2));
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vKeys.size(); i++)
+            Hash160(vKeys[i]);
+    }
+}
+
+static void Hash160_33b_Batch(benchmark::State& state)
+{
+    std::vector<std::vector<unsigned char> > vKeys(1000, std::vector<unsigned char>(33, 2));
+    while (state.KeepRunning())
+        Hash160Many(vKeys);
+}
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -75,4 +134,12 @@ BENCHMARK(SHA256);
 BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
+BENCHMARK(SHA256_standard);
+BENCHMARK(SHA256_shani);
+BENCHMARK(SHA256D64_1024_standard);
+BENCHMARK(SHA256D64_1024_shani);
+BENCHMARK(SHA256D64_1024_sse41);
+BENCHMARK(SHA256D64_1024_avx2);
 BENCHMARK(SipHash_32b);
+BENCHMARK(Hash160_33b_Single);
+BENCHMARK(Hash160_33b_Batch);
@@ -0,0 +1,99 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "cuckoocache.h"
+#include "random.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_set.hpp>
+
+static const int CACHE_THREADS = 4;
+static const size_t OPS_PER_THREAD = 20000;
+static const size_t CACHE_BYTES = 32 << 20;
+
+/** The signature cache before CCuckooCache: an unordered_set behind a shared mutex, capped by random eviction. */
+class LockedSetCache
+{
+    struct Hasher
+    {
+        size_t operator()(const uint256& key) const { return key.GetCheapHash(); }
+    };
+    typedef boost::unordered_set<uint256, Hasher> map_type;
+    map_type setValid;
+    boost::shared_mutex cs;
+    size_t nMaxEntries;
+
+public:
+    explicit LockedSetCache(size_t nMaxEntriesIn) : nMaxEntries(nMaxEntriesIn) {}
+
+    bool contains(const uint256& entry, bool fErase)
+    {
+        if (fErase) {
+            boost::unique_lock<boost::shared_mutex> lock(cs);
+            return setValid.erase(entry);
+        }
+        boost::shared_lock<boost::shared_mutex> lock(cs);
+        return setValid.count(entry);
+    }
+
+    void insert(const uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        while (setValid.size() >= nMaxEntries) {
+            map_type::size_type s = GetRand(setValid.bucket_count());
+            map_type::local_iterator it = setValid.begin(s);
+            if (it != setValid.end(s))
+                setValid.erase(*it);
+        }
+        setValid.insert(entry);
+    }
+};
+
+/** Per thread: one insert of a new entry for every three lookups of earlier ones, as script checks of new transactions do. */
+template <typename Cache>
+static void CacheWorker(Cache* pcache, const std::vector<uint256>* pvEntries, size_t nBegin)
+{
+    for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+        const uint256& entry = (*pvEntries)[nBegin + i];
+        if (i % 4 == 0)
+            pcache->insert(entry);
+        else
+            pcache->contains((*pvEntries)[nBegin + i / 2], false);
+    }
+}
+
+template <typename Cache>
+static void RunCacheThreads(benchmark::State& state, Cache& cache)
+{
+    std::vector<uint256> vEntries(CACHE_THREADS * OPS_PER_THREAD);
+    for (size_t i = 0; i < vEntries.size(); i++)
+        vEntries[i] = GetRandHash();
+    while (state.KeepRunning()) {
+        boost::thread_group threads;
+        for (int i = 0; i < CACHE_THREADS; i++)
+            threads.create_thread(boost::bind(&CacheWorker<Cache>, &cache, &vEntries, i * OPS_PER_THREAD));
+        threads.join_all();
+    }
+}
+
+static void SigCacheCuckoo(benchmark::State& state)
+{
+    CCuckooCache cache;
+    cache.setup_bytes(CACHE_BYTES);
+    RunCacheThreads(state, cache);
+}
+
+static void SigCacheLockedSet(benchmark::State& state)
+{
+    // About the number of entries the old cache fit in the same memory
+    LockedSetCache cache(CACHE_BYTES / 80);
+    RunCacheThreads(state, cache);
+}
+
+BENCHMARK(SigCacheCuckoo);
+BENCHMARK(SigCacheLockedSet);
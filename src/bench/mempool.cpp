@@ -0,0 +1,191 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "policy/policy.h"
+#include "txmempool.h"
+
+#include <iostream>
+#include <list>
+#include <vector>
+
+static void AddTx(const CTransaction& tx, const CAmount& nFee, CTxMemPool& pool)
+{
+    int64_t nTime = 0;
+    double dPriority = 10.0;
+    unsigned int nHeight = 1;
+    bool spendsCoinbase = false;
+    unsigned int sigOpCost = 4;
+    LockPoints lp;
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(
+                                        tx, nFee, nTime, dPriority, nHeight, pool.HasNoInputsOf(tx),
+                                        0, spendsCoinbase, sigOpCost, lp));
+}
+
+static CMutableTransaction SpendOutputs(const std::vector<COutPoint>& prevouts, unsigned int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(prevouts.size());
+    for (unsigned int i = 0; i < prevouts.size(); i++) {
+        tx.vin[i].prevout = prevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_1;
+    }
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[i].nValue = COIN;
+    }
+    return tx;
+}
+
+// A single chain of transactions, each spending the previous one. Adding
+// the tip walks every ancestor; confirming the root walks every descendant.
+static void MempoolDeepChain(benchmark::State& state)
+{
+    const unsigned int nChainLength = 500;
+    std::vector<CTransaction> vtx;
+    vtx.reserve(nChainLength);
+    uint256 prevHash = uint256S("0x01");
+    for (unsigned int i = 0; i < nChainLength; i++) {
+        vtx.push_back(SpendOutputs(std::vector<COutPoint>(1, COutPoint(prevHash, 0)), 1));
+        prevHash = vtx.back().GetHash();
+    }
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            AddTx(vtx[i], 1000, pool);
+        std::vector<std::shared_ptr<const CTransaction> > conflicts;
+        pool.removeForBlock(std::vector<CTransaction>(1, vtx[0]), 2, conflicts, false);
+        std::list<CTransaction> removed;
+        pool.removeRecursive(vtx[1], removed);
+    }
+}
+
+// One parent fanning out to many children which are all spent again by a
+// single transaction, so every child is reachable along many paths.
+static void MempoolWideFanout(benchmark::State& state)
+{
+    const unsigned int nWidth = 1000;
+    std::vector<CTransaction> vtx;
+    vtx.reserve(nWidth + 2);
+    vtx.push_back(SpendOutputs(std::vector<COutPoint>(1, COutPoint(uint256S("0x01"), 0)), nWidth));
+    const uint256 parentHash = vtx[0].GetHash();
+    std::vector<COutPoint> childOutputs;
+    for (unsigned int i = 0; i < nWidth; i++) {
+        vtx.push_back(SpendOutputs(std::vector<COutPoint>(1, COutPoint(parentHash, i)), 1));
+        childOutputs.push_back(COutPoint(vtx.back().GetHash(), 0));
+    }
+    vtx.push_back(SpendOutputs(childOutputs, 1));
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            AddTx(vtx[i], 1000, pool);
+        std::vector<std::shared_ptr<const CTransaction> > conflicts;
+        pool.removeForBlock(std::vector<CTransaction>(1, vtx[0]), 2, conflicts, false);
+        std::list<CTransaction> removed;
+        pool.removeRecursive(vtx[1], removed);
+    }
+}
+
+// Keep a full mempool at the default -maxmempool size and push a spam wave
+// of better-paying transactions through it, so every iteration evicts
+// roughly as much as it adds.
+static void MempoolTrimToSize(benchmark::State& state)
+{
+    const size_t nSizeLimit = DEFAULT_MAX_MEMPOOL_SIZE * 1000000;
+    const unsigned int nWaveSize = 1000;
+    CTxMemPool pool(CFeeRate(1000));
+    uint64_t nCount = 0;
+
+    // Pad each transaction so the pool holds a realistic number of entries.
+    std::vector<unsigned char> vPadding(400, 0x42);
+    CMutableTransaction tx = SpendOutputs(std::vector<COutPoint>(1, COutPoint()), 1);
+    tx.vin[0].scriptSig = CScript() << vPadding;
+    while (pool.DynamicMemoryUsage() < nSizeLimit) {
+        tx.vin[0].prevout = COutPoint(ArithToUint256(arith_uint256(++nCount)), 0);
+        AddTx(tx, 1000 + (nCount * 7919) % 10000, pool);
+    }
+
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < nWaveSize; i++) {
+            tx.vin[0].prevout = COutPoint(ArithToUint256(arith_uint256(++nCount)), 0);
+            AddTx(tx, 5000 + (nCount * 7919) % 10000, pool);
+        }
+        pool.TrimToSize(nSizeLimit);
+    }
+}
+
+// Connect a block confirming half of a pool of independent transactions,
+// where one in ten of the block's transactions double-spends a mempool
+// entry with a child of its own.
+static void MempoolRemoveForBlock(benchmark::State& state)
+{
+    const unsigned int nBlockSize = 1000;
+    std::vector<CTransaction> vPool;
+    std::vector<CTransaction> vBlock;
+    for (unsigned int i = 0; i < nBlockSize; i++) {
+        const COutPoint prevout(ArithToUint256(arith_uint256(i + 1)), 0);
+        CMutableTransaction tx = SpendOutputs(std::vector<COutPoint>(1, prevout), 1);
+        if (i % 10 == 0) {
+            // Pool gets a spend and its child; the block a double-spend
+            vPool.push_back(tx);
+            vPool.push_back(SpendOutputs(std::vector<COutPoint>(1, COutPoint(tx.GetHash(), 0)), 1));
+            tx.vout[0].nValue -= 1000;
+            vBlock.push_back(tx);
+        } else {
+            vPool.push_back(tx);
+            vBlock.push_back(tx);
+            const COutPoint other(ArithToUint256(arith_uint256(i + 1 + nBlockSize)), 0);
+            vPool.push_back(SpendOutputs(std::vector<COutPoint>(1, other), 1));
+        }
+    }
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        for (unsigned int i = 0; i < vPool.size(); i++)
+            AddTx(vPool[i], 1000, pool);
+        std::vector<std::shared_ptr<const CTransaction> > conflicts;
+        pool.removeForBlock(vBlock, 2, conflicts, true);
+        assert(conflicts.size() == 2 * nBlockSize / 10);
+    }
+}
+
+// Fill a pool with typical one-input, two-output transactions, half of
+// which spend an output of the transaction before them, and report the
+// mempool's accounted memory per transaction.
+static void MempoolMemoryUsage(benchmark::State& state)
+{
+    const unsigned int nTxCount = 5000;
+    std::vector<CTransaction> vtx;
+    vtx.reserve(nTxCount);
+    for (unsigned int i = 0; i < nTxCount; i++) {
+        COutPoint prevout(ArithToUint256(arith_uint256(i + 1)), 0);
+        if (i % 2 == 1)
+            prevout = COutPoint(vtx.back().GetHash(), 1);
+        CMutableTransaction tx = SpendOutputs(std::vector<COutPoint>(1, prevout), 2);
+        // Signature and public key pushes of a P2PKH spend, P2PKH outputs
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, j) << OP_EQUALVERIFY << OP_CHECKSIG;
+        vtx.push_back(tx);
+    }
+
+    size_t nUsagePerTx = 0;
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            AddTx(vtx[i], 1000, pool);
+        nUsagePerTx = pool.DynamicMemoryUsage() / pool.size();
+    }
+    std::cout << "# MempoolMemoryUsage: " << nUsagePerTx << " bytes/tx\n";
+}
+
+BENCHMARK(MempoolDeepChain);
+BENCHMARK(MempoolWideFanout);
+BENCHMARK(MempoolTrimToSize);
+BENCHMARK(MempoolRemoveForBlock);
+BENCHMARK(MempoolMemoryUsage);
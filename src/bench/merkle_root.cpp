@@ -0,0 +1,56 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "consensus/merkle.h"
+#include "primitives/block.h"
+#include "random.h"
+
+// About a full block of two-input, two-output P2WPKH spends
+static const unsigned int BLOCK_TXS = 2500;
+
+static CBlock MakeWitnessBlock()
+{
+    CBlock block;
+    for (unsigned int i = 0; i < BLOCK_TXS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        tx.wit.vtxinwit.resize(2);
+        for (unsigned int j = 0; j < 2; j++) {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            tx.wit.vtxinwit[j].scriptWitness.stack.push_back(std::vector<unsigned char>(72, 0x30));
+            tx.wit.vtxinwit[j].scriptWitness.stack.push_back(std::vector<unsigned char>(33, 0x02));
+        }
+        tx.vout.resize(2);
+        for (unsigned int j = 0; j < 2; j++) {
+            tx.vout[j].nValue = 1000000;
+            tx.vout[j].scriptPubKey = CScript() << OP_0 << std::vector<unsigned char>(20, j);
+        }
+        block.vtx.push_back(CTransaction(tx));
+    }
+    return block;
+}
+
+// The witness merkle root, with the wtxids cached in the transactions
+static void WitnessMerkleRoot(benchmark::State& state)
+{
+    CBlock block = MakeWitnessBlock();
+    while (state.KeepRunning()) {
+        bool fMutated;
+        BlockWitnessMerkleRoot(block, &fMutated);
+    }
+}
+
+// Computing the txids and wtxids of all transactions, as deserializing the block does
+static void BlockTxHashes(benchmark::State& state)
+{
+    CBlock block = MakeWitnessBlock();
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            block.vtx[i].UpdateHash();
+    }
+}
+
+BENCHMARK(WitnessMerkleRoot);
+BENCHMARK(BlockTxHashes);
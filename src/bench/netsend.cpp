@@ -0,0 +1,132 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "net.h"
+#include "primitives/block.h"
+#include "protocol.h"
+#include "utiltime.h"
+
+#include <iostream>
+#include <vector>
+
+#include <sys/socket.h>
+
+/** A block of about 400kB of simple transactions. */
+static CBlock MakeServedBlock()
+{
+    CBlock block;
+    uint256 hashPrev;
+    for (int i = 0; i < 2000; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(hashPrev, 0);
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+        tx.vout.resize(2);
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+            tx.vout[j].nValue = COIN;
+        }
+        block.vtx.push_back(CTransaction(tx));
+        hashPrev = block.vtx.back().GetHash();
+    }
+    return block;
+}
+
+/** Peers on local stream sockets, drained as fast as we can send to them. */
+struct ServedPeers
+{
+    std::vector<CNode*> vNodes;
+    std::vector<SOCKET> vRemote;
+
+    explicit ServedPeers(int nPeers)
+    {
+        in_addr ipv4Addr;
+        ipv4Addr.s_addr = htonl(INADDR_LOOPBACK);
+        CAddress addr(CService(ipv4Addr, 8333), NODE_NETWORK);
+        for (int i = 0; i < nPeers; i++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                break;
+            vRemote.push_back(fds[1]);
+            vNodes.push_back(new CNode(i, NODE_NETWORK, 0, fds[0], addr, 0, "", true));
+            vNodes.back()->ssSend.SetVersion(PROTOCOL_VERSION);
+        }
+    }
+
+    ~ServedPeers()
+    {
+        for (size_t i = 0; i < vNodes.size(); i++) {
+            delete vNodes[i];
+            CloseSocket(vRemote[i]);
+        }
+    }
+
+    /** Flush every send queue to the other side. */
+    void Flush()
+    {
+        static char buf[0x10000];
+        bool fPending = true;
+        while (fPending) {
+            fPending = false;
+            for (size_t i = 0; i < vNodes.size(); i++) {
+                {
+                    LOCK(vNodes[i]->cs_vSend);
+                    SocketSendData(vNodes[i]);
+                    fPending |= vNodes[i]->nSendSize > 0;
+                }
+                while (recv(vRemote[i], buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+            }
+        }
+    }
+
+    uint64_t BytesSent() const
+    {
+        uint64_t nBytes = 0;
+        for (size_t i = 0; i < vNodes.size(); i++)
+            nBytes += vNodes[i]->nSendBytes;
+        return nBytes;
+    }
+};
+
+static void ReportThroughput(const char* pszName, const ServedPeers& peers, int64_t nTimeUsec)
+{
+    if (nTimeUsec > 0)
+        std::cout << "# " << pszName << ": " << peers.BytesSent() / nTimeUsec << " MB/s\n";
+}
+
+// Every peer gets its own copy of the block, serialized from scratch.
+static void ServeBlockPerPeer(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    CBlock block = MakeServedBlock();
+    ServedPeers peers(8);
+    int64_t nStart = GetTimeMicros();
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < peers.vNodes.size(); i++)
+            peers.vNodes[i]->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+        peers.Flush();
+    }
+    ReportThroughput("ServeBlockPerPeer", peers, GetTimeMicros() - nStart);
+}
+
+// The block is serialized once and the same buffer is queued to every peer.
+static void ServeBlockShared(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    CBlock block = MakeServedBlock();
+    ServedPeers peers(8);
+    int64_t nStart = GetTimeMicros();
+    while (state.KeepRunning()) {
+        CSendBufferRef msg = SerializeNetMessage(PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+        for (size_t i = 0; i < peers.vNodes.size(); i++)
+            peers.vNodes[i]->PushSerializedMessage(NetMsgType::BLOCK, msg);
+        peers.Flush();
+    }
+    ReportThroughput("ServeBlockShared", peers, GetTimeMicros() - nStart);
+}
+
+BENCHMARK(ServeBlockPerPeer);
+BENCHMARK(ServeBlockShared);
@@ -0,0 +1,54 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+
+// A consolidation transaction, as sweeps produce
+static const unsigned int SWEEP_INPUTS = 500;
+
+static CTransaction MakeSweep(CScript& scriptCode)
+{
+    scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x42) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.vin.resize(SWEEP_INPUTS);
+    for (unsigned int i = 0; i < SWEEP_INPUTS; i++) {
+        tx.vin[i].prevout = COutPoint(GetRandHash(), i % 4);
+        // About the size of a P2PKH signature and public key
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1000000;
+    tx.vout[0].scriptPubKey = scriptCode;
+    return CTransaction(tx);
+}
+
+// The signature hashes of all inputs, each serialized from scratch
+static void SighashLegacySweep(benchmark::State& state)
+{
+    CScript scriptCode;
+    CTransaction tx = MakeSweep(scriptCode);
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    }
+}
+
+// The same, including the setup of the precomputed data as CheckInputs does it
+static void SighashLegacySweepPrecomputed(benchmark::State& state)
+{
+    CScript scriptCode;
+    CTransaction tx = MakeSweep(scriptCode);
+    while (state.KeepRunning()) {
+        PrecomputedTransactionData txdata(tx);
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL, 0, SIGVERSION_BASE, &txdata);
+    }
+}
+
+BENCHMARK(SighashLegacySweep);
+BENCHMARK(SighashLegacySweepPrecomputed);
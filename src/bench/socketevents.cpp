@@ -0,0 +1,139 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "compat.h"
+#include "netbase.h"
+#include "util.h"
+
+#include <string.h>
+#include <vector>
+
+/** Loopback TCP connections standing in for connected peers. */
+struct LoopbackPeers
+{
+    std::vector<SOCKET> vRemote; // the peers' ends
+    std::vector<SOCKET> vLocal;  // our ends, as the socket handler sees them
+
+    explicit LoopbackPeers(int nPeers)
+    {
+        RaiseFileDescriptorLimit(2 * nPeers + 64);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (bind(hListen, (struct sockaddr*)&addr, len) == SOCKET_ERROR ||
+            listen(hListen, SOMAXCONN) == SOCKET_ERROR ||
+            getsockname(hListen, (struct sockaddr*)&addr, &len) == SOCKET_ERROR) {
+            CloseSocket(hListen);
+            return;
+        }
+        for (int i = 0; i < nPeers; i++) {
+            SOCKET hRemote = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (connect(hRemote, (struct sockaddr*)&addr, len) == SOCKET_ERROR) {
+                CloseSocket(hRemote);
+                break;
+            }
+            SOCKET hLocal = accept(hListen, NULL, NULL);
+            if (hLocal == INVALID_SOCKET || !SetSocketNonBlocking(hLocal, true)) {
+                CloseSocket(hRemote);
+                break;
+            }
+            vRemote.push_back(hRemote);
+            vLocal.push_back(hLocal);
+        }
+        CloseSocket(hListen);
+    }
+
+    ~LoopbackPeers()
+    {
+        for (size_t i = 0; i < vRemote.size(); i++) {
+            CloseSocket(vRemote[i]);
+            CloseSocket(vLocal[i]);
+        }
+    }
+
+    /** Have the next peer in turn send us one byte. */
+    void Send(size_t& nNext)
+    {
+        char c = 0;
+        send(vRemote[nNext], &c, 1, MSG_NOSIGNAL);
+        nNext = (nNext + 1) % vRemote.size();
+    }
+};
+
+// The select() loop rebuilds and scans an fd_set covering every peer on each
+// wakeup. Descriptors must stay below FD_SETSIZE, which limits the peer count.
+static void SocketEventsSelect480(benchmark::State& state)
+{
+    LoopbackPeers peers(480);
+    if (peers.vLocal.empty())
+        return;
+    size_t nNext = 0;
+    while (state.KeepRunning()) {
+        peers.Send(nNext);
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        SOCKET hSocketMax = 0;
+        for (size_t i = 0; i < peers.vLocal.size(); i++) {
+            FD_SET(peers.vLocal[i], &fdsetRecv);
+            hSocketMax = std::max(hSocketMax, peers.vLocal[i]);
+        }
+        struct timeval timeout = MillisToTimeval(50);
+        select(hSocketMax + 1, &fdsetRecv, NULL, NULL, &timeout);
+        for (size_t i = 0; i < peers.vLocal.size(); i++) {
+            if (FD_ISSET(peers.vLocal[i], &fdsetRecv)) {
+                char c;
+                recv(peers.vLocal[i], &c, 1, MSG_DONTWAIT);
+            }
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// With epoll a wakeup only costs work for the sockets that became ready.
+static void SocketEventsEpoll(benchmark::State& state, int nPeers)
+{
+    LoopbackPeers peers(nPeers);
+    if (peers.vLocal.empty())
+        return;
+    CSocketEvents events;
+    for (size_t i = 0; i < peers.vLocal.size(); i++)
+        events.Add(peers.vLocal[i], &peers.vLocal[i]);
+    // Swallow the initial writability edges.
+    std::vector<CSocketEvents::Event> vEvents;
+    do {
+        events.Wait(vEvents, 0);
+    } while (!vEvents.empty());
+
+    size_t nNext = 0;
+    while (state.KeepRunning()) {
+        peers.Send(nNext);
+        events.Wait(vEvents, 50);
+        for (size_t i = 0; i < vEvents.size(); i++) {
+            if (vEvents[i].fRecv) {
+                char c;
+                recv(*static_cast<SOCKET*>(vEvents[i].ptr), &c, 1, MSG_DONTWAIT);
+            }
+        }
+    }
+}
+
+static void SocketEventsEpoll480(benchmark::State& state)
+{
+    SocketEventsEpoll(state, 480);
+}
+
+static void SocketEventsEpoll1000(benchmark::State& state)
+{
+    SocketEventsEpoll(state, 1000);
+}
+
+BENCHMARK(SocketEventsEpoll480);
+BENCHMARK(SocketEventsEpoll1000);
+#endif
+
+BENCHMARK(SocketEventsSelect480);
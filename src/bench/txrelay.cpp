@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "blockencodings.h"
+#include "chainparams.h"
+#include "main.h"
+#include "net.h"
+#include "protocol.h"
+#include "random.h"
+
+#include <iostream>
+#include <limits>
+#include <vector>
+
+/** A trickle's worth of transaction hashes. */
+static std::vector<uint256> MakeTrickle()
+{
+    std::vector<uint256> vHashes;
+    for (unsigned int i = 0; i < INVENTORY_BROADCAST_MAX; i++)
+        vHashes.push_back(GetRandHash());
+    return vHashes;
+}
+
+static void ReportBytesPerTx(const char* pszName, uint64_t nBytes, uint64_t nTxs)
+{
+    if (nTxs > 0)
+        std::cout << "# " << pszName << ": " << (double)nBytes / nTxs << " bytes/tx\n";
+}
+
+// Announce a trickle by full hash in an inv, and have the peer request all of it with a getdata.
+static void RelayTxInv(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<uint256> vHashes = MakeTrickle();
+    uint64_t nBytes = 0, nTxs = 0;
+    while (state.KeepRunning()) {
+        std::vector<CInv> vInv;
+        for (const uint256& hash : vHashes)
+            vInv.push_back(CInv(MSG_TX, hash));
+        nBytes += SerializeNetMessage(PROTOCOL_VERSION, NetMsgType::INV, vInv)->size();
+        nBytes += SerializeNetMessage(PROTOCOL_VERSION, NetMsgType::GETDATA, vInv)->size();
+        nTxs += vHashes.size();
+    }
+    ReportBytesPerTx("RelayTxInv", nBytes, nTxs);
+}
+
+// Announce the same trickle by salted short ids, and have the peer request all of it with a getshorttx.
+static void RelayTxShortIDs(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<uint256> vHashes = MakeTrickle();
+    uint64_t k0, k1;
+    TransactionShortIDs::GetShortIDKeys(GetRand(std::numeric_limits<uint64_t>::max()), k0, k1);
+    uint64_t nBytes = 0, nTxs = 0;
+    while (state.KeepRunning()) {
+        TransactionShortIDs shortInv;
+        for (const uint256& hash : vHashes)
+            shortInv.shorttxids.push_back(TransactionShortIDs::GetShortID(k0, k1, hash));
+        nBytes += SerializeNetMessage(PROTOCOL_VERSION, NetMsgType::SHORTTXINV, shortInv)->size();
+        nBytes += SerializeNetMessage(PROTOCOL_VERSION, NetMsgType::GETSHORTTX, shortInv)->size();
+        nTxs += vHashes.size();
+    }
+    ReportBytesPerTx("RelayTxShortIDs", nBytes, nTxs);
+}
+
+BENCHMARK(RelayTxInv);
+BENCHMARK(RelayTxShortIDs);
@@ -46,8 +46,24 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
 }
 
 
+void TransactionShortIDs::GetShortIDKeys(uint64_t salt, uint64_t& k0, uint64_t& k1) {
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << salt;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 shorttxidhash;
+    hasher.Finalize(shorttxidhash.begin());
+    k0 = shorttxidhash.GetUint64(0);
+    k1 = shorttxidhash.GetUint64(1);
+}
+
+uint64_t TransactionShortIDs::GetShortID(uint64_t k0, uint64_t k1, const uint256& txhash) {
+    static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids calculation assumes 6-byte shorttxids");
+    return SipHashUint256(k0, k1, txhash) & 0xffffffffffffL;
+}
 
-ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock) {
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > >& extra_txn) {
     if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
         return READ_STATUS_INVALID;
     if (cmpctblock.shorttxids.size() + cmpctblock.prefilledtxn.size() > MAX_BLOCK_BASE_SIZE / MIN_TRANSACTION_BASE_SIZE)
@@ -131,6 +147,33 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
             break;
     }
 
+    // Then look at recently seen transactions that didn't make it into (or were
+    // removed from) the mempool, which would otherwise cost a getblocktxn round trip.
+    std::vector<bool> from_extra(mempool_count < shorttxids.size() ? txn_available.size() : 0);
+    for (size_t i = 0; i < extra_txn.size() && mempool_count + extra_count < shorttxids.size(); i++) {
+        if (!extra_txn[i].second)
+            continue;
+        uint64_t shortid = cmpctblock.GetShortID(extra_txn[i].first);
+        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
+        if (idit != shorttxids.end()) {
+            if (!have_txn[idit->second]) {
+                txn_available[idit->second] = extra_txn[i].second;
+                have_txn[idit->second] = true;
+                from_extra[idit->second] = true;
+                extra_count++;
+            } else if (txn_available[idit->second] &&
+                       txn_available[idit->second]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
+                // Same as above, but a transaction seen both in the mempool and
+                // among the extra ones is not a collision.
+                txn_available[idit->second].reset();
+                if (from_extra[idit->second])
+                    extra_count--;
+                else
+                    mempool_count--;
+            }
+        }
+    }
+
     LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n", cmpctblock.header.GetHash().ToString(), cmpctblock.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
 
     return READ_STATUS_OK;
@@ -170,7 +213,7 @@ ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<
         return READ_STATUS_INVALID;
     }
 
-    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool and %lu txn requested\n", header.GetHash().ToString(), prefilled_count, mempool_count, vtx_missing.size());
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool, %lu txn from extra pool and %lu txn requested\n", header.GetHash().ToString(), prefilled_count, mempool_count, extra_count, vtx_missing.size());
     if (vtx_missing.size() < 5) {
         for(const CTransaction& tx : vtx_missing)
             LogPrint("cmpctblock", "Reconstructed block %s required tx %s\n", header.GetHash().ToString(), tx.GetHash().ToString());
@@ -85,22 +85,37 @@ void CBloomFilter::insert(const uint256& hash)
     insert(data);
 }
 
-bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const unsigned char* pData, size_t nDataLen) const
 {
     if (isFull)
         return true;
     if (isEmpty)
         return false;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    // Hash a few seeds at a time: most lookups miss, and stop at one of the first bits checked.
+    unsigned int vSeeds[MURMURHASH3_LANES];
+    unsigned int vHashes[MURMURHASH3_LANES];
+    for (unsigned int nStart = 0; nStart < nHashFuncs; nStart += MURMURHASH3_LANES)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Checks bit nIndex of vData
-        if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
-            return false;
+        unsigned int nLanes = min(nHashFuncs - nStart, MURMURHASH3_LANES);
+        for (unsigned int j = 0; j < nLanes; j++)
+            vSeeds[j] = (nStart + j) * 0xFBA4C795 + nTweak;
+        MurmurHash3Multi(vSeeds, nLanes, pData, nDataLen, vHashes);
+        for (unsigned int j = 0; j < nLanes; j++)
+        {
+            unsigned int nIndex = vHashes[j] % (vData.size() * 8);
+            // Checks bit nIndex of vData
+            if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
+                return false;
+        }
     }
     return true;
 }
 
+bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(vKey.data(), vKey.size());
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
@@ -111,8 +126,7 @@ bool CBloomFilter::contains(const COutPoint& outpoint) const
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.size());
 }
 
 void CBloomFilter::clear()
@@ -133,7 +147,58 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
+static void ExtractPushes(const CScript& script, CBloomTxElements::element_vector& vPushes)
+{
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            vPushes.push_back(data);
+    }
+}
+
+CBloomTxElements::CBloomTxElements(const CTransaction& tx) : hash(tx.GetHash())
+{
+    vOutputPushes.resize(tx.vout.size());
+    vOutputIsP2PubKey.resize(tx.vout.size());
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CScript& scriptPubKey = tx.vout[i].scriptPubKey;
+        ExtractPushes(scriptPubKey, vOutputPushes[i]);
+        if (!vOutputPushes[i].empty())
+        {
+            txnouttype type;
+            vector<vector<unsigned char> > vSolutions;
+            vOutputIsP2PubKey[i] = Solver(scriptPubKey, type, vSolutions) &&
+                    (type == TX_PUBKEY || type == TX_MULTISIG);
+        }
+    }
+
+    vPrevouts.reserve(tx.vin.size());
+    vInputPushes.resize(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << tx.vin[i].prevout;
+        vPrevouts.push_back(vector<unsigned char>(stream.begin(), stream.end()));
+        ExtractPushes(tx.vin[i].scriptSig, vInputPushes[i]);
+    }
+}
+
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& txElements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -142,37 +207,25 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         return true;
     if (isEmpty)
         return false;
-    const uint256& hash = tx.GetHash();
+    const uint256& hash = txElements.hash;
     if (contains(hash))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    for (unsigned int i = 0; i < txElements.vOutputPushes.size(); i++)
     {
-        const CTxOut& txout = tx.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        BOOST_FOREACH(const vector<unsigned char>& data, txElements.vOutputPushes[i])
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(data))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
                     insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
-                {
-                    txnouttype type;
-                    vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                            (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && txElements.vOutputIsP2PubKey[i])
+                    insert(COutPoint(hash, i));
                 break;
             }
         }
@@ -181,21 +234,16 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    for (unsigned int i = 0; i < txElements.vPrevouts.size(); i++)
     {
         // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        if (contains(txElements.vPrevouts[i]))
             return true;
 
         // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
+        BOOST_FOREACH(const vector<unsigned char>& data, txElements.vInputPushes[i])
         {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(data))
                 return true;
         }
     }
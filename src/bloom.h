@@ -6,12 +6,12 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
 #include <vector>
 
 class COutPoint;
 class CTransaction;
-class uint256;
 
 //! 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -30,6 +30,31 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that CBloomFilter::IsRelevantAndUpdate
+ * matches against: the txid, the data pushes of every scriptPubKey and
+ * scriptSig, and the outpoints spent. Extracting them does not depend on the
+ * filter, so a transaction checked against many peers' filters is only parsed
+ * once.
+ */
+class CBloomTxElements
+{
+public:
+    typedef std::vector<std::vector<unsigned char> > element_vector;
+
+    uint256 hash;
+    //! Non-empty pushes of each output's scriptPubKey, up to the first invalid opcode
+    std::vector<element_vector> vOutputPushes;
+    //! Whether each output pays to a pubkey or bare multisig, for BLOOM_UPDATE_P2PUBKEY_ONLY
+    std::vector<bool> vOutputIsP2PubKey;
+    //! Serialized prevout of each input
+    element_vector vPrevouts;
+    //! Non-empty pushes of each input's scriptSig, up to the first invalid opcode
+    std::vector<element_vector> vInputPushes;
+
+    explicit CBloomTxElements(const CTransaction& tx);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -52,6 +77,7 @@ private:
     unsigned char nFlags;
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    bool contains(const unsigned char* pData, size_t nDataLen) const;
 
     // Private constructor for CRollingBloomFilter, no restrictions on size
     CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
@@ -97,6 +123,8 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    //! Same as above, with the transaction's elements extracted beforehand
+    bool IsRelevantAndUpdate(const CBloomTxElements& txElements);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
@@ -5,7 +5,12 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <memory>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -16,21 +21,57 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/** Counters of one CCheckQueue worker, cumulative since the queue was created. */
+struct CCheckQueueWorkerStats
+{
+    //! Verifications performed
+    uint64_t nChecks;
+    //! Batches taken from other workers' queues
+    uint64_t nSteals;
+    //! Time spent waiting for work while a batch of verifications was in progress
+    int64_t nIdleMicros;
+
+    CCheckQueueWorkerStats() : nChecks(0), nSteals(0), nIdleMicros(0) {}
+};
+
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
+  * operator(), returning a bool, and a swap().
   *
   * One thread (the master) is assumed to push batches of verifications
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker, and the master, has its own queue behind its own lock.
+  * The master hands out batches to the workers' queues in turn. Workers
+  * take work from the back of their own queue, and when it runs dry steal
+  * from the front of the others', so the shared lock is only taken to
+  * sleep and to wake up. Queues keep their capacity between blocks, so
+  * adding verifications does not allocate once they are warmed up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    /** One worker's verifications: the ones in [nBegin, vChecks.size()) are still to be done. */
+    struct WorkerQueue
+    {
+        boost::mutex mutex;
+        std::vector<T> vChecks;
+        size_t nBegin;
+
+        std::atomic<uint64_t> nChecks;
+        std::atomic<uint64_t> nSteals;
+        std::atomic<int64_t> nIdleMicros;
+        //! When the worker went to sleep, or 0 if it is awake; protected by the queue's shared mutex
+        int64_t nSleepingSince;
+
+        WorkerQueue() : nBegin(0), nChecks(0), nSteals(0), nIdleMicros(0), nSleepingSince(0) {}
+    };
+
+    //! Mutex to sleep and wake up on
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,25 +80,33 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! One queue per thread; the master's is the first
+    std::unique_ptr<WorkerQueue[]> vQueues;
+
+    //! The maximum number of threads (including the master)
+    const unsigned int nMaxThreads;
 
-    //! The number of workers (including the master) that are idle.
+    //! The number of worker threads (excluding the master) which took a queue
+    std::atomic<unsigned int> nWorkers;
+
+    //! The number of workers (excluding the master) waiting for work, protected by mutex
     int nIdle;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The queue the next call to Add() fills
+    unsigned int nNextQueue;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<int64_t> nTodo;
+
+    //! Number of verifications in queues, not yet taken by any thread
+    std::atomic<int64_t> nQueued;
 
     //! Whether we're shutting down.
     bool fQuit;
@@ -65,95 +114,204 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Times the master started adding work and finished waiting for it, for idle time accounting
+    std::atomic<bool> fInProgress;
+    std::atomic<int64_t> nStartMicros;
+    std::atomic<int64_t> nEndMicros;
+
+    unsigned int NumQueues() const
+    {
+        return 1 + nWorkers.load(std::memory_order_acquire);
+    }
+
+    /** Move up to nMax verifications from the back of queue into vBatch. */
+    static void TakeBack(WorkerQueue& queue, std::vector<T>& vBatch, size_t nMax)
+    {
+        size_t nNow = std::min(nMax, queue.vChecks.size() - queue.nBegin);
+        for (size_t i = 0; i < nNow; i++) {
+            vBatch.push_back(T());
+            vBatch.back().swap(queue.vChecks.back());
+            queue.vChecks.pop_back();
+        }
+        if (queue.nBegin == queue.vChecks.size()) {
+            queue.vChecks.clear();
+            queue.nBegin = 0;
+        }
+    }
+
+    /** Move up to nMax verifications from the front of queue into vBatch. */
+    static void TakeFront(WorkerQueue& queue, std::vector<T>& vBatch, size_t nMax)
+    {
+        size_t nNow = std::min(nMax, queue.vChecks.size() - queue.nBegin);
+        for (size_t i = 0; i < nNow; i++) {
+            vBatch.push_back(T());
+            vBatch.back().swap(queue.vChecks[queue.nBegin++]);
+        }
+        if (queue.nBegin == queue.vChecks.size()) {
+            queue.vChecks.clear();
+            queue.nBegin = 0;
+        }
+    }
+
+    /**
+     * Fill vBatch from the thread's own queue, or else from another one.
+     * Batches shrink with the amount of work left, so that all threads
+     * finish at about the same time.
+     */
+    bool TakeWork(unsigned int nSelf, unsigned int& nVictim, std::vector<T>& vBatch)
+    {
+        unsigned int nQueues = NumQueues();
+        {
+            WorkerQueue& own = vQueues[nSelf];
+            size_t nShare = std::max((int64_t)0, nQueued.load(std::memory_order_relaxed)) / (2 * nQueues);
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            if (own.vChecks.size() > own.nBegin) {
+                TakeBack(own, vBatch, std::max((size_t)1, std::min((size_t)nBatchSize, nShare)));
+                return true;
+            }
+        }
+        // Steal about half of what a victim has, starting where the last successful steal was
+        for (unsigned int i = 0; i < nQueues; i++, nVictim++) {
+            WorkerQueue& victim = vQueues[nVictim % nQueues];
+            if (&victim == &vQueues[nSelf])
+                continue;
+            boost::unique_lock<boost::mutex> lock(victim.mutex);
+            size_t nSize = victim.vChecks.size() - victim.nBegin;
+            if (nSize) {
+                TakeFront(victim, vBatch, std::max((size_t)1, std::min((size_t)nBatchSize, nSize / 2)));
+                vQueues[nSelf].nSteals.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Add the part of [nSince, nNow) during which the master had work outstanding to a worker's idle time. */
+    void AccountIdle(WorkerQueue& queue, int64_t nSince, int64_t nNow)
+    {
+        int64_t nFrom = std::max(nSince, nStartMicros.load(std::memory_order_relaxed));
+        int64_t nTo = fInProgress.load(std::memory_order_relaxed) ? nNow : std::min(nNow, nEndMicros.load(std::memory_order_relaxed));
+        if (nTo > nFrom)
+            queue.nIdleMicros.fetch_add(nTo - nFrom, std::memory_order_relaxed);
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nSelf)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
+        const bool fMaster = (nSelf == 0);
+        WorkerQueue& own = vQueues[nSelf];
+        std::vector<T> vBatch;
+        vBatch.reserve(nBatchSize);
+        unsigned int nVictim = nSelf + 1;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
+            if (TakeWork(nSelf, nVictim, vBatch)) {
+                int64_t nNow = vBatch.size();
+                nQueued.fetch_sub(nNow);
+                // Check whether we need to do work at all
+                bool fOk = fAllOk.load(std::memory_order_relaxed);
+                BOOST_FOREACH (T& check, vBatch)
+                    if (fOk)
+                        fOk = check();
+                if (!fOk)
+                    fAllOk.store(false);
+                own.nChecks.fetch_add(nNow, std::memory_order_relaxed);
+                vBatch.clear();
+                if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+                    // We processed the last element; inform the master it can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    condMaster.notify_one();
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster && nTodo.load() == 0) {
+                bool fRet = fAllOk.load();
+                // reset the status for new work later
+                fAllOk.store(true);
+                // Settle the idle time of workers still asleep, so that the counters are up to date on return
+                int64_t nEnd = GetTimeMicros();
+                for (unsigned int i = 1; i < NumQueues(); i++) {
+                    if (vQueues[i].nSleepingSince) {
+                        AccountIdle(vQueues[i], vQueues[i].nSleepingSince, nEnd);
+                        vQueues[i].nSleepingSince = nEnd;
                     }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                nEndMicros.store(nEnd, std::memory_order_relaxed);
+                fInProgress.store(false, std::memory_order_relaxed);
+                // return the current status
+                return fRet;
+            }
+            if (fQuit)
+                return false;
+            // Only sleep when there is nothing left to take; Add() wakes us under this lock
+            if (nQueued.load() > 0)
+                continue;
+            if (fMaster) {
+                condMaster.wait(lock);
+            } else {
+                own.nSleepingSince = GetTimeMicros();
+                nIdle++;
+                condWorker.wait(lock);
+                nIdle--;
+                AccountIdle(own, own.nSleepingSince, GetTimeMicros());
+                own.nSleepingSince = 0;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, with room for nMaxThreadsIn threads including the master
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxThreadsIn = 64) :
+        vQueues(new WorkerQueue[nMaxThreadsIn]), nMaxThreads(nMaxThreadsIn), nWorkers(0), nIdle(0), nNextQueue(0),
+        fAllOk(true), nTodo(0), nQueued(0), fQuit(false), nBatchSize(nBatchSizeIn),
+        fInProgress(false), nStartMicros(0), nEndMicros(0)
+    {
+        assert(nMaxThreads >= 1);
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        unsigned int nSelf = nWorkers.fetch_add(1) + 1;
+        assert(nSelf < nMaxThreads);
+        Loop(nSelf);
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        if (!fInProgress.load(std::memory_order_relaxed)) {
+            nStartMicros.store(GetTimeMicros(), std::memory_order_relaxed);
+            fInProgress.store(true, std::memory_order_relaxed);
         }
-        nTodo += vChecks.size();
+        nTodo.fetch_add(vChecks.size());
+        // Workers take turns; the master only gets work if there are no workers
+        unsigned int nQueues = NumQueues();
+        unsigned int nTarget = nQueues == 1 ? 0 : 1 + nNextQueue++ % (nQueues - 1);
+        {
+            WorkerQueue& queue = vQueues[nTarget];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            BOOST_FOREACH (T& check, vChecks) {
+                queue.vChecks.push_back(T());
+                check.swap(queue.vChecks.back());
+            }
+        }
+        nQueued.fetch_add(vChecks.size());
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nIdle == 0)
+            return;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -164,12 +322,24 @@ public:
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo.load() == 0 && fAllOk.load() == true);
+    }
+
+    //! Per thread counters, the master's first
+    std::vector<CCheckQueueWorkerStats> GetWorkerStats() const
+    {
+        std::vector<CCheckQueueWorkerStats> vStats(NumQueues());
+        for (unsigned int i = 0; i < vStats.size(); i++) {
+            vStats[i].nChecks = vQueues[i].nChecks.load(std::memory_order_relaxed);
+            vStats[i].nSteals = vQueues[i].nSteals.load(std::memory_order_relaxed);
+            vStats[i].nIdleMicros = vQueues[i].nIdleMicros.load(std::memory_order_relaxed);
+        }
+        return vStats;
     }
 
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -82,8 +82,14 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+#ifdef HAVE_SYS_EPOLL_H
+// Sockets are multiplexed with epoll(7) instead of select(), which lifts the
+// FD_SETSIZE limit on descriptor numbers.
+#define USE_EPOLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_EPOLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -0,0 +1,40 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_CPUID_H
+#define BITCOIN_CRYPTO_CPUID_H
+
+#if (defined(__x86_64__) || defined(__amd64__)) && defined(__GNUC__)
+#define HAVE_X86_CPUID 1
+
+#include <stdint.h>
+#include <cpuid.h>
+
+/** Detect the x86 extensions used by the SIMD hash code: SSE4.1, AVX2 (only when
+ *  the OS saves the AVX registers) and the SHA extensions.
+ */
+inline void GetX86HashFeatures(bool& fSSE41, bool& fAVX2, bool& fSHANI)
+{
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid(0, eax, ebx, ecx, edx);
+    uint32_t nMaxLeaf = eax;
+    __cpuid(1, eax, ebx, ecx, edx);
+    fSSE41 = (ecx >> 19) & 1;
+    bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1);
+    if (fAVX) {
+        uint32_t a, d;
+        __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        fAVX = (a & 6) == 6;
+    }
+    fAVX2 = false;
+    fSHANI = false;
+    if (nMaxLeaf >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        fAVX2 = fAVX && ((ebx >> 5) & 1);
+        fSHANI = fSSE41 && ((ebx >> 29) & 1);
+    }
+}
+#endif
+
+#endif // BITCOIN_CRYPTO_CPUID_H
@@ -5,9 +5,21 @@
 #include "crypto/ripemd160.h"
 
 #include "crypto/common.h"
+#include "crypto/cpuid.h"
 
 #include <string.h>
 
+#if defined(HAVE_X86_CPUID)
+namespace ripemd160_32_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+namespace ripemd160_32_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -235,6 +247,43 @@ void Transform(uint32_t* s, const unsigned char* chunk)
 
 } // namespace ripemd160
 
+typedef void (*Transform32Type)(unsigned char*, const unsigned char*);
+
+/** RIPEMD-160 of one 32-byte input with the portable code. */
+void Transform32(unsigned char* out, const unsigned char* in)
+{
+    CRIPEMD160().Write(in, 32).Finalize(out);
+}
+
+/** The multi-lane code this CPU runs, each kept only if it agrees with the portable code. */
+struct Lanes
+{
+    Transform32Type four;
+    Transform32Type eight;
+
+    Lanes() : four(NULL), eight(NULL)
+    {
+#if defined(HAVE_X86_CPUID)
+        bool fHaveSSE41, fHaveAVX2, fHaveSHANI;
+        GetX86HashFeatures(fHaveSSE41, fHaveAVX2, fHaveSHANI);
+        if (fHaveSSE41 && SelfTest(ripemd160_32_sse41::Transform_4way, 4))
+            four = ripemd160_32_sse41::Transform_4way;
+        if (fHaveAVX2 && SelfTest(ripemd160_32_avx2::Transform_8way, 8))
+            eight = ripemd160_32_avx2::Transform_8way;
+#endif
+    }
+
+    static bool SelfTest(Transform32Type tr, size_t nLanes)
+    {
+        unsigned char data[8 * 32], expected[8 * 20], out[8 * 20];
+        for (size_t i = 0; i < sizeof(data); i++)
+            data[i] = (unsigned char)(i * 7 + 3);
+        for (size_t i = 0; i < nLanes; i++)
+            Transform32(expected + 20 * i, data + 32 * i);
+        tr(out, data);
+        return memcmp(out, expected, 20 * nLanes) == 0;
+    }
+};
 } // namespace
 
 ////// RIPEMD160
@@ -290,3 +339,19 @@ CRIPEMD160& CRIPEMD160::Reset()
     ripemd160::Initialize(s);
     return *this;
 }
+
+void RIPEMD160_32(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    // Detected on first use; C++11 makes this initialization thread safe
+    static const Lanes lanes;
+    if (lanes.eight) {
+        for (; blocks >= 8; blocks -= 8, out += 8 * 20, in += 8 * 32)
+            lanes.eight(out, in);
+    }
+    if (lanes.four) {
+        for (; blocks >= 4; blocks -= 4, out += 4 * 20, in += 4 * 32)
+            lanes.four(out, in);
+    }
+    for (; blocks > 0; blocks--, out += 20, in += 32)
+        Transform32(out, in);
+}
@@ -0,0 +1,260 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// RIPEMD-160 of 4 independent 32-byte inputs at once, one per 32-bit lane,
+// using SSE4.1. Only called after RIPEMD160_32() found SSE4.1 on this CPU.
+
+#if (defined(__x86_64__) || defined(__amd64__)) && defined(__GNUC__)
+
+#include "crypto/common.h"
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace ripemd160_32_sse41
+{
+namespace
+{
+#define TARGET __attribute__((target("sse4.1")))
+
+static const size_t LANES = 4;
+
+TARGET __m128i inline K(uint32_t x) { return _mm_set1_epi32(x); }
+TARGET __m128i inline Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+TARGET __m128i inline Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+TARGET __m128i inline Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+TARGET __m128i inline And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+TARGET __m128i inline Not(__m128i x) { return Xor(x, K(0xFFFFFFFFul)); }
+TARGET __m128i inline rol(__m128i x, int i) { return Or(_mm_slli_epi32(x, i), _mm_srli_epi32(x, 32 - i)); }
+
+TARGET __m128i inline f1(__m128i x, __m128i y, __m128i z) { return Xor(Xor(x, y), z); }
+TARGET __m128i inline f2(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), _mm_andnot_si128(x, z)); }
+TARGET __m128i inline f3(__m128i x, __m128i y, __m128i z) { return Xor(Or(x, Not(y)), z); }
+TARGET __m128i inline f4(__m128i x, __m128i y, __m128i z) { return Or(And(x, z), _mm_andnot_si128(z, y)); }
+TARGET __m128i inline f5(__m128i x, __m128i y, __m128i z) { return Xor(x, Or(y, Not(z))); }
+
+TARGET void inline Round(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i f, __m128i x, uint32_t k, int r)
+{
+    a = Add(rol(Add(Add(a, f), Add(x, K(k))), r), e);
+    c = rol(c, 10);
+}
+
+TARGET void inline R11(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f1(b, c, d), x, 0, r); }
+TARGET void inline R21(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f2(b, c, d), x, 0x5A827999ul, r); }
+TARGET void inline R31(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f3(b, c, d), x, 0x6ED9EBA1ul, r); }
+TARGET void inline R41(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f4(b, c, d), x, 0x8F1BBCDCul, r); }
+TARGET void inline R51(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f5(b, c, d), x, 0xA953FD4Eul, r); }
+
+TARGET void inline R12(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f5(b, c, d), x, 0x50A28BE6ul, r); }
+TARGET void inline R22(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f4(b, c, d), x, 0x5C4DD124ul, r); }
+TARGET void inline R32(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f3(b, c, d), x, 0x6D703EF3ul, r); }
+TARGET void inline R42(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f2(b, c, d), x, 0x7A6D76E9ul, r); }
+TARGET void inline R52(__m128i& a, __m128i b, __m128i& c, __m128i d, __m128i e, __m128i x, int r) { Round(a, b, c, d, e, f1(b, c, d), x, 0, r); }
+
+/** Word j of each lane's 32-byte input. */
+TARGET __m128i inline Read(const unsigned char* in, int j)
+{
+    uint32_t vLanes[LANES];
+    for (size_t i = 0; i < LANES; i++)
+        vLanes[i] = ReadLE32(in + 32 * i + 4 * j);
+    return _mm_loadu_si128((const __m128i*)vLanes);
+}
+
+/** Store word j of each lane's 20-byte output. */
+TARGET void inline Write(unsigned char* out, int j, __m128i x)
+{
+    uint32_t vLanes[LANES];
+    _mm_storeu_si128((__m128i*)vLanes, x);
+    for (size_t i = 0; i < LANES; i++)
+        WriteLE32(out + 20 * i + 4 * j, vLanes[i]);
+}
+} // namespace
+
+TARGET void Transform_4way(unsigned char* out, const unsigned char* in)
+{
+    // A 32-byte message and its padding fill exactly one block
+    __m128i w0 = Read(in, 0), w1 = Read(in, 1), w2 = Read(in, 2), w3 = Read(in, 3);
+    __m128i w4 = Read(in, 4), w5 = Read(in, 5), w6 = Read(in, 6), w7 = Read(in, 7);
+    __m128i w8 = K(0x80), w9 = K(0), w10 = K(0), w11 = K(0);
+    __m128i w12 = K(0), w13 = K(0), w14 = K(256), w15 = K(0);
+
+    __m128i a1 = K(0x67452301ul), b1 = K(0xEFCDAB89ul), c1 = K(0x98BADCFEul), d1 = K(0x10325476ul), e1 = K(0xC3D2E1F0ul);
+    __m128i a2 = a1, b2 = b1, c2 = c1, d2 = d1, e2 = e1;
+
+    R11(a1, b1, c1, d1, e1, w0, 11);
+    R12(a2, b2, c2, d2, e2, w5, 8);
+    R11(e1, a1, b1, c1, d1, w1, 14);
+    R12(e2, a2, b2, c2, d2, w14, 9);
+    R11(d1, e1, a1, b1, c1, w2, 15);
+    R12(d2, e2, a2, b2, c2, w7, 9);
+    R11(c1, d1, e1, a1, b1, w3, 12);
+    R12(c2, d2, e2, a2, b2, w0, 11);
+    R11(b1, c1, d1, e1, a1, w4, 5);
+    R12(b2, c2, d2, e2, a2, w9, 13);
+    R11(a1, b1, c1, d1, e1, w5, 8);
+    R12(a2, b2, c2, d2, e2, w2, 15);
+    R11(e1, a1, b1, c1, d1, w6, 7);
+    R12(e2, a2, b2, c2, d2, w11, 15);
+    R11(d1, e1, a1, b1, c1, w7, 9);
+    R12(d2, e2, a2, b2, c2, w4, 5);
+    R11(c1, d1, e1, a1, b1, w8, 11);
+    R12(c2, d2, e2, a2, b2, w13, 7);
+    R11(b1, c1, d1, e1, a1, w9, 13);
+    R12(b2, c2, d2, e2, a2, w6, 7);
+    R11(a1, b1, c1, d1, e1, w10, 14);
+    R12(a2, b2, c2, d2, e2, w15, 8);
+    R11(e1, a1, b1, c1, d1, w11, 15);
+    R12(e2, a2, b2, c2, d2, w8, 11);
+    R11(d1, e1, a1, b1, c1, w12, 6);
+    R12(d2, e2, a2, b2, c2, w1, 14);
+    R11(c1, d1, e1, a1, b1, w13, 7);
+    R12(c2, d2, e2, a2, b2, w10, 14);
+    R11(b1, c1, d1, e1, a1, w14, 9);
+    R12(b2, c2, d2, e2, a2, w3, 12);
+    R11(a1, b1, c1, d1, e1, w15, 8);
+    R12(a2, b2, c2, d2, e2, w12, 6);
+
+    R21(e1, a1, b1, c1, d1, w7, 7);
+    R22(e2, a2, b2, c2, d2, w6, 9);
+    R21(d1, e1, a1, b1, c1, w4, 6);
+    R22(d2, e2, a2, b2, c2, w11, 13);
+    R21(c1, d1, e1, a1, b1, w13, 8);
+    R22(c2, d2, e2, a2, b2, w3, 15);
+    R21(b1, c1, d1, e1, a1, w1, 13);
+    R22(b2, c2, d2, e2, a2, w7, 7);
+    R21(a1, b1, c1, d1, e1, w10, 11);
+    R22(a2, b2, c2, d2, e2, w0, 12);
+    R21(e1, a1, b1, c1, d1, w6, 9);
+    R22(e2, a2, b2, c2, d2, w13, 8);
+    R21(d1, e1, a1, b1, c1, w15, 7);
+    R22(d2, e2, a2, b2, c2, w5, 9);
+    R21(c1, d1, e1, a1, b1, w3, 15);
+    R22(c2, d2, e2, a2, b2, w10, 11);
+    R21(b1, c1, d1, e1, a1, w12, 7);
+    R22(b2, c2, d2, e2, a2, w14, 7);
+    R21(a1, b1, c1, d1, e1, w0, 12);
+    R22(a2, b2, c2, d2, e2, w15, 7);
+    R21(e1, a1, b1, c1, d1, w9, 15);
+    R22(e2, a2, b2, c2, d2, w8, 12);
+    R21(d1, e1, a1, b1, c1, w5, 9);
+    R22(d2, e2, a2, b2, c2, w12, 7);
+    R21(c1, d1, e1, a1, b1, w2, 11);
+    R22(c2, d2, e2, a2, b2, w4, 6);
+    R21(b1, c1, d1, e1, a1, w14, 7);
+    R22(b2, c2, d2, e2, a2, w9, 15);
+    R21(a1, b1, c1, d1, e1, w11, 13);
+    R22(a2, b2, c2, d2, e2, w1, 13);
+    R21(e1, a1, b1, c1, d1, w8, 12);
+    R22(e2, a2, b2, c2, d2, w2, 11);
+
+    R31(d1, e1, a1, b1, c1, w3, 11);
+    R32(d2, e2, a2, b2, c2, w15, 9);
+    R31(c1, d1, e1, a1, b1, w10, 13);
+    R32(c2, d2, e2, a2, b2, w5, 7);
+    R31(b1, c1, d1, e1, a1, w14, 6);
+    R32(b2, c2, d2, e2, a2, w1, 15);
+    R31(a1, b1, c1, d1, e1, w4, 7);
+    R32(a2, b2, c2, d2, e2, w3, 11);
+    R31(e1, a1, b1, c1, d1, w9, 14);
+    R32(e2, a2, b2, c2, d2, w7, 8);
+    R31(d1, e1, a1, b1, c1, w15, 9);
+    R32(d2, e2, a2, b2, c2, w14, 6);
+    R31(c1, d1, e1, a1, b1, w8, 13);
+    R32(c2, d2, e2, a2, b2, w6, 6);
+    R31(b1, c1, d1, e1, a1, w1, 15);
+    R32(b2, c2, d2, e2, a2, w9, 14);
+    R31(a1, b1, c1, d1, e1, w2, 14);
+    R32(a2, b2, c2, d2, e2, w11, 12);
+    R31(e1, a1, b1, c1, d1, w7, 8);
+    R32(e2, a2, b2, c2, d2, w8, 13);
+    R31(d1, e1, a1, b1, c1, w0, 13);
+    R32(d2, e2, a2, b2, c2, w12, 5);
+    R31(c1, d1, e1, a1, b1, w6, 6);
+    R32(c2, d2, e2, a2, b2, w2, 14);
+    R31(b1, c1, d1, e1, a1, w13, 5);
+    R32(b2, c2, d2, e2, a2, w10, 13);
+    R31(a1, b1, c1, d1, e1, w11, 12);
+    R32(a2, b2, c2, d2, e2, w0, 13);
+    R31(e1, a1, b1, c1, d1, w5, 7);
+    R32(e2, a2, b2, c2, d2, w4, 7);
+    R31(d1, e1, a1, b1, c1, w12, 5);
+    R32(d2, e2, a2, b2, c2, w13, 5);
+
+    R41(c1, d1, e1, a1, b1, w1, 11);
+    R42(c2, d2, e2, a2, b2, w8, 15);
+    R41(b1, c1, d1, e1, a1, w9, 12);
+    R42(b2, c2, d2, e2, a2, w6, 5);
+    R41(a1, b1, c1, d1, e1, w11, 14);
+    R42(a2, b2, c2, d2, e2, w4, 8);
+    R41(e1, a1, b1, c1, d1, w10, 15);
+    R42(e2, a2, b2, c2, d2, w1, 11);
+    R41(d1, e1, a1, b1, c1, w0, 14);
+    R42(d2, e2, a2, b2, c2, w3, 14);
+    R41(c1, d1, e1, a1, b1, w8, 15);
+    R42(c2, d2, e2, a2, b2, w11, 14);
+    R41(b1, c1, d1, e1, a1, w12, 9);
+    R42(b2, c2, d2, e2, a2, w15, 6);
+    R41(a1, b1, c1, d1, e1, w4, 8);
+    R42(a2, b2, c2, d2, e2, w0, 14);
+    R41(e1, a1, b1, c1, d1, w13, 9);
+    R42(e2, a2, b2, c2, d2, w5, 6);
+    R41(d1, e1, a1, b1, c1, w3, 14);
+    R42(d2, e2, a2, b2, c2, w12, 9);
+    R41(c1, d1, e1, a1, b1, w7, 5);
+    R42(c2, d2, e2, a2, b2, w2, 12);
+    R41(b1, c1, d1, e1, a1, w15, 6);
+    R42(b2, c2, d2, e2, a2, w13, 9);
+    R41(a1, b1, c1, d1, e1, w14, 8);
+    R42(a2, b2, c2, d2, e2, w9, 12);
+    R41(e1, a1, b1, c1, d1, w5, 6);
+    R42(e2, a2, b2, c2, d2, w7, 5);
+    R41(d1, e1, a1, b1, c1, w6, 5);
+    R42(d2, e2, a2, b2, c2, w10, 15);
+    R41(c1, d1, e1, a1, b1, w2, 12);
+    R42(c2, d2, e2, a2, b2, w14, 8);
+
+    R51(b1, c1, d1, e1, a1, w4, 9);
+    R52(b2, c2, d2, e2, a2, w12, 8);
+    R51(a1, b1, c1, d1, e1, w0, 15);
+    R52(a2, b2, c2, d2, e2, w15, 5);
+    R51(e1, a1, b1, c1, d1, w5, 5);
+    R52(e2, a2, b2, c2, d2, w10, 12);
+    R51(d1, e1, a1, b1, c1, w9, 11);
+    R52(d2, e2, a2, b2, c2, w4, 9);
+    R51(c1, d1, e1, a1, b1, w7, 6);
+    R52(c2, d2, e2, a2, b2, w1, 12);
+    R51(b1, c1, d1, e1, a1, w12, 8);
+    R52(b2, c2, d2, e2, a2, w5, 5);
+    R51(a1, b1, c1, d1, e1, w2, 13);
+    R52(a2, b2, c2, d2, e2, w8, 14);
+    R51(e1, a1, b1, c1, d1, w10, 12);
+    R52(e2, a2, b2, c2, d2, w7, 6);
+    R51(d1, e1, a1, b1, c1, w14, 5);
+    R52(d2, e2, a2, b2, c2, w6, 8);
+    R51(c1, d1, e1, a1, b1, w1, 12);
+    R52(c2, d2, e2, a2, b2, w2, 13);
+    R51(b1, c1, d1, e1, a1, w3, 13);
+    R52(b2, c2, d2, e2, a2, w13, 6);
+    R51(a1, b1, c1, d1, e1, w8, 14);
+    R52(a2, b2, c2, d2, e2, w14, 5);
+    R51(e1, a1, b1, c1, d1, w11, 11);
+    R52(e2, a2, b2, c2, d2, w0, 15);
+    R51(d1, e1, a1, b1, c1, w6, 8);
+    R52(d2, e2, a2, b2, c2, w3, 13);
+    R51(c1, d1, e1, a1, b1, w15, 5);
+    R52(c2, d2, e2, a2, b2, w9, 11);
+    R51(b1, c1, d1, e1, a1, w13, 6);
+    R52(b2, c2, d2, e2, a2, w11, 11);
+
+    Write(out, 0, Add(Add(K(0xEFCDAB89ul), c1), d2));
+    Write(out, 1, Add(Add(K(0x98BADCFEul), d1), e2));
+    Write(out, 2, Add(Add(K(0x10325476ul), e1), a2));
+    Write(out, 3, Add(Add(K(0xC3D2E1F0ul), a1), b2));
+    Write(out, 4, Add(Add(K(0x67452301ul), b1), c2));
+}
+
+#undef TARGET
+} // namespace ripemd160_32_sse41
+
+#endif
@@ -7,6 +7,8 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
+#include <vector>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +27,32 @@ public:
     CSHA256& Reset();
 };
 
+/** Names of the SHA-256 implementations which run, and pass their self-test, on
+ *  this CPU: "standard" always, and any of "shani", "sse41" and "avx2".
+ */
+std::vector<std::string> SHA256Implementations();
+
+/** Select the SHA-256 implementation to use, after self-testing it against the
+ *  portable code: the named one, or the fastest available if strName is empty.
+ *  Returns the name of the implementation in use, or an empty string (and falls
+ *  back to "standard") if the named one is not available. Must not run while
+ *  other threads are hashing.
+ */
+std::string SHA256AutoDetect(const std::string& strName = "");
+
+/** Compute multiple double-SHA256's of 64-byte blobs.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Compute multiple SHA256's of messages already padded into a single 64-byte
+ *  block each, so of at most 55 bytes.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256OneBlock(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
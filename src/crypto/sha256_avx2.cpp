@@ -0,0 +1,153 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// SHA-256 of 8 independent 64-byte blocks at once, one per 32-bit lane, either
+// double hashing 64-byte inputs or hashing messages padded into a single block,
+// using AVX2. Only called after SHA256AutoDetect() found AVX2 on this CPU.
+
+#if (defined(__x86_64__) || defined(__amd64__)) && defined(__GNUC__)
+
+#include "crypto/common.h"
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace sha256d64_avx2
+{
+namespace
+{
+#define TARGET __attribute__((target("avx2")))
+
+static const size_t LANES = 8;
+
+TARGET __m256i inline K(uint32_t x) { return _mm256_set1_epi32(x); }
+TARGET __m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+TARGET __m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+TARGET __m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+TARGET __m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+TARGET __m256i inline ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
+TARGET __m256i inline ShL(__m256i x, int n) { return _mm256_slli_epi32(x, n); }
+
+TARGET __m256i inline Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+TARGET __m256i inline Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+TARGET __m256i inline Sigma0(__m256i x) { return Xor(Xor(Or(ShR(x, 2), ShL(x, 30)), Or(ShR(x, 13), ShL(x, 19))), Or(ShR(x, 22), ShL(x, 10))); }
+TARGET __m256i inline Sigma1(__m256i x) { return Xor(Xor(Or(ShR(x, 6), ShL(x, 26)), Or(ShR(x, 11), ShL(x, 21))), Or(ShR(x, 25), ShL(x, 7))); }
+TARGET __m256i inline sigma0(__m256i x) { return Xor(Xor(Or(ShR(x, 7), ShL(x, 25)), Or(ShR(x, 18), ShL(x, 14))), ShR(x, 3)); }
+TARGET __m256i inline sigma1(__m256i x) { return Xor(Xor(Or(ShR(x, 17), ShL(x, 15)), Or(ShR(x, 19), ShL(x, 13))), ShR(x, 10)); }
+
+static const uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** Reset every lane to the SHA-256 initial state. */
+TARGET void inline Initialize(__m256i* s)
+{
+    s[0] = K(0x6a09e667ul);
+    s[1] = K(0xbb67ae85ul);
+    s[2] = K(0x3c6ef372ul);
+    s[3] = K(0xa54ff53aul);
+    s[4] = K(0x510e527ful);
+    s[5] = K(0x9b05688cul);
+    s[6] = K(0x1f83d9abul);
+    s[7] = K(0x5be0cd19ul);
+}
+
+/** One SHA-256 transformation in every lane; w holds each lane's message words. */
+TARGET void Transform(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] = Add(Add(sigma1(w[(i - 2) & 15]), w[(i - 7) & 15]), Add(sigma0(w[(i - 15) & 15]), w[i & 15]));
+        __m256i t1 = Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), Add(K(ROUND_CONSTANTS[i]), w[i & 15])));
+        __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = Add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+/** Word j of each lane's 64-byte input. */
+TARGET __m256i inline Read(const unsigned char* in, int j)
+{
+    uint32_t vLanes[LANES];
+    for (size_t i = 0; i < LANES; i++)
+        vLanes[i] = ReadBE32(in + 64 * i + 4 * j);
+    return _mm256_loadu_si256((const __m256i*)vLanes);
+}
+
+/** Store word j of each lane's 32-byte output. */
+TARGET void inline Write(unsigned char* out, int j, __m256i x)
+{
+    uint32_t vLanes[LANES];
+    _mm256_storeu_si256((__m256i*)vLanes, x);
+    for (size_t i = 0; i < LANES; i++)
+        WriteBE32(out + 32 * i + 4 * j, vLanes[i]);
+}
+} // namespace
+
+TARGET void Transform_8way(unsigned char* out, const unsigned char* in)
+{
+    __m256i s[8], t[8], w[16];
+
+    // First hash: the input, then a padding block for a 64-byte message
+    Initialize(s);
+    for (int j = 0; j < 16; j++)
+        w[j] = Read(in, j);
+    Transform(s, w);
+    w[0] = K(0x80000000ul);
+    for (int j = 1; j < 15; j++)
+        w[j] = K(0);
+    w[15] = K(512);
+    Transform(s, w);
+
+    // Second hash: the 32-byte first hash and its padding, in a single block
+    Initialize(t);
+    for (int j = 0; j < 8; j++)
+        w[j] = s[j];
+    w[8] = K(0x80000000ul);
+    for (int j = 9; j < 15; j++)
+        w[j] = K(0);
+    w[15] = K(256);
+    Transform(t, w);
+
+    for (int j = 0; j < 8; j++)
+        Write(out, j, t[j]);
+}
+
+TARGET void TransformOneBlock_8way(unsigned char* out, const unsigned char* in)
+{
+    __m256i s[8], w[16];
+    Initialize(s);
+    for (int j = 0; j < 16; j++)
+        w[j] = Read(in, j);
+    Transform(s, w);
+    for (int j = 0; j < 8; j++)
+        Write(out, j, s[j]);
+}
+
+#undef TARGET
+} // namespace sha256d64_avx2
+
+#endif
@@ -0,0 +1,225 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include "uint256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Fixed-size, lock-free set of uint256 entries which are already uniformly
+ * distributed, such as salted hashes.
+ *
+ * Every entry can live in one of CANDIDATES slots, picked by its own 32-bit
+ * words. Each slot is guarded by a sequence counter which is odd while a
+ * writer owns it: readers copy the slot and check that the counter did not
+ * change, and writers claim it with a compare-and-swap. Nothing ever waits;
+ * a reader racing a writer sees a miss, and a writer racing another writer
+ * drops its entry, which for a cache only costs a later recomputation.
+ *
+ * Entries are stamped with the generation they were inserted in. The
+ * generation advances every size() / 2 inserts, and entries two generations
+ * old are free space for new inserts, so nothing is ever swept. When all
+ * candidate slots hold live entries, the oldest is replaced and moved to one
+ * of its own other slots, up to MAX_DISPLACEMENTS times; the entry displaced
+ * last is dropped.
+ *
+ * All memory is allocated by setup_bytes(), which must be called before the
+ * cache is shared between threads.
+ */
+class CCuckooCache
+{
+public:
+    //! Number of slots an entry can be stored in
+    static const unsigned int CANDIDATES = 8;
+    //! Longest chain of entries moved by one insert
+    static const unsigned int MAX_DISPLACEMENTS = 8;
+
+private:
+    struct Slot
+    {
+        //! Odd while a writer owns the slot
+        std::atomic<uint32_t> nSequence;
+        //! Generation the entry was inserted in, or 0 if the slot is empty
+        std::atomic<uint32_t> nGeneration;
+        std::atomic<uint64_t> vWords[4];
+
+        Slot() : nSequence(0), nGeneration(0)
+        {
+            for (unsigned int i = 0; i < 4; i++)
+                vWords[i].store(0, std::memory_order_relaxed);
+        }
+    };
+
+    std::unique_ptr<Slot[]> vSlots;
+    uint32_t nSlots;
+    uint32_t nInsertsPerGeneration;
+    std::atomic<uint32_t> nGeneration;
+    std::atomic<uint32_t> nInserts;
+
+    struct Entry
+    {
+        uint64_t vWords[4];
+        explicit Entry(const uint256& entry) { memcpy(vWords, entry.begin(), sizeof(vWords)); }
+        Entry() {}
+    };
+
+    Slot& Candidate(const Entry& entry, unsigned int i) const
+    {
+        // Each 32-bit word of the entry is an independent uniform hash; scale it onto [0, nSlots)
+        uint32_t nHash = (uint32_t)(entry.vWords[i / 2] >> (32 * (i % 2)));
+        return vSlots[((uint64_t)nHash * nSlots) >> 32];
+    }
+
+    //! Copy a slot's contents, returns false if a writer owned or changed it meanwhile
+    static bool Read(const Slot& slot, Entry& entry, uint32_t& nEntryGeneration)
+    {
+        uint32_t nSequence = slot.nSequence.load(std::memory_order_acquire);
+        if (nSequence & 1)
+            return false;
+        nEntryGeneration = slot.nGeneration.load(std::memory_order_relaxed);
+        for (unsigned int i = 0; i < 4; i++)
+            entry.vWords[i] = slot.vWords[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.nSequence.load(std::memory_order_relaxed) == nSequence;
+    }
+
+    static bool Holds(const Slot& slot, const Entry& entry)
+    {
+        Entry current;
+        uint32_t nEntryGeneration;
+        return Read(slot, current, nEntryGeneration) && nEntryGeneration != 0 &&
+               memcmp(current.vWords, entry.vWords, sizeof(entry.vWords)) == 0;
+    }
+
+    static bool TryLock(Slot& slot, uint32_t& nSequence)
+    {
+        nSequence = slot.nSequence.load(std::memory_order_relaxed);
+        if ((nSequence & 1) || !slot.nSequence.compare_exchange_strong(nSequence, nSequence + 1, std::memory_order_acquire))
+            return false;
+        // Keep the writes to the slot from becoming visible before the odd sequence number
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    static void Unlock(Slot& slot, uint32_t nSequence)
+    {
+        slot.nSequence.store(nSequence + 2, std::memory_order_release);
+    }
+
+    static bool IsFree(uint32_t nEntryGeneration, uint32_t nCurrentGeneration)
+    {
+        return nEntryGeneration == 0 || nEntryGeneration + 2 <= nCurrentGeneration;
+    }
+
+public:
+    CCuckooCache() : nSlots(0), nInsertsPerGeneration(1), nGeneration(1), nInserts(0) {}
+
+    /**
+     * Allocate as many slots as fit in nBytes, dropping all entries.
+     * Returns the number of slots.
+     */
+    uint32_t setup_bytes(size_t nBytes)
+    {
+        nSlots = std::min(nBytes / sizeof(Slot), (size_t)std::numeric_limits<uint32_t>::max());
+        vSlots.reset(nSlots ? new Slot[nSlots] : NULL);
+        nInsertsPerGeneration = std::max(nSlots / 2, (uint32_t)1);
+        nGeneration.store(1);
+        nInserts.store(0);
+        return nSlots;
+    }
+
+    //! Number of slots
+    uint32_t size() const { return nSlots; }
+
+    //! Memory used by the slots, which is all the cache ever allocates
+    size_t DynamicMemoryUsage() const { return (size_t)nSlots * sizeof(Slot); }
+
+    /** Returns whether entry is in the cache, removing it if fErase is set. */
+    bool contains(const uint256& entryIn, bool fErase)
+    {
+        if (nSlots == 0)
+            return false;
+        Entry entry(entryIn);
+        for (unsigned int i = 0; i < CANDIDATES; i++) {
+            Slot& slot = Candidate(entry, i);
+            if (!Holds(slot, entry))
+                continue;
+            uint32_t nSequence;
+            // Erasing only frees space, so give up if another thread owns the slot
+            if (fErase && TryLock(slot, nSequence)) {
+                // The slot may have been rewritten between the read and the lock
+                bool fSame = true;
+                for (unsigned int j = 0; j < 4; j++)
+                    fSame &= slot.vWords[j].load(std::memory_order_relaxed) == entry.vWords[j];
+                if (fSame)
+                    slot.nGeneration.store(0, std::memory_order_relaxed);
+                Unlock(slot, nSequence);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void insert(const uint256& entryIn)
+    {
+        if (nSlots == 0)
+            return;
+        uint32_t nCurrentGeneration = nGeneration.load(std::memory_order_relaxed);
+        if ((nInserts.fetch_add(1, std::memory_order_relaxed) + 1) % nInsertsPerGeneration == 0)
+            nCurrentGeneration = nGeneration.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        Entry entry(entryIn);
+        uint32_t nEntryGeneration = nCurrentGeneration;
+        const Slot* pslotFrom = NULL;
+        for (unsigned int nDisplaced = 0; nDisplaced <= MAX_DISPLACEMENTS; nDisplaced++) {
+            // Take a free slot if there is one, else the one with the oldest entry
+            Slot* pslot = NULL;
+            uint32_t nOldest = 0;
+            bool fFree = false;
+            for (unsigned int i = 0; i < CANDIDATES; i++) {
+                Slot& slot = Candidate(entry, i);
+                if (&slot == pslotFrom)
+                    continue;
+                // The new entry may be present already; displaced ones are not
+                if (nDisplaced == 0 && Holds(slot, entry))
+                    return;
+                if (fFree)
+                    continue;
+                uint32_t nSlotGeneration = slot.nGeneration.load(std::memory_order_relaxed);
+                if (IsFree(nSlotGeneration, nCurrentGeneration)) {
+                    pslot = &slot;
+                    fFree = true;
+                } else if (pslot == NULL || nSlotGeneration < nOldest) {
+                    pslot = &slot;
+                    nOldest = nSlotGeneration;
+                }
+            }
+            uint32_t nSequence;
+            if (pslot == NULL || !TryLock(*pslot, nSequence))
+                return;
+            Entry displaced;
+            for (unsigned int i = 0; i < 4; i++) {
+                displaced.vWords[i] = pslot->vWords[i].load(std::memory_order_relaxed);
+                pslot->vWords[i].store(entry.vWords[i], std::memory_order_relaxed);
+            }
+            uint32_t nDisplacedGeneration = pslot->nGeneration.exchange(nEntryGeneration, std::memory_order_relaxed);
+            Unlock(*pslot, nSequence);
+            if (IsFree(nDisplacedGeneration, nCurrentGeneration))
+                return;
+            entry = displaced;
+            nEntryGeneration = nDisplacedGeneration;
+            pslotFrom = pslot;
+        }
+    }
+};
+
+#endif // BITCOIN_CUCKOOCACHE_H
@@ -7,6 +7,8 @@
 #include "crypto/hmac_sha512.h"
 #include "pubkey.h"
 
+#include <algorithm>
+
 
 inline uint32_t ROTL32(uint32_t x, int8_t r)
 {
@@ -72,6 +74,103 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+void MurmurHash3Multi(const unsigned int* pnSeeds, unsigned int nSeeds, const unsigned char* pData, size_t nDataLen, unsigned int* pnHashesOut)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    const size_t nblocks = nDataLen / 4;
+    const uint8_t* tail = pData + nblocks * 4;
+
+    for (unsigned int nStart = 0; nStart < nSeeds; nStart += MURMURHASH3_LANES) {
+        // Unused lanes are hashed too, so the loops below always run over the full width.
+        const unsigned int nLanes = std::min(nSeeds - nStart, MURMURHASH3_LANES);
+        uint32_t h1[MURMURHASH3_LANES] = {};
+        for (unsigned int j = 0; j < nLanes; j++)
+            h1[j] = pnSeeds[nStart + j];
+
+        // body
+        for (size_t i = 0; i < nblocks; i++) {
+            uint32_t k1 = ReadLE32(pData + i*4);
+
+            k1 *= c1;
+            k1 = ROTL32(k1, 15);
+            k1 *= c2;
+
+            for (unsigned int j = 0; j < MURMURHASH3_LANES; j++) {
+                h1[j] ^= k1;
+                h1[j] = ROTL32(h1[j], 13);
+                h1[j] = h1[j] * 5 + 0xe6546b64;
+            }
+        }
+
+        // tail
+        uint32_t k1 = 0;
+
+        switch (nDataLen & 3) {
+        case 3:
+            k1 ^= tail[2] << 16;
+        case 2:
+            k1 ^= tail[1] << 8;
+        case 1:
+            k1 ^= tail[0];
+            k1 *= c1;
+            k1 = ROTL32(k1, 15);
+            k1 *= c2;
+            for (unsigned int j = 0; j < MURMURHASH3_LANES; j++)
+                h1[j] ^= k1;
+        };
+
+        // finalization
+        for (unsigned int j = 0; j < MURMURHASH3_LANES; j++) {
+            h1[j] ^= (uint32_t)nDataLen;
+            h1[j] ^= h1[j] >> 16;
+            h1[j] *= 0x85ebca6b;
+            h1[j] ^= h1[j] >> 13;
+            h1[j] *= 0xc2b2ae35;
+            h1[j] ^= h1[j] >> 16;
+        }
+
+        for (unsigned int j = 0; j < nLanes; j++)
+            pnHashesOut[nStart + j] = h1[j];
+    }
+}
+
+std::vector<uint160> Hash160Batch(const std::vector<std::pair<const unsigned char*, size_t> >& vInputs)
+{
+    std::vector<uint160> vResults(vInputs.size());
+
+    // Pad the short inputs into one SHA-256 block each; hash the others one by one
+    std::vector<size_t> vShort;
+    std::vector<unsigned char> vBlocks;
+    vShort.reserve(vInputs.size());
+    vBlocks.reserve(vInputs.size() * 64);
+    for (size_t i = 0; i < vInputs.size(); i++) {
+        const unsigned char* pdata = vInputs[i].first;
+        size_t nLen = vInputs[i].second;
+        if (nLen > 55) {
+            CHash160().Write(pdata, nLen).Finalize(vResults[i].begin());
+            continue;
+        }
+        vShort.push_back(i);
+        size_t nPos = vBlocks.size();
+        vBlocks.resize(nPos + 64, 0);
+        memcpy(&vBlocks[nPos], pdata, nLen);
+        vBlocks[nPos + nLen] = 0x80;
+        WriteBE64(&vBlocks[nPos + 56], (uint64_t)nLen << 3);
+    }
+    if (vShort.empty())
+        return vResults;
+
+    std::vector<unsigned char> vSHA256(vShort.size() * 32);
+    SHA256OneBlock(&vSHA256[0], &vBlocks[0], vShort.size());
+    std::vector<unsigned char> vRIPEMD160(vShort.size() * 20);
+    RIPEMD160_32(&vRIPEMD160[0], &vSHA256[0], vShort.size());
+    for (size_t i = 0; i < vShort.size(); i++)
+        memcpy(vResults[vShort[i]].begin(), &vRIPEMD160[20 * i], 20);
+    return vResults;
+}
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64])
 {
     unsigned char num[4];
@@ -126,6 +126,25 @@ inline uint160 Hash160(const prevector<N, unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+/** Compute the 160-bit hashes of many byte arrays at once: the same results as
+ *  Hash160 on each, but inputs of up to 55 bytes, which covers public keys and
+ *  standard scripts, are hashed several at a time in SIMD lanes. */
+std::vector<uint160> Hash160Batch(const std::vector<std::pair<const unsigned char*, size_t> >& vInputs);
+
+/** Compute the 160-bit hashes of a vector of objects, such as public keys. */
+template<typename T>
+std::vector<uint160> Hash160Many(const std::vector<T>& vItems)
+{
+    static unsigned char pblank[1] = {};
+    std::vector<std::pair<const unsigned char*, size_t> > vInputs;
+    vInputs.reserve(vItems.size());
+    for (typename std::vector<T>::const_iterator it = vItems.begin(); it != vItems.end(); ++it) {
+        const unsigned char* pdata = it->begin() == it->end() ? pblank : (const unsigned char*)&it->begin()[0];
+        vInputs.push_back(std::make_pair(pdata, (size_t)(it->end() - it->begin())));
+    }
+    return Hash160Batch(vInputs);
+}
+
 /** A writer stream (for serialization) that computes a 256-bit hash. */
 class CHashWriter
 {
@@ -169,6 +188,17 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** Number of seeds MurmurHash3Multi hashes side by side. */
+static const unsigned int MURMURHASH3_LANES = 4;
+
+/**
+ * Compute MurmurHash3 of the same data under nSeeds different seeds, writing
+ * pnHashesOut[i] = MurmurHash3(pnSeeds[i], data). The seed-independent mixing
+ * of each data block is done once, and up to MURMURHASH3_LANES seeds are
+ * updated together in fixed-width loops that the compiler can vectorize.
+ */
+void MurmurHash3Multi(const unsigned int* pnSeeds, unsigned int nSeeds, const unsigned char* pData, size_t nDataLen, unsigned int* pnHashesOut);
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 /** SipHash-2-4 */
@@ -15,6 +15,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "cuckoocache.h"
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -108,6 +109,7 @@ map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOr
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev, const Consensus::Params& consensusparams);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -207,6 +209,7 @@ namespace {
         uint256 hash;
         CBlockIndex* pindex;                                     //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
+        int64_t nTimeRequested;                                  //!< When the block was requested (in microseconds).
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
@@ -231,6 +234,33 @@ namespace {
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /** Ring of recently seen transactions that are not in the mempool (orphans, and replaced, evicted or
+     *  expired mempool transactions), consulted when reconstructing compact blocks. Protected by cs_main. */
+    std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > vExtraTxnForCompact;
+    size_t vExtraTxnForCompactIt = 0;
+
+    /** Where the transactions of compact blocks we reconstructed came from. Protected by cs_main. */
+    CCompactBlockStats compactBlockStats;
+
+    /**
+     * Salt, and the SipHash keys derived from it, of the short ids our peers
+     * announce transactions to us with. It is the same for all peers, so a
+     * transaction has the same short id whoever announces it. Set in
+     * InitBlockIndex.
+     */
+    uint64_t nShortTxIdSalt = 0;
+    uint64_t shorttxidk0 = 0, shorttxidk1 = 0;
+
+    /**
+     * Filter of the short ids of transactions we have seen (received or
+     * accepted to the mempool), so that short id announcements of them are
+     * ignored. Protected by cs_main.
+     */
+    std::unique_ptr<CRollingBloomFilter> filterShortTxIdsKnown;
+
+    /** Short ids we requested, with the time we may request them again. Protected by cs_main. */
+    limitedmap<uint64_t, int64_t> mapShortTxIdsAskedFor(MAX_INV_SZ);
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -284,6 +314,14 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Moving average of the time between request and arrival of blocks from this peer (in microseconds), or 0.
+    int64_t nBlockLatencyAvg;
+    //! Moving average of the time this peer takes to deliver each next block of a batch (in microseconds), or 0.
+    int64_t nBlockIntervalAvg;
+    //! Moving average of the serialized size of blocks received from this peer, in bytes.
+    int64_t nBlockSizeAvg;
+    //! When the last requested block from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockReceived;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -294,6 +332,15 @@ struct CNodeState {
     bool fProvidesHeaderAndIDs;
     //! Whether this peer can give us witnesses
     bool fHaveWitness;
+    //! Whether this peer wants transactions announced by short ids, and the keys of its salt.
+    bool fShortTxInv;
+    uint64_t shorttxidk0, shorttxidk1;
+    //! Transactions announced to this peer by short id, which it may still request.
+    std::map<uint64_t, uint256> mapShortTxIdsAnnounced;
+    std::deque<std::pair<int64_t, uint64_t> > vShortTxIdsExpiration;
+    //! Short ids this peer announced to us, by the earliest time (in microseconds) we may request them.
+    std::multimap<int64_t, uint64_t> mapShortTxAskFor;
+    std::set<uint64_t> setShortTxAskFor;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -309,11 +356,18 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockLatencyAvg = 0;
+        nBlockIntervalAvg = 0;
+        nBlockSizeAvg = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
         fProvidesHeaderAndIDs = false;
         fHaveWitness = false;
+        fShortTxInv = false;
+        shorttxidk0 = 0;
+        shorttxidk1 = 0;
     }
 };
 
@@ -375,13 +429,39 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
     }
 }
 
+/** Fold a new sample into a per-peer moving average (weight 1/4), seeding it with the first sample. */
+void UpdateBlockDownloadAverage(int64_t& nAverage, int64_t nSample) {
+    nAverage = nAverage == 0 ? std::max<int64_t>(nSample, 1) : std::max<int64_t>(nAverage + (nSample - nAverage) / 4, 1);
+}
+
+// Requires cs_main.
+/** Number of blocks we let a peer have in flight: enough to keep BLOCK_DOWNLOAD_QUEUE_TIME of its
+ *  measured delivery time queued, or the static default while it hasn't delivered anything yet. */
+int GetBlocksInTransitQuota(const CNodeState& state) {
+    if (state.nBlockIntervalAvg == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nQuota = BLOCK_DOWNLOAD_QUEUE_TIME / state.nBlockIntervalAvg;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nQuota, MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE));
+}
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
 // Also used if a block was /not/ received and timed out or started with another peer
-bool MarkBlockAsReceived(const uint256& hash) {
+// If nodeFrom is the peer we requested the block from, its download speed estimates are updated.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nBlockSize = 0) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (nodeFrom == itInFlight->second.first) {
+            // The block was delivered by the peer we asked. The interval counts from the later of its
+            // request and the previous delivery, so blocks queued behind each other aren't double counted.
+            int64_t nNow = GetTimeMicros();
+            int64_t nTimeRequested = itInFlight->second.second->nTimeRequested;
+            UpdateBlockDownloadAverage(state->nBlockLatencyAvg, nNow - nTimeRequested);
+            UpdateBlockDownloadAverage(state->nBlockIntervalAvg, nNow - std::max(nTimeRequested, state->nLastBlockReceived));
+            UpdateBlockDownloadAverage(state->nBlockSizeAvg, nBlockSize);
+            state->nLastBlockReceived = nNow;
+        }
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         if (state->nBlocksInFlightValidHeaders == 0 && itInFlight->second.second->fValidatedHeaders) {
             // Last validated block on the queue was received.
@@ -418,7 +498,7 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     MarkBlockAsReceived(hash);
 
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != NULL, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)});
+            {hash, pindex, pindex != NULL, GetTimeMicros(), std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -530,8 +610,10 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
+ *  at most count entries. pindexWaitingFor is set to the first block in the window that is already
+ *  in flight from another peer, if one was seen. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexWaitingFor, const Consensus::Params& consensusParams) {
+    pindexWaitingFor = NULL;
     if (count == 0)
         return;
 
@@ -609,14 +691,48 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 if (vBlocks.size() == count) {
                     return;
                 }
-            } else if (waitingfor == -1) {
-                // This is the first already-in-flight block.
-                waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+            } else {
+                NodeId nodeInFlight = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                if (waitingfor == -1) {
+                    // This is the first already-in-flight block.
+                    waitingfor = nodeInFlight;
+                }
+                if (pindexWaitingFor == NULL && nodeInFlight != nodeid) {
+                    // This is the first block we're waiting on another peer for.
+                    pindexWaitingFor = pindex;
+                }
             }
         }
     }
 }
 
+// Requires cs_main.
+/** Whether the block holding back nodeid's download window has been in flight from another peer for
+ *  so long that nodeid, being faster, should be asked for it instead. */
+bool ShouldRerequestBlock(NodeId nodeid, const uint256& hash, int64_t nNow) {
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first == nodeid)
+        return false;
+    const QueuedBlock& queued = *itInFlight->second.second;
+    if (queued.partialBlock) {
+        // A compact block reconstruction is in progress; leave it be.
+        return false;
+    }
+    CNodeState *stateTo = State(nodeid);
+    CNodeState *stateFrom = State(itInFlight->second.first);
+    if (stateTo->nBlockIntervalAvg == 0) {
+        // We don't know yet whether this peer is any faster.
+        return false;
+    }
+    if (stateFrom->nBlockIntervalAvg != 0 && stateFrom->nBlockIntervalAvg <= stateTo->nBlockIntervalAvg)
+        return false;
+
+    // How long the current peer should take, given the blocks queued ahead of this one.
+    int64_t nQueuedAhead = std::distance(stateFrom->vBlocksInFlight.begin(), itInFlight->second.second);
+    int64_t nExpected = std::max(stateFrom->nBlockLatencyAvg, stateFrom->nBlockIntervalAvg * (nQueuedAhead + 1));
+    return nNow - queued.nTimeRequested > std::max(BLOCK_REREQUEST_MIN_TIME, BLOCK_REREQUEST_FACTOR * nExpected);
+}
+
 } // anon namespace
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -627,6 +743,10 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    stats.nBlockLatencyAvg = state->nBlockLatencyAvg;
+    stats.nBlockIntervalAvg = state->nBlockIntervalAvg;
+    stats.nBlockSizeAvg = state->nBlockSizeAvg;
+    stats.nBlocksInTransitQuota = GetBlocksInTransitQuota(*state);
     BOOST_FOREACH(const QueuedBlock& queue, state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
@@ -671,6 +791,109 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// vExtraTxnForCompact
+//
+
+void AddToCompactExtraTransactions(const std::shared_ptr<const CTransaction>& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    int64_t nMaxExtraTxn = GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN);
+    if (nMaxExtraTxn <= 0)
+        return;
+    if (vExtraTxnForCompact.size() != (size_t)nMaxExtraTxn)
+        vExtraTxnForCompact.resize(nMaxExtraTxn);
+    vExtraTxnForCompactIt %= nMaxExtraTxn;
+    vExtraTxnForCompact[vExtraTxnForCompactIt] = std::make_pair(tx->GetHash(), tx);
+    vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % nMaxExtraTxn;
+}
+
+void GetCompactBlockStats(CCompactBlockStats& stats)
+{
+    LOCK(cs_main);
+    stats = compactBlockStats;
+    stats.nExtraTxn = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, std::shared_ptr<const CTransaction>)& extra, vExtraTxnForCompact) {
+        if (extra.second)
+            stats.nExtraTxn++;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Short id transaction relay
+//
+
+static std::vector<unsigned char> ShortTxIdKey(uint64_t shortid)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << shortid;
+    return std::vector<unsigned char>(ss.begin(), ss.end());
+}
+
+/** The short id a transaction is announced to us with. */
+static uint64_t GetOwnShortTxId(const uint256& hash)
+{
+    return TransactionShortIDs::GetShortID(shorttxidk0, shorttxidk1, hash);
+}
+
+void MarkShortTxIdKnown(const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    if (!filterShortTxIdsKnown)
+        return;
+    uint64_t shortid = GetOwnShortTxId(hash);
+    filterShortTxIdsKnown->insert(ShortTxIdKey(shortid));
+    mapShortTxIdsAskedFor.erase(shortid);
+}
+
+bool AlreadyHaveShortTxId(uint64_t shortid) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    return filterShortTxIdsKnown->contains(ShortTxIdKey(shortid));
+}
+
+/** Queue a request for an announced short id, like CNode::AskFor does for invs. */
+void AskForShortTx(CNodeState* state, uint64_t shortid) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    if (state->mapShortTxAskFor.size() > MAPASKFOR_MAX_SZ || state->setShortTxAskFor.size() > SETASKFOR_MAX_SZ)
+        return;
+    // a peer may not have multiple non-responded queue positions for a single short id
+    if (!state->setShortTxAskFor.insert(shortid).second)
+        return;
+
+    // Each retry from another peer is SHORT_TX_REQUEST_TIMEOUT after the last
+    int64_t nNow = GetTimeMicros();
+    int64_t nRequestTime = nNow;
+    limitedmap<uint64_t, int64_t>::const_iterator it = mapShortTxIdsAskedFor.find(shortid);
+    if (it != mapShortTxIdsAskedFor.end()) {
+        nRequestTime = std::max(it->second + SHORT_TX_REQUEST_TIMEOUT * 1000000, nNow);
+        mapShortTxIdsAskedFor.update(it, nRequestTime);
+    } else {
+        mapShortTxIdsAskedFor.insert(std::make_pair(shortid, nRequestTime));
+    }
+    state->mapShortTxAskFor.insert(std::make_pair(nRequestTime, shortid));
+}
+
+/**
+ * Remember a transaction announced to a peer by short id, so the peer can
+ * request it. Returns false if another transaction announced to the peer
+ * still has the same short id, in which case it has to be announced by
+ * full hash instead.
+ */
+bool AddShortTxAnnouncement(CNodeState& state, const uint256& hash, int64_t nNow, std::vector<uint64_t>& vShortTxIds) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    while (!state.vShortTxIdsExpiration.empty() && state.vShortTxIdsExpiration.front().first < nNow) {
+        state.mapShortTxIdsAnnounced.erase(state.vShortTxIdsExpiration.front().second);
+        state.vShortTxIdsExpiration.pop_front();
+    }
+
+    uint64_t shortid = TransactionShortIDs::GetShortID(state.shorttxidk0, state.shorttxidk1, hash);
+    if (!state.mapShortTxIdsAnnounced.insert(std::make_pair(shortid, hash)).second)
+        return false;
+    state.vShortTxIdsExpiration.push_back(std::make_pair(nNow + SHORT_TX_ANNOUNCE_EXPIRY * 1000000, shortid));
+    vShortTxIds.push_back(shortid);
+    return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -702,6 +925,8 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
 
+    AddToCompactExtraTransactions(std::make_shared<const CTransaction>(tx));
+
     LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
              mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
     return true;
@@ -1095,14 +1320,17 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state)
 }
 
 void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
-    int expired = pool.Expire(GetTime() - age);
+    std::vector<std::shared_ptr<const CTransaction> > vRemovedTxs;
+    int expired = pool.Expire(GetTime() - age, &vRemovedTxs);
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
     std::vector<uint256> vNoSpendsRemaining;
-    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    pool.TrimToSize(limit, &vNoSpendsRemaining, &vRemovedTxs);
     BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
+    BOOST_FOREACH(const std::shared_ptr<const CTransaction>& tx, vRemovedTxs)
+        AddToCompactExtraTransactions(tx);
 }
 
 /** Convert CValidationState to a human-readable message for logging */
@@ -1494,12 +1722,12 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
+            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
                 // Only the witness is missing, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
@@ -1515,12 +1743,23 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, false, txdata))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
         }
 
+        // Check once more with the flags the next block will be connected
+        // with, and remember the result in the script execution cache so
+        // that ConnectBlock does not run these scripts again. The signatures
+        // are all in the signature cache by now, so this is cheap.
+        unsigned int nextBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
+        if (!CheckInputs(tx, state, view, true, nextBlockScriptVerifyFlags, true, true, txdata))
+        {
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against next-block but not STANDARD flags %s, %s",
+                __func__, hash.ToString(), FormatStateMessage(state));
+        }
+
         // Remove conflicting transactions from the mempool
         BOOST_FOREACH(const CTxMemPool::txiter it, allConflicting)
         {
@@ -1529,6 +1768,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                     hash.ToString(),
                     FormatMoney(nModifiedFees - nConflictingFees),
                     (int)nSize - (int)nConflictingSize);
+            AddToCompactExtraTransactions(it->GetSharedTx());
         }
         pool.RemoveStaged(allConflicting, false);
 
@@ -1543,6 +1783,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         }
     }
 
+    MarkShortTxIdKnown(hash);
     SyncWithWallets(tx, NULL);
 
     return true;
@@ -2058,8 +2299,33 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
+namespace {
+/**
+ * Transactions whose scripts all passed with given flags, as
+ * SHA256(nonce || wtxid || flags). Filled by AcceptToMemoryPool with the
+ * flags of the next block, so ConnectBlock can skip script checks entirely
+ * for transactions it already saw in the mempool.
+ */
+CCuckooCache scriptExecutionCache;
+uint256 scriptExecutionCacheNonce;
+}
+
+void InitScriptExecutionCache()
+{
+    // Half of -maxsigcachesize goes to the script execution cache, the other half to the signature cache
+    GetRandBytes(scriptExecutionCacheNonce.begin(), 32);
+    int64_t nMaxCacheSize = std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2);
+    size_t nBytes = std::min(nMaxCacheSize, MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    uint32_t nEntries = scriptExecutionCache.setup_bytes(nBytes);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %u elements\n",
+              scriptExecutionCache.DynamicMemoryUsage() >> 20, nBytes >> 20, nEntries);
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks, bool* pfScriptsCached)
 {
+    if (pfScriptsCached)
+        *pfScriptsCached = false;
+
     if (!tx.IsCoinBase())
     {
         if (!Consensus::CheckTxInputs(tx, state, inputs, GetSpendHeight(inputs)))
@@ -2079,13 +2345,24 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // the checkpoint is for a chain that's invalid due to false scriptSigs
         // this optimization would allow an invalid chain to be accepted.
         if (fScriptChecks) {
+            // First check whether all scripts were already run with the same flags.
+            // The spent outputs are committed to by the prevouts in the wtxid, so
+            // the entry also covers the scriptPubKeys and amounts in inputs.
+            uint256 hashCacheEntry;
+            CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetWitnessHash().begin(), 32).Write((const unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
+                if (pfScriptsCached)
+                    *pfScriptsCached = true;
+                return true;
+            }
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(*coins, tx, i, flags, cacheSigStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2098,7 +2375,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2112,6 +2389,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            if (cacheFullScriptStore && !pvChecks) {
+                // All scripts were run and passed here, remember that
+                scriptExecutionCache.insert(hashCacheEntry);
+            }
         }
     }
 
@@ -2325,7 +2607,7 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("ixcoin-scriptch");
@@ -2377,6 +2659,43 @@ public:
 // Protected by cs_main
 static ThresholdConditionCache warningcache[VERSIONBITS_NUM_BITS];
 
+/** Returns the script flags which should be checked for a block built on pindexPrev. */
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev, const Consensus::Params& consensusparams)
+{
+    const int nHeight = pindexPrev->nHeight + 1;
+
+    // BIP16 didn't become active until Apr 1 2012
+    // FIXME: Enable BIP16 at some time.
+    //int64_t nBIP16SwitchTime = 1333238400;
+    //bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
+    bool fStrictPayToScriptHash = false;
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rule
+    if (nHeight >= consensusparams.BIP66Height) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY (BIP65) rule
+    if (nHeight >= consensusparams.BIP65Height) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindexPrev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    // Start enforcing WITNESS rules using versionbits logic.
+    if (IsWitnessEnabled(pindexPrev, consensusparams)) {
+        flags |= SCRIPT_VERIFY_WITNESS;
+        flags |= SCRIPT_VERIFY_NULLDUMMY;
+    }
+
+    return flags;
+}
+
 static int64_t nTimeCheck = 0;
 static int64_t nTimeForks = 0;
 static int64_t nTimeVerify = 0;
@@ -2384,6 +2703,8 @@ static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
+static int64_t nBlockInputs = 0;
+static int64_t nBlockInputsScriptsCached = 0;
 
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                   CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
@@ -2455,49 +2776,29 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    // BIP16 didn't become active until Apr 1 2012
-    // FIXME: Enable BIP16 at some time.
-    //int64_t nBIP16SwitchTime = 1333238400;
-    //bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-    bool fStrictPayToScriptHash = false;
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rule
-    if (pindex->nHeight >= chainparams.GetConsensus().BIP66Height) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY (BIP65) rule
-    if (pindex->nHeight >= chainparams.GetConsensus().BIP65Height) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
+    // Get the script flags for this block
+    unsigned int flags = GetBlockScriptFlags(pindex->pprev, chainparams.GetConsensus());
 
-    // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    // Start enforcing BIP68 (sequence locks) together with BIP112 (CHECKSEQUENCEVERIFY).
     int nLockTimeFlags = 0;
-    if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    if (flags & SCRIPT_VERIFY_CHECKSEQUENCEVERIFY) {
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
-    // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_WITNESS;
-        flags |= SCRIPT_VERIFY_NULLDUMMY;
-    }
-
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
     CBlockUndo blockundo;
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    std::vector<CCheckQueueWorkerStats> vWorkerStats = scriptcheckqueue.GetWorkerStats();
 
     std::vector<uint256> vOrphanErase;
     std::vector<int> prevheights;
     CAmount nFees = 0;
     CAmount nMiningFundIncrease = 0;
     int nInputs = 0;
+    int nInputsScriptsCached = 0;
     int64_t nSigOpsCost = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
@@ -2558,9 +2859,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
+            bool fScriptsCached = false;
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL, &fScriptsCached))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
+            if (fScriptsCached)
+                nInputsScriptsCached += tx.vin.size();
             control.Add(vChecks);
         }
 
@@ -2601,6 +2905,21 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
+    nBlockInputs += nInputs - 1; nBlockInputsScriptsCached += nInputsScriptsCached;
+    LogPrint("bench", "      - Script execution cache: %u/%u txins (%.1f%%) [%.1f%%]\n", nInputsScriptsCached, nInputs - 1, nInputs <= 1 ? 0.0 : 100.0 * nInputsScriptsCached / (nInputs - 1), nBlockInputs == 0 ? 0.0 : 100.0 * nBlockInputsScriptsCached / nBlockInputs);
+    if (nScriptCheckThreads && fScriptChecks) {
+        // Time the script check threads spent waiting for the checks of this block, and how much they had to steal
+        std::vector<CCheckQueueWorkerStats> vWorkerStatsAfter = scriptcheckqueue.GetWorkerStats();
+        int64_t nIdleMicros = 0, nMaxIdleMicros = 0;
+        uint64_t nSteals = 0;
+        for (unsigned int i = 1; i < vWorkerStatsAfter.size(); i++) {
+            int64_t nWorkerIdle = vWorkerStatsAfter[i].nIdleMicros - (i < vWorkerStats.size() ? vWorkerStats[i].nIdleMicros : 0);
+            nIdleMicros += nWorkerIdle;
+            nMaxIdleMicros = std::max(nMaxIdleMicros, nWorkerIdle);
+            nSteals += vWorkerStatsAfter[i].nSteals - (i < vWorkerStats.size() ? vWorkerStats[i].nSteals : 0);
+        }
+        LogPrint("bench", "      - Script check threads: %.2fms idle (%.2fms max per thread), %u batches stolen\n", 0.001 * nIdleMicros, 0.001 * nMaxIdleMicros, nSteals);
+    }
 
     if (fJustCheck)
         return true;
@@ -2918,7 +3237,7 @@ static int64_t nTimePostConnect = 0;
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
  */
-bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const CBlock* pblock, std::list<CTransaction> &txConflicted, std::vector<std::tuple<CTransaction,CBlockIndex*,int>> &txChanged)
+bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const CBlock* pblock, std::vector<std::shared_ptr<const CTransaction> > &txConflicted, std::vector<std::tuple<CTransaction,CBlockIndex*,int>> &txChanged)
 {
     assert(pindexNew->pprev == chainActive.Tip());
     // Read block from disk.
@@ -3042,7 +3361,7 @@ static void PruneBlockIndexCandidates() {
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
  */
-static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const CBlock* pblock, bool& fInvalidFound, std::list<CTransaction>& txConflicted, std::vector<std::tuple<CTransaction,CBlockIndex*,int>>& txChanged)
+static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const CBlock* pblock, bool& fInvalidFound, std::vector<std::shared_ptr<const CTransaction> >& txConflicted, std::vector<std::tuple<CTransaction,CBlockIndex*,int>>& txChanged)
 {
     AssertLockHeld(cs_main);
     const CBlockIndex *pindexOldTip = chainActive.Tip();
@@ -3154,7 +3473,7 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
             break;
 
         const CBlockIndex *pindexFork;
-        std::list<CTransaction> txConflicted;
+        std::vector<std::shared_ptr<const CTransaction> > txConflicted;
         bool fInitialDownload;
         int nNewHeight;
         {
@@ -3189,9 +3508,9 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
 
         // throw all transactions though the signal-interface
         // while _not_ holding the cs_main lock
-        BOOST_FOREACH(const CTransaction &tx, txConflicted)
+        BOOST_FOREACH(const std::shared_ptr<const CTransaction> &ptx, txConflicted)
         {
-            SyncWithWallets(tx, pindexNewTip);
+            SyncWithWallets(*ptx, pindexNewTip);
         }
         // ... and about transactions that got confirmed:
         for(unsigned int i = 0; i < txChanged.size(); i++)
@@ -3600,6 +3919,7 @@ void UpdateUncommittedBlockStructures(CBlock& block, const CBlockIndex* pindexPr
         block.vtx[0].wit.vtxinwit.resize(1);
         block.vtx[0].wit.vtxinwit[0].scriptWitness.stack.resize(1);
         block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0] = nonce;
+        block.vtx[0].UpdateHash();
     }
 }
 
@@ -3875,7 +4195,8 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, C
 {
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = pfrom ? MarkBlockAsReceived(pblock->GetHash(), pfrom->GetId(), ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION))
+                                : MarkBlockAsReceived(pblock->GetHash());
         fRequested |= fForceProcessing;
 
         // Store to disk
@@ -4416,6 +4737,7 @@ void UnloadBlockIndex()
     setDirtyFileInfo.clear();
     mapNodeState.clear();
     recentRejects.reset(NULL);
+    filterShortTxIdsKnown.reset(NULL);
     versionbitscache.Clear();
     for (int b = 0; b < VERSIONBITS_NUM_BITS; b++) {
         warningcache[b].clear();
@@ -4442,6 +4764,9 @@ bool InitBlockIndex(const CChainParams& chainparams)
 
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    filterShortTxIdsKnown.reset(new CRollingBloomFilter(120000, 0.000001));
+    nShortTxIdSalt = GetRand(std::numeric_limits<uint64_t>::max());
+    TransactionShortIDs::GetShortIDKeys(nShortTxIdSalt, shorttxidk0, shorttxidk1);
 
     // Check whether we're already initialized
     if (chainActive.Genesis() != NULL)
@@ -4900,6 +5225,125 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman& connma
     connman.ForEachNodeThen(std::move(sortfunc), std::move(pushfunc));
 }
 
+namespace {
+/** Recently served blocks, already serialized as block messages. A new block is
+ *  requested by most peers within seconds, and syncing peers fetch the same old
+ *  blocks, so they share one disk read and one serialized buffer. */
+class CBlockMessageCache
+{
+    struct Entry
+    {
+        uint256 hash;
+        int nVersion;
+        CSendBufferRef msg;
+    };
+    std::deque<Entry> vEntries; // most recently added first
+    CCriticalSection cs;
+
+public:
+    CSendBufferRef Get(const uint256& hash, int nVersion)
+    {
+        LOCK(cs);
+        BOOST_FOREACH(const Entry& entry, vEntries) {
+            if (entry.hash == hash && entry.nVersion == nVersion)
+                return entry.msg;
+        }
+        return CSendBufferRef();
+    }
+
+    void Add(const uint256& hash, int nVersion, const CSendBufferRef& msg)
+    {
+        LOCK(cs);
+        BOOST_FOREACH(const Entry& entry, vEntries) {
+            if (entry.hash == hash && entry.nVersion == nVersion)
+                return;
+        }
+        vEntries.push_front(Entry{hash, nVersion, msg});
+        if (vEntries.size() > MAX_BLOCK_MESSAGE_CACHE)
+            vEntries.pop_back();
+    }
+};
+
+CBlockMessageCache blockMessageCache;
+
+/** A served block together with the bloom filter elements of its transactions. */
+struct CFilterableBlock
+{
+    CBlock block;
+    std::vector<CBloomTxElements> vTxElements;
+
+    explicit CFilterableBlock(const CBlock& blockIn) : block(blockIn)
+    {
+        vTxElements.reserve(block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vTxElements.push_back(CBloomTxElements(tx));
+    }
+};
+
+/** Recently served filtered blocks. Every SPV peer requests the new block as
+ *  a merkleblock, so the block is read and parsed once for all of their filters. */
+class CFilteredBlockCache
+{
+    std::deque<std::pair<uint256, std::shared_ptr<const CFilterableBlock> > > vEntries; // most recently added first
+    CCriticalSection cs;
+
+public:
+    std::shared_ptr<const CFilterableBlock> Get(const uint256& hash)
+    {
+        LOCK(cs);
+        for (const auto& entry : vEntries) {
+            if (entry.first == hash)
+                return entry.second;
+        }
+        return std::shared_ptr<const CFilterableBlock>();
+    }
+
+    void Add(const uint256& hash, const std::shared_ptr<const CFilterableBlock>& pblock)
+    {
+        LOCK(cs);
+        for (const auto& entry : vEntries) {
+            if (entry.first == hash)
+                return;
+        }
+        vEntries.push_front(std::make_pair(hash, pblock));
+        if (vEntries.size() > MAX_FILTERED_BLOCK_CACHE)
+            vEntries.pop_back();
+    }
+};
+
+CFilteredBlockCache filteredBlockCache;
+
+/** Bloom filter elements of recently announced transactions. A transaction is
+ *  matched against the filter of every SPV peer within a few trickles, so it
+ *  is parsed once for all of them. */
+class CTxBloomElementsCache
+{
+    std::map<uint256, std::shared_ptr<const CBloomTxElements> > mapElements;
+    std::deque<uint256> vOrder; // insertion order, oldest first
+    CCriticalSection cs;
+
+public:
+    std::shared_ptr<const CBloomTxElements> Get(const CTransaction& tx)
+    {
+        LOCK(cs);
+        const uint256& hash = tx.GetHash();
+        auto it = mapElements.find(hash);
+        if (it != mapElements.end())
+            return it->second;
+        std::shared_ptr<const CBloomTxElements> pelements = std::make_shared<const CBloomTxElements>(tx);
+        mapElements.insert(std::make_pair(hash, pelements));
+        vOrder.push_back(hash);
+        if (vOrder.size() > MAX_TX_BLOOM_ELEMENTS_CACHE) {
+            mapElements.erase(vOrder.front());
+            vOrder.pop_front();
+        }
+        return pelements;
+    }
+};
+
+CTxBloomElementsCache txBloomElementsCache;
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams, CConnman& connman)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4907,141 +5351,188 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
+    // Block reads happen outside cs_main, so that serving historical blocks
+    // to one peer does not stall message processing for the others.
+    CInv invBlock;
+    CDiskBlockPos posBlock;
+    bool fCompactBlock = false;
+    uint256 hashContinueTip;
 
-    while (it != pfrom->vRecvGetData.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= nMaxSendBufferSize)
-            break;
+    {
+        LOCK(cs_main);
 
-        const CInv &inv = *it;
-        {
-            boost::this_thread::interruption_point();
-            it++;
+        while (it != pfrom->vRecvGetData.end()) {
+            // Don't bother if send buffer is too full to respond anyway
+            if (pfrom->nSendSize >= nMaxSendBufferSize)
+                break;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+            const CInv &inv = *it;
             {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
-                {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
-                        }
-                    }
-                }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && connman.OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
-                {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                boost::this_thread::interruption_point();
+                it++;
 
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
-                }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_FILTERED_BLOCK)
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
                     {
-                        bool sendMerkleBlock = false;
-                        CMerkleBlock merkleBlock;
-                        {
-                            LOCK(pfrom->cs_filter);
-                            if (pfrom->pfilter) {
-                                sendMerkleBlock = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
                             }
                         }
-                        if (sendMerkleBlock) {
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
-                        }
-                        // else
-                            // no response
                     }
-                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    if (send && connman.OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                     {
+                        // Remember what to send; the block itself is read from disk
+                        // and pushed after cs_main has been released.
+                        invBlock = inv;
+                        posBlock = mi->second->GetBlockPos();
                         // If a peer is asking for old blocks, we're almost guaranteed
                         // they wont have a useful mempool to match against a compact block,
                         // and we don't feel like constructing the object for them, so
                         // instead we respond with the full, non-compact block.
-                        if (mi->second->nHeight >= chainActive.Height() - 10) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block);
-                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
-                        } else
-                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    }
+                        fCompactBlock = mi->second->nHeight >= chainActive.Height() - 10;
 
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage(NetMsgType::INV, vInv);
-                        pfrom->hashContinue.SetNull();
+                        // Trigger the peer node to send a getblocks request for the next batch of inventory
+                        if (inv.hash == pfrom->hashContinue)
+                        {
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                            pfrom->hashContinue.SetNull();
+                        }
                     }
                 }
-            }
-            else if (inv.type == MSG_TX || inv.type == MSG_WITNESS_TX)
-            {
-                // Send stream from relay memory
-                bool push = false;
-                auto mi = mapRelay.find(inv.hash);
-                if (mi != mapRelay.end()) {
-                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *mi->second);
-                    push = true;
-                } else if (pfrom->timeLastMempoolReq) {
-                    auto txinfo = mempool.info(inv.hash);
-                    // To protect privacy, do not answer getdata using the mempool when
-                    // that TX couldn't have been INVed in reply to a MEMPOOL request.
-                    if (txinfo.tx && txinfo.nTime <= pfrom->timeLastMempoolReq) {
-                        pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *txinfo.tx);
+                else if (inv.type == MSG_TX || inv.type == MSG_WITNESS_TX)
+                {
+                    // Send stream from relay memory
+                    bool push = false;
+                    auto mi = mapRelay.find(inv.hash);
+                    if (mi != mapRelay.end()) {
+                        pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *mi->second);
                         push = true;
+                    } else if (pfrom->timeLastMempoolReq) {
+                        auto txinfo = mempool.info(inv.hash);
+                        // To protect privacy, do not answer getdata using the mempool when
+                        // that TX couldn't have been INVed in reply to a MEMPOOL request.
+                        if (txinfo.tx && txinfo.nTime <= pfrom->timeLastMempoolReq) {
+                            pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *txinfo.tx);
+                            push = true;
+                        }
+                    }
+                    if (!push) {
+                        vNotFound.push_back(inv);
                     }
                 }
-                if (!push) {
-                    vNotFound.push_back(inv);
-                }
+
+                // Track requests for our stuff.
+                GetMainSignals().Inventory(inv.hash);
+
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+                    break;
             }
+        }
+    }
 
-            // Track requests for our stuff.
-            GetMainSignals().Inventory(inv.hash);
+    if (!posBlock.IsNull())
+    {
+        // Full blocks are shared with other peers asking for the same block
+        bool fFullBlock = invBlock.type == MSG_BLOCK || invBlock.type == MSG_WITNESS_BLOCK;
+        int nBlockVersion = pfrom->ssSend.GetVersion() | (invBlock.type == MSG_BLOCK ? SERIALIZE_TRANSACTION_NO_WITNESS : 0);
+        CSendBufferRef msgBlock;
+        if (fFullBlock)
+            msgBlock = blockMessageCache.Get(invBlock.hash, nBlockVersion);
+
+        // Filtered blocks are parsed once for all filtered peers asking for the same block
+        std::shared_ptr<const CFilterableBlock> pfilterable;
+        if (invBlock.type == MSG_FILTERED_BLOCK)
+            pfilterable = filteredBlockCache.Get(invBlock.hash);
+
+        // Send block from disk
+        CBlock block;
+        if (msgBlock)
+            pfrom->PushSerializedMessage(NetMsgType::BLOCK, msgBlock);
+        else if (!pfilterable && (!ReadBlockFromDisk(block, posBlock, consensusParams) || block.GetHash() != invBlock.hash)) {
+            // The block may have been pruned since cs_main was released.
+            if (!fPruneMode)
+                assert(!"cannot load block from disk");
+            LogPrint("net", "%s: block %s was pruned before it could be sent to peer=%d\n", __func__, invBlock.hash.ToString(), pfrom->GetId());
+        }
+        else if (fFullBlock)
+        {
+            msgBlock = SerializeNetMessage(nBlockVersion, NetMsgType::BLOCK, block);
+            blockMessageCache.Add(invBlock.hash, nBlockVersion, msgBlock);
+            pfrom->PushSerializedMessage(NetMsgType::BLOCK, msgBlock);
+        }
+        else if (invBlock.type == MSG_FILTERED_BLOCK)
+        {
+            if (!pfilterable) {
+                pfilterable = std::make_shared<const CFilterableBlock>(block);
+                filteredBlockCache.Add(invBlock.hash, pfilterable);
+            }
+            bool sendMerkleBlock = false;
+            CMerkleBlock merkleBlock;
+            {
+                LOCK(pfrom->cs_filter);
+                if (pfrom->pfilter) {
+                    sendMerkleBlock = true;
+                    merkleBlock = CMerkleBlock(pfilterable->block, *pfrom->pfilter, pfilterable->vTxElements);
+                }
+            }
+            if (sendMerkleBlock) {
+                pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                // This avoids hurting performance by pointlessly requiring a round-trip
+                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                // they must either disconnect and retry or request the full block.
+                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                // however we MUST always provide at least what the remote peer needs
+                typedef std::pair<unsigned int, uint256> PairType;
+                BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                    pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, pfilterable->block.vtx[pair.first]);
+            }
+            // else
+                // no response
+        }
+        else if (invBlock.type == MSG_CMPCT_BLOCK)
+        {
+            if (fCompactBlock) {
+                CBlockHeaderAndShortTxIDs cmpctblock(block);
+                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+            } else
+                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+        }
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
-                break;
+        if (!hashContinueTip.IsNull())
+        {
+            // Bypass PushInventory, this must send even if redundant,
+            // and we want it right after the last block so they don't
+            // wait for other stuff first.
+            vector<CInv> vInv;
+            vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
+            pfrom->PushMessage(NetMsgType::INV, vInv);
         }
     }
 
@@ -5276,6 +5767,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             uint64_t nCMPCTBLOCKVersion = 1;
             pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
         }
+        if (pfrom->nVersion >= SHORT_TXIDS_RELAY_VERSION && fRelayTxes && GetBoolArg("-shorttxrelay", DEFAULT_SHORT_TX_RELAY)) {
+            // Ask our peer to announce transactions to us by short ids, salted
+            // the same way for all our peers
+            uint64_t nShortTxVersion = 1;
+            pfrom->PushMessage(NetMsgType::SENDSHORTTX, nShortTxVersion, nShortTxIdSalt);
+        }
     }
 
 
@@ -5343,6 +5840,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     }
 
+    else if (strCommand == NetMsgType::SENDSHORTTX)
+    {
+        uint64_t nShortTxVersion = 0;
+        uint64_t nSalt = 0;
+        vRecv >> nShortTxVersion >> nSalt;
+        if (nShortTxVersion == 1 && GetBoolArg("-shorttxrelay", DEFAULT_SHORT_TX_RELAY)) {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            nodestate->fShortTxInv = true;
+            TransactionShortIDs::GetShortIDKeys(nSalt, nodestate->shorttxidk0, nodestate->shorttxidk1);
+            nodestate->mapShortTxIdsAnnounced.clear();
+            nodestate->vShortTxIdsExpiration.clear();
+        }
+    }
+
 
     else if (strCommand == NetMsgType::INV)
     {
@@ -5431,6 +5943,75 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == NetMsgType::SHORTTXINV)
+    {
+        TransactionShortIDs announced;
+        vRecv >> announced;
+        if (announced.shorttxids.size() > MAX_INV_SZ)
+        {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message shorttxinv size() = %u", announced.shorttxids.size());
+        }
+
+        bool fBlocksOnly = !fRelayTxes;
+
+        // Allow whitelisted peers to send data other than blocks in blocks only mode if whitelistrelay is true
+        if (pfrom->fWhitelisted && GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))
+            fBlocksOnly = false;
+
+        if (fBlocksOnly) {
+            LogPrint("net", "transaction shorttxinv sent in violation of protocol peer=%d\n", pfrom->id);
+            return true;
+        }
+
+        LOCK(cs_main);
+
+        CNodeState* nodestate = State(pfrom->GetId());
+        bool fAskFor = !fImporting && !fReindex && !IsInitialBlockDownload();
+        unsigned int nNew = 0;
+        BOOST_FOREACH(uint64_t shortid, announced.shorttxids) {
+            {
+                // So we don't announce it back to the peer that told us about it
+                LOCK(pfrom->cs_inventory);
+                pfrom->filterInventoryKnown.insert(ShortTxIdKey(shortid));
+            }
+            if (fAskFor && !AlreadyHaveShortTxId(shortid)) {
+                AskForShortTx(nodestate, shortid);
+                nNew++;
+            }
+        }
+        LogPrint("net", "got shorttxinv (%u ids, %u new) peer=%d\n", announced.shorttxids.size(), nNew, pfrom->id);
+    }
+
+
+    else if (strCommand == NetMsgType::GETSHORTTX)
+    {
+        TransactionShortIDs requested;
+        vRecv >> requested;
+        if (requested.shorttxids.size() > MAX_INV_SZ)
+        {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message getshorttx size() = %u", requested.shorttxids.size());
+        }
+
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            int nTxType = nodestate->fHaveWitness ? MSG_WITNESS_TX : MSG_TX;
+            BOOST_FOREACH(uint64_t shortid, requested.shorttxids) {
+                std::map<uint64_t, uint256>::const_iterator it = nodestate->mapShortTxIdsAnnounced.find(shortid);
+                if (it != nodestate->mapShortTxIdsAnnounced.end())
+                    pfrom->vRecvGetData.push_back(CInv(nTxType, it->second));
+                else
+                    LogPrint("net", "unknown short txid %012x requested peer=%d\n", shortid, pfrom->id);
+            }
+        }
+        ProcessGetData(pfrom, chainparams.GetConsensus(), connman);
+    }
+
+
     else if (strCommand == NetMsgType::GETDATA)
     {
         vector<CInv> vInv;
@@ -5502,6 +6083,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         BlockTransactionsRequest req;
         vRecv >> req;
 
+        LOCK(cs_main);
+
         BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
         if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
             LogPrintf("Peer %d sent us a getblocktxn for a block we don't have", pfrom->id);
@@ -5624,6 +6207,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv.hash);
+        State(pfrom->GetId())->setShortTxAskFor.erase(GetOwnShortTxId(inv.hash));
+        MarkShortTxIdKnown(inv.hash);
 
         if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
             mempool.check(pcoinsTip);
@@ -5839,7 +6424,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 }
 
                 PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
-                ReadStatus status = partialBlock.InitData(cmpctblock);
+                ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
                 if (status == READ_STATUS_INVALID) {
                     MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
                     Misbehaving(pfrom->GetId(), 100);
@@ -5858,6 +6443,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     if (!partialBlock.IsTxAvailable(i))
                         req.indexes.push_back(i);
                 }
+
+                compactBlockStats.nBlocks++;
+                compactBlockStats.nTxTotal += cmpctblock.BlockTxCount();
+                compactBlockStats.nTxPrefilled += partialBlock.GetPrefilledCount();
+                compactBlockStats.nTxFromMempool += partialBlock.GetMempoolCount();
+                compactBlockStats.nTxFromExtra += partialBlock.GetExtraCount();
+                compactBlockStats.nTxRequested += req.indexes.size();
+                if (req.indexes.empty()) {
+                    compactBlockStats.nBlocksWithoutRequest++;
+                    if (partialBlock.GetExtraCount() > 0)
+                        compactBlockStats.nRoundTripsSaved++;
+                }
                 if (req.indexes.empty()) {
                     // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
                     BlockTransactions txn;
@@ -6154,7 +6751,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = connman.GetAddresses();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -6434,7 +7034,7 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        const uint256& hash = msg.GetMessageHash();
         if (memcmp(hash.begin(), hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) != 0)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR expected %s was %s\n", __func__,
@@ -6444,8 +7044,12 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
             continue;
         }
 
+        int64_t nProcessStart = GetTimeMicros();
+        pfrom->RecordQueueWait(nProcessStart - msg.nTime);
+
         // Process message
         bool fRet = false;
+        StartLockHoldTimer(&cs_main);
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman);
@@ -6482,6 +7086,8 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        int64_t nLockHeld = StopLockHoldTimer();
+        connman.RecordMessageTiming(pfrom, strCommand, nProcessStart - msg.nTime, GetTimeMicros() - nProcessStart, nLockHeld);
 
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -6566,28 +7172,39 @@ bool SendMessages(CNode* pto, CConnman& connman)
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            // Other peers' message handler threads add to vAddrToSend, so
+            // take the pending addresses under its lock and push them after.
+            vector<CAddress> vAddrPending;
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_vAddrToSend);
+                vAddrPending.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage(NetMsgType::ADDR, vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddrPending.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+                // we only send the big addr message once
+                if (pto->vAddrToSend.capacity() > 40)
+                    pto->vAddrToSend.shrink_to_fit();
+            }
+            vector<CAddress> vAddr;
+            vAddr.reserve(std::min(vAddrPending.size(), (size_t)1000));
+            BOOST_FOREACH(const CAddress& addr, vAddrPending)
+            {
+                vAddr.push_back(addr);
+                // receiver rejects addr messages larger than 1000
+                if (vAddr.size() >= 1000)
+                {
+                    pto->PushMessage(NetMsgType::ADDR, vAddr);
+                    vAddr.clear();
+                }
             }
-            pto->vAddrToSend.clear();
             if (!vAddr.empty())
                 pto->PushMessage(NetMsgType::ADDR, vAddr);
-            // we only send the big addr message once
-            if (pto->vAddrToSend.capacity() > 40)
-                pto->vAddrToSend.shrink_to_fit();
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -6769,6 +7386,7 @@ bool SendMessages(CNode* pto, CConnman& connman)
         // Message: inventory
         //
         vector<CInv> vInv;
+        TransactionShortIDs shortInv;
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(std::max<size_t>(pto->vInventoryBlockToSend.size(), INVENTORY_BROADCAST_MAX));
@@ -6863,6 +7481,10 @@ bool SendMessages(CNode* pto, CConnman& connman)
                     if (pto->filterInventoryKnown.contains(hash)) {
                         continue;
                     }
+                    // Or announced to us by the peer with our short id
+                    if (state.fShortTxInv && pto->filterInventoryKnown.contains(ShortTxIdKey(GetOwnShortTxId(hash)))) {
+                        continue;
+                    }
                     // Not in the mempool anymore? don't bother sending it.
                     auto txinfo = mempool.info(hash);
                     if (!txinfo.tx) {
@@ -6871,9 +7493,10 @@ bool SendMessages(CNode* pto, CConnman& connman)
                     if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
                         continue;
                     }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
-                    // Send
-                    vInv.push_back(CInv(MSG_TX, hash));
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txBloomElementsCache.Get(*txinfo.tx))) continue;
+                    // Send, by short id if the peer asked for it and the id is unambiguous
+                    if (!state.fShortTxInv || !AddShortTxAnnouncement(state, hash, nNow, shortInv.shorttxids))
+                        vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
                     {
                         // Expire old relay messages
@@ -6892,12 +7515,18 @@ bool SendMessages(CNode* pto, CConnman& connman)
                         pto->PushMessage(NetMsgType::INV, vInv);
                         vInv.clear();
                     }
+                    if (shortInv.shorttxids.size() == MAX_INV_SZ) {
+                        pto->PushMessage(NetMsgType::SHORTTXINV, shortInv);
+                        shortInv.shorttxids.clear();
+                    }
                     pto->filterInventoryKnown.insert(hash);
                 }
             }
         }
         if (!vInv.empty())
             pto->PushMessage(NetMsgType::INV, vInv);
+        if (!shortInv.shorttxids.empty())
+            pto->PushMessage(NetMsgType::SHORTTXINV, shortInv);
 
         // Detect whether we're stalling
         nNow = GetTimeMicros();
@@ -6926,10 +7555,12 @@ bool SendMessages(CNode* pto, CConnman& connman)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nBlocksInTransitQuota = GetBlocksInTransitQuota(state);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlocksInTransitQuota) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            CBlockIndex *pindexWaitingFor = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInTransitQuota - state.nBlocksInFlight, vToDownload, staller, pindexWaitingFor, consensusParams);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -6937,6 +7568,15 @@ bool SendMessages(CNode* pto, CConnman& connman)
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            // With room to spare, take over the block everyone is waiting for if its peer is too slow.
+            if (pindexWaitingFor && state.nBlocksInFlight < nBlocksInTransitQuota &&
+                ShouldRerequestBlock(pto->GetId(), pindexWaitingFor->GetBlockHash(), nNow)) {
+                LogPrint("net", "Requesting slow block %s (%d) peer=%d, was in flight from peer=%d\n", pindexWaitingFor->GetBlockHash().ToString(),
+                    pindexWaitingFor->nHeight, pto->id, mapBlocksInFlight[pindexWaitingFor->GetBlockHash()].first);
+                uint32_t nFetchFlags = GetFetchFlags(pto, pindexWaitingFor->pprev, consensusParams);
+                vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindexWaitingFor->GetBlockHash()));
+                MarkBlockAsInFlight(pto->GetId(), pindexWaitingFor->GetBlockHash(), consensusParams, pindexWaitingFor);
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -6970,6 +7610,28 @@ bool SendMessages(CNode* pto, CConnman& connman)
         if (!vGetData.empty())
             pto->PushMessage(NetMsgType::GETDATA, vGetData);
 
+        //
+        // Message: getshorttx
+        //
+        TransactionShortIDs shortGetData;
+        while (!pto->fDisconnect && !state.mapShortTxAskFor.empty() && state.mapShortTxAskFor.begin()->first <= nNow)
+        {
+            uint64_t shortid = state.mapShortTxAskFor.begin()->second;
+            if (!AlreadyHaveShortTxId(shortid)) {
+                shortGetData.shorttxids.push_back(shortid);
+                if (shortGetData.shorttxids.size() >= 1000) {
+                    pto->PushMessage(NetMsgType::GETSHORTTX, shortGetData);
+                    shortGetData.shorttxids.clear();
+                }
+            } else {
+                //If we're not going to ask, don't expect a response.
+                state.setShortTxAskFor.erase(shortid);
+            }
+            state.mapShortTxAskFor.erase(state.mapShortTxAskFor.begin());
+        }
+        if (!shortGetData.shorttxids.empty())
+            pto->PushMessage(NetMsgType::GETSHORTTX, shortGetData);
+
         //
         // Message: feefilter
         //
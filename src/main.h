@@ -58,6 +58,8 @@ static const CAmount HIGH_TX_FEE_PER_KB = 0.01 * COIN;
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default number of recently seen non-mempool transactions kept for compact block reconstruction */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** Expiration time for orphan transactions in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** Minimum time between orphan transactions expire time checks in seconds */
@@ -80,11 +82,27 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 
 /** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+static const int MAX_SCRIPTCHECK_THREADS = 128;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its download speed is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks in flight from a single peer once its download speed is known. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE = 64;
+/** Per-peer block requests are sized to keep this much of the peer's download time queued (in microseconds). */
+static const int64_t BLOCK_DOWNLOAD_QUEUE_TIME = 4 * 1000000;
+/** A block holding back the download window is requested from a faster peer once it has been in flight
+ *  this many times longer than its peer was expected to take... */
+static const int BLOCK_REREQUEST_FACTOR = 3;
+/** ...and at least this long (in microseconds). */
+static const int64_t BLOCK_REREQUEST_MIN_TIME = 2 * 1000000;
+/** Number of recently served blocks kept serialized for other peers requesting them. */
+static const unsigned int MAX_BLOCK_MESSAGE_CACHE = 4;
+/** Number of recently served blocks kept parsed for bloom filtering, for other filtered peers requesting them. */
+static const unsigned int MAX_FILTERED_BLOCK_CACHE = 4;
+/** Number of relayed transactions kept parsed for bloom filtering, for the other filtered peers they are announced to. */
+static const unsigned int MAX_TX_BLOOM_ELEMENTS_CACHE = 2000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -131,6 +149,10 @@ static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTE
 static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
 /** Maximum feefilter broadcast delay after significant change. */
 static const unsigned int MAX_FEEFILTER_CHANGE_DELAY = 5 * 60;
+/** Time (in seconds) during which a peer can request a transaction we announced to it by short id. */
+static const unsigned int SHORT_TX_ANNOUNCE_EXPIRY = 15 * 60;
+/** Time (in seconds) to wait for a transaction requested by short id before asking another peer for it. */
+static const unsigned int SHORT_TX_REQUEST_TIMEOUT = 2 * 60;
 /** Block download timeout base, expressed in millionths of the block interval (i.e. 10 min) */
 static const int64_t BLOCK_DOWNLOAD_TIMEOUT_BASE = 1000000;
 /** Additional block download timeout per parallel downloading peer (i.e. 5 min) */
@@ -151,6 +173,8 @@ static const bool DEFAULT_TESTSAFEMODE = false;
 static const bool DEFAULT_ENABLE_REPLACEMENT = true;
 /** Default for using fee filter */
 static const bool DEFAULT_FEEFILTER = true;
+/** Default for -shorttxrelay, announcing transactions by short ids */
+static const bool DEFAULT_SHORT_TX_RELAY = true;
 
 /** Maximum number of headers to announce when relaying blocks with headers message.*/
 static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
@@ -327,11 +351,34 @@ std::string FormatStateMessage(const CValidationState &state);
 /** Get the BIP9 state for a given deployment at the current tip. */
 ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::DeploymentPos pos);
 
+/** Where the transactions of reconstructed compact blocks came from. */
+struct CCompactBlockStats {
+    uint64_t nBlocks;               //!< Compact blocks we started reconstructing
+    uint64_t nBlocksWithoutRequest; //!< ... of which without a getblocktxn round trip
+    uint64_t nRoundTripsSaved;      //!< ... of which only thanks to the extra transaction pool
+    uint64_t nTxTotal;
+    uint64_t nTxPrefilled;
+    uint64_t nTxFromMempool;
+    uint64_t nTxFromExtra;
+    uint64_t nTxRequested;
+    size_t nExtraTxn;               //!< Transactions currently in the extra pool
+
+    CCompactBlockStats() : nBlocks(0), nBlocksWithoutRequest(0), nRoundTripsSaved(0), nTxTotal(0),
+        nTxPrefilled(0), nTxFromMempool(0), nTxFromExtra(0), nTxRequested(0), nExtraTxn(0) {}
+};
+
+/** Get the compact block reconstruction counters. */
+void GetCompactBlockStats(CCompactBlockStats& stats);
+
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int64_t nBlockLatencyAvg;
+    int64_t nBlockIntervalAvg;
+    int64_t nBlockSizeAvg;
+    int nBlocksInTransitQuota;
 };
 
 
@@ -361,13 +408,20 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
  */
 int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& inputs, int flags);
 
+/** Set up the script execution cache, sized by half of -maxsigcachesize */
+void InitScriptExecutionCache();
+
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
  * instead of being performed inline.
+ * Transactions whose scripts all passed with the same flags before are looked up in the script
+ * execution cache and skip script checks; cacheFullScriptStore adds them there after passing
+ * inline checks, and otherwise a hit is removed. pfScriptsCached reports such a hit.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata,
+                 std::vector<CScriptCheck> *pvChecks = NULL, bool* pfScriptsCached = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
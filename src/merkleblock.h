@@ -140,6 +140,12 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    /**
+     * Same as above, with the elements of each transaction in the block
+     * extracted beforehand, so they can be shared by many filters.
+     */
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomTxElements>& vTxElements);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids);
 
@@ -205,9 +205,9 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
 
 bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
 {
-    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+    BOOST_FOREACH(const CTxMemPoolEntry* parent, mempool.GetMemPoolParents(iter))
     {
-        if (!inBlock.count(parent)) {
+        if (!inBlock.count(mempool.mapTx.iterator_to(*parent))) {
             return true;
         }
     }
@@ -579,8 +579,9 @@ void BlockAssembler::addPriorityTxs()
 
             // This tx was successfully added, so
             // add transactions that depend on this one to the priority queue to try again
-            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
+            BOOST_FOREACH(const CTxMemPoolEntry* childEntry, mempool.GetMemPoolChildren(iter))
             {
+                CTxMemPool::txiter child = mempool.mapTx.iterator_to(*childEntry);
                 waitPriIter wpiter = waitPriMap.find(child);
                 if (wpiter != waitPriMap.end()) {
                     vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
@@ -26,6 +26,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -64,6 +65,25 @@
 const static std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
 
 static const uint64_t RANDOMIZER_ID_NETGROUP = 0x6c0edd8036ef4036ULL; // SHA256("netgroup")[0:8]
+
+/** How long the socket handler waits for socket events, in milliseconds */
+static const int SOCKET_WAIT_TIMEOUT = 50;
+/** How often the epoll socket handler walks all nodes for disconnects and timeouts, in milliseconds */
+static const int64_t SOCKET_SWEEP_INTERVAL = 100;
+/** How long to wait before retrying nodes whose locks were held by another thread, in milliseconds */
+static const int SOCKET_BUSY_TIMEOUT = 1;
+/** The most queued messages handed to the kernel in a single sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+/** The number of finished send buffers kept for reuse */
+static const size_t MAX_POOLED_SEND_BUFFERS = 32;
+/** Send buffers above this capacity are freed rather than kept for reuse */
+static const size_t MAX_POOLED_SEND_BUFFER_SIZE = 256 * 1024;
+/** The number of receive buffer size classes */
+static const int RECV_BUFFER_CLASSES = 4;
+/** The number of receive buffers kept in the smallest class; each larger class keeps a quarter */
+static const size_t MAX_POOLED_RECV_BUFFERS = 64;
+/** How far ahead of the received data a receive buffer is grown */
+static const unsigned int RECV_BUFFER_STEP = 256 * 1024;
 //
 // Global state variables
 //
@@ -353,10 +373,14 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
         pszDest ? pszDest : addrConnect.ToString(),
         pszDest ? 0.0 : (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0);
 
-    // Connect
+    // Connect. Direct connections to a known address are not waited for here: the
+    // socket handler finishes them, so several attempts can be in flight at once.
     SOCKET hSocket;
     bool proxyConnectionFailed = false;
-    if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
+    bool fPending = false;
+    proxyType proxy;
+    if (!pszDest && !GetProxy(addrConnect.GetNetwork(), proxy) ? StartConnectSocket(addrConnect, hSocket, fPending) :
+        pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
         if (!IsSelectableSocket(hSocket)) {
@@ -389,8 +413,16 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
 
         // Add node
         CNode* pnode = new CNode(GetNewNodeId(), nLocalServices, GetBestHeight(), hSocket, addrConnect, CalculateKeyedNetGroup(addrConnect), pszDest ? pszDest : "", false);
+        if (fPending) {
+            pnode->fConnecting = true;
+            pnode->nConnectDeadline = GetTimeMillis() + nConnectTimeout;
+        }
         GetNodeSignals().InitializeNode(pnode->GetId(), pnode);
         pnode->AddRef();
+#ifdef USE_EPOLL
+        if (!RegisterSocket(pnode))
+            pnode->fDisconnect = true;
+#endif
 
         {
             LOCK(cs_vNodes);
@@ -663,6 +695,16 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    uint64_t nQueueWaits = nQueueWaitCount;
+    stats.nMsgHandler = 0;
+    stats.dQueueWait = nQueueWaits ? (((double)nQueueWaitUsecTotal) / nQueueWaits / 1e6) : 0.0;
+    stats.dQueueWaitMax = (((double)nQueueWaitUsecMax) / 1e6);
+
+    {
+        LOCK(cs_msgTiming);
+        X(mapMsgTiming);
+    }
 }
 #undef X
 
@@ -715,6 +757,94 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     return true;
 }
 
+namespace {
+/** Receive buffers, grouped in size classes by capacity, so that the buffer of
+ *  a processed message is reused for the next one of similar size. */
+class CRecvBufferPool
+{
+    std::vector<CSerializeData> vClasses[RECV_BUFFER_CLASSES];
+    uint64_t nHits;
+    uint64_t nMisses;
+    size_t nBytes;
+    CCriticalSection cs;
+
+    /** Capacity of the buffers in class n: 1kB, 16kB, 256kB, 4MB. */
+    static size_t ClassSize(int n) { return (size_t)1024 << (4 * n); }
+
+public:
+    CRecvBufferPool() : nHits(0), nMisses(0), nBytes(0) {}
+
+    /** Swap a buffer with room for at least nSize bytes into the empty data. */
+    void Get(CSerializeData& data, size_t nSize)
+    {
+        int n = 0;
+        while (n < RECV_BUFFER_CLASSES - 1 && ClassSize(n) < nSize)
+            n++;
+        {
+            LOCK(cs);
+            if (!vClasses[n].empty()) {
+                data.swap(vClasses[n].back());
+                vClasses[n].pop_back();
+                nBytes -= data.capacity();
+                nHits++;
+                return;
+            }
+            nMisses++;
+        }
+        data.reserve(std::max(nSize, ClassSize(n)));
+    }
+
+    /** Take the buffer out of data, leaving it empty. */
+    void Put(CSerializeData& data)
+    {
+        // Odd sized buffers of huge messages are not worth keeping
+        if (data.capacity() < ClassSize(0) || data.capacity() > 2 * ClassSize(RECV_BUFFER_CLASSES - 1))
+            return;
+        int n = RECV_BUFFER_CLASSES - 1;
+        while (n > 0 && data.capacity() < ClassSize(n))
+            n--;
+        data.clear();
+        LOCK(cs);
+        if (vClasses[n].size() < MAX_POOLED_RECV_BUFFERS >> (2 * n)) {
+            nBytes += data.capacity();
+            vClasses[n].push_back(CSerializeData());
+            vClasses[n].back().swap(data);
+        }
+    }
+
+    void GetStats(CRecvBufferPoolStats& stats)
+    {
+        LOCK(cs);
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nBuffers = 0;
+        for (int n = 0; n < RECV_BUFFER_CLASSES; n++)
+            stats.nBuffers += vClasses[n].size();
+        stats.nBytes = nBytes;
+    }
+};
+
+CRecvBufferPool& GetRecvBufferPool()
+{
+    // Never destroyed: messages may still be freed by other static destructors.
+    static CRecvBufferPool* pool = new CRecvBufferPool();
+    return *pool;
+}
+}
+
+void GetRecvBufferPoolStats(CRecvBufferPoolStats& stats)
+{
+    GetRecvBufferPool().GetStats(stats);
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData data;
+    vRecv.clear();
+    vRecv.Swap(data);
+    GetRecvBufferPool().Put(data);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -743,6 +873,16 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Take a buffer from the pool, but don't trust the announced size for
+    // more than the first 256 KiB.
+    CSerializeData data;
+    GetRecvBufferPool().Get(data, std::min(hdr.nMessageSize, RECV_BUFFER_STEP));
+    vRecv.Swap(data);
+    GetRecvBufferPool().Put(data);
+
+    if (hdr.nMessageSize == 0)
+        hasher.Finalize(hashData.begin());
+
     return nCopy;
 }
 
@@ -751,45 +891,70 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.capacity() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.reserve(std::min(hdr.nMessageSize, nDataPos + nCopy + RECV_BUFFER_STEP));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
+    hasher.Write((const unsigned char*)pch, nCopy);
     nDataPos += nCopy;
 
+    // Only the last round of the double-SHA256 is left when the message completes
+    if (nDataPos == hdr.nMessageSize)
+        hasher.Finalize(hashData.begin());
+
     return nCopy;
 }
 
-
-
-
-
-
-
-
-
 // requires LOCK(cs_vSend)
 size_t SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendBufferRef>::iterator it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
+    // Messages queued while connecting are flushed once the connection is up.
+    if (pnode->fConnecting)
+        return 0;
+
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand as many queued messages as possible to the kernel in one call
+        struct iovec vIov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSendBufferRef>::iterator jt = it; jt != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++jt, ++nIov) {
+            vIov[nIov].iov_base = (void*)(&(**jt)[0] + nOffset);
+            vIov[nIov].iov_len = (*jt)->size() - nOffset;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = (*it)->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -816,6 +981,79 @@ size_t SocketSendData(CNode *pnode)
     return nSentSize;
 }
 
+namespace {
+/** Send buffers of finished messages, kept so that queuing a message does not
+ *  need an allocation. Buffers are returned empty but keep their capacity. */
+class CSendBufferPool
+{
+    std::vector<CSerializeData*> vFree;
+    CCriticalSection cs;
+
+public:
+    CSerializeData* Get()
+    {
+        {
+            LOCK(cs);
+            if (!vFree.empty()) {
+                CSerializeData* pdata = vFree.back();
+                vFree.pop_back();
+                return pdata;
+            }
+        }
+        return new CSerializeData();
+    }
+
+    void Put(CSerializeData* pdata)
+    {
+        // Large buffers (mostly blocks) are freed, the pool is for the
+        // steady stream of small messages.
+        if (pdata->capacity() <= MAX_POOLED_SEND_BUFFER_SIZE) {
+            pdata->clear();
+            LOCK(cs);
+            if (vFree.size() < MAX_POOLED_SEND_BUFFERS) {
+                vFree.push_back(pdata);
+                return;
+            }
+        }
+        delete pdata;
+    }
+};
+
+CSendBufferPool& GetSendBufferPool()
+{
+    // Never destroyed: buffers may be released by other static destructors.
+    static CSendBufferPool* pool = new CSendBufferPool();
+    return *pool;
+}
+
+void ReleaseSendBuffer(const CSerializeData* pdata)
+{
+    GetSendBufferPool().Put(const_cast<CSerializeData*>(pdata));
+}
+}
+
+void BeginSerializedMessage(CDataStream& ss, const char* pszCommand)
+{
+    assert(ss.size() == 0);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+}
+
+CSendBufferRef FinishSerializedMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + CMessageHeader::CHECKSUM_SIZE);
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+
+    CSerializeData* pdata = GetSendBufferPool().Get();
+    ss.Swap(*pdata);
+    return CSendBufferRef(pdata, ReleaseSendBuffer);
+}
+
 struct NodeEvictionCandidate
 {
     NodeId id;
@@ -1027,6 +1265,10 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     GetNodeSignals().InitializeNode(pnode->GetId(), pnode);
     pnode->AddRef();
     pnode->fWhitelisted = whitelisted;
+#ifdef USE_EPOLL
+    if (!RegisterSocket(pnode))
+        pnode->fDisconnect = true;
+#endif
 
     LogPrint("net", "connection from %s accepted\n", addr.ToString());
 
@@ -1036,285 +1278,536 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
-void CConnman::ThreadSocketHandler()
+void CConnman::DisconnectNodes()
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        std::vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        DeleteNode(pnode);
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    DeleteNode(pnode);
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            if(clientInterface)
-                clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
-        }
+    }
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+// Called once the socket of a connecting node is writable or has an error.
+void CConnman::FinishConnect(CNode *pnode)
+{
+    if (!pnode->fConnecting || pnode->hSocket == INVALID_SOCKET)
+        return;
+    if (!FinishConnectSocket(pnode->addr, pnode->hSocket)) {
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    LogPrint("net", "connected to %s peer=%d\n", pnode->addr.ToString(), pnode->id);
+    pnode->nTimeConnected = GetTime();
+    pnode->fConnecting = false;
+}
 
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+void CConnman::InactivityCheck(CNode *pnode)
+{
+    if (pnode->fConnecting) {
+        if (GetTimeMillis() > pnode->nConnectDeadline) {
+            LogPrint("net", "connection to %s timeout\n", pnode->addr.ToString());
+            pnode->fDisconnect = true;
         }
+        return;
+    }
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
+// requires LOCK(cs_vRecvMsg)
+// Returns true if the read filled the whole buffer, so more data may be waiting.
+bool CConnman::SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        bool notify = false;
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+            pnode->CloseSocketDisconnect();
+        if(notify)
+            WakeMessageHandler(pnode);
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        RecordBytesRecv(nBytes);
+        return nBytes == (int)sizeof(pchBuf);
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        if (pnode->nOptimisticBytesWritten) {
-                            RecordBytesSent(pnode->nOptimisticBytesWritten);
-                            pnode->nOptimisticBytesWritten = 0;
-                        }
-                        if (!pnode->vSendMsg.empty()) {
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                            continue;
-                        }
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+void CConnman::ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+#ifdef USE_EPOLL
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+        if (!socketEvents.Add(hListenSocket.socket, &hListenSocket, false))
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(WSAGetLastError()));
+    }
+    int64_t nLastSweep = 0;
+#endif
+    while (true)
+    {
+#ifdef USE_EPOLL
+        // Walking all nodes costs O(peers), so with epoll it is done on a
+        // timer rather than on every wakeup.
+        int64_t nNow = GetTimeMillis();
+        bool fSweep = nNow - nLastSweep >= SOCKET_SWEEP_INTERVAL;
+        if (fSweep)
+            nLastSweep = nNow;
+#else
+        bool fSweep = true;
+#endif
+        if (fSweep) {
+            DisconnectNodes();
+            if(vNodes.size() != nPrevNodeCount) {
+                nPrevNodeCount = vNodes.size();
+                if(clientInterface)
+                    clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+#ifdef USE_EPOLL
+        SocketHandlerEpoll(fSweep);
+#else
+        SocketHandlerSelect();
+#endif
+    }
+}
+
+#ifdef USE_EPOLL
+bool CConnman::RegisterSocket(CNode *pnode)
+{
+    if (socketEvents.Add(pnode->hSocket, pnode))
+        return true;
+    LogPrintf("socket epoll error %s\n", NetworkErrorString(WSAGetLastError()));
+    return false;
+}
+
+// requires LOCK(cs_vNodes)
+void CConnman::QueueReadyNode(CNode *pnode)
+{
+    if (!pnode->fReadyQueued) {
+        pnode->fReadyQueued = true;
+        vReadyNodes.push_back(pnode->AddRef());
+    }
+}
 
-        if (nSelect == SOCKET_ERROR)
+void CConnman::SocketHandlerEpoll(bool fSweep)
+{
+    // Nodes with work left over from the last round are serviced without
+    // waiting, unless all of them were only waiting for another thread.
+    int nTimeout = SOCKET_WAIT_TIMEOUT;
+    if (!vReadyNodes.empty())
+        nTimeout = fReadyNodesBusy ? SOCKET_BUSY_TIMEOUT : 0;
+    if (!socketEvents.Wait(vSocketEvents, nTimeout))
+    {
+        LogPrintf("socket epoll error %s\n", NetworkErrorString(WSAGetLastError()));
+        MilliSleep(SOCKET_WAIT_TIMEOUT);
+    }
+    boost::this_thread::interruption_point();
+
+    std::vector<CNode*> vWoken;
+    {
+        LOCK(cs_vWakeNodes);
+        vWoken.swap(vWakeNodes);
+    }
+
+    // Nodes are only deleted by this thread, and closing a socket removes
+    // it from the epoll set, so every node reported here is still alive.
+    std::vector<const ListenSocket*> vListenReady;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(const CSocketEvents::Event& event, vSocketEvents)
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+            bool fListen = false;
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+                if (event.ptr == &hListenSocket) {
+                    vListenReady.push_back(&hListenSocket);
+                    fListen = true;
+                    break;
+                }
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            if (fListen)
+                continue;
+            CNode* pnode = static_cast<CNode*>(event.ptr);
+            if (event.fRecv)
+                pnode->fRecvReady = true;
+            QueueReadyNode(pnode);
         }
-
-        //
-        // Accept new connections
-        //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
-        {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+        BOOST_FOREACH(CNode* pnode, vWoken) {
+            QueueReadyNode(pnode);
+            pnode->Release();
+        }
+        if (fSweep) {
+            BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                AcceptConnection(hListenSocket);
+                InactivityCheck(pnode);
+                // Also retry nodes which still have work queued, in case an
+                // edge was missed.
+                if (pnode->fRecvReady || pnode->nSendSize > 0 || pnode->nOptimisticBytesWritten > 0)
+                    QueueReadyNode(pnode);
             }
         }
+    }
 
-        //
-        // Service each socket
-        //
-        std::vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket* hListenSocket, vListenReady)
+        AcceptConnection(*hListenSocket);
+
+    //
+    // Service each ready socket
+    //
+    std::vector<CNode*> vServiced;
+    vServiced.swap(vReadyNodes);
+    std::vector<CNode*> vDone;
+    fReadyNodesBusy = true;
+    BOOST_FOREACH(CNode* pnode, vServiced)
+    {
+        boost::this_thread::interruption_point();
+        bool fBusy = false;
+        if (ServiceReadyNode(pnode, fBusy)) {
+            // keep the reference for the next round
+            vReadyNodes.push_back(pnode);
+            fReadyNodesBusy &= fBusy;
+        } else {
+            pnode->fReadyQueued = false;
+            vDone.push_back(pnode);
         }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
+    }
+    if (!vDone.empty()) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vDone)
+            pnode->Release();
+    }
+}
 
-            //
-            // Receive
-            //
+// Returns true if the node should be serviced again in the next round;
+// fBusy is set if that is only because another thread held its locks.
+bool CConnman::ServiceReadyNode(CNode *pnode, bool& fBusy)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+
+    // Any event on a connecting socket means the attempt completed.
+    FinishConnect(pnode);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+
+    // As in the select() loop, drain the send queue before receiving more,
+    // so that a peer which is not reading from us is not read from either.
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend) {
+            fBusy = true;
+            return true;
+        }
+        if (pnode->nOptimisticBytesWritten) {
+            RecordBytesSent(pnode->nOptimisticBytesWritten);
+            pnode->nOptimisticBytesWritten = 0;
+        }
+        if (!pnode->vSendMsg.empty()) {
+            size_t nBytes = SocketSendData(pnode);
+            if (nBytes)
+                RecordBytesSent(nBytes);
+            // The socket buffer is full; EPOLLOUT will bring the node back.
+            if (!pnode->vSendMsg.empty())
+                return false;
+        }
+    }
+
+    if (!pnode->fRecvReady || pnode->hSocket == INVALID_SOCKET)
+        return false;
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv) {
+        fBusy = true;
+        return true;
+    }
+    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+        pnode->GetTotalRecvSize() > GetReceiveFloodSize()) {
+        // The message handler wakes us once it has made room.
+        pnode->fPauseRecv = true;
+        return false;
+    }
+    pnode->fPauseRecv = false;
+    // A short read drained the socket: data arriving later raises a new
+    // edge. After a full read come back once the other nodes had a turn.
+    pnode->fRecvReady = SocketRecvData(pnode);
+    return pnode->fRecvReady;
+}
+#else
+void CConnman::SocketHandlerSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_WAIT_TIMEOUT * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            bool notify = false;
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                                pnode->CloseSocketDisconnect();
-                            if(notify)
-                                messageHandlerCondition.notify_one();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
+            // A connecting socket becomes writable once the attempt completes.
+            if (pnode->fConnecting) {
+                FD_SET(pnode->hSocket, &fdsetSend);
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            }
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend) {
-                    size_t nBytes = SocketSendData(pnode);
-                    if (nBytes)
-                        RecordBytesSent(nBytes);
+                    if (pnode->nOptimisticBytesWritten) {
+                        RecordBytesSent(pnode->nOptimisticBytesWritten);
+                        pnode->nOptimisticBytesWritten = 0;
+                    }
+                    if (!pnode->vSendMsg.empty()) {
+                        FD_SET(pnode->hSocket, &fdsetSend);
+                        continue;
+                    }
                 }
             }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
             }
         }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
         }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+        {
+            AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service each socket
+    //
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        boost::this_thread::interruption_point();
+
+        if (pnode->fConnecting && pnode->hSocket != INVALID_SOCKET &&
+            (FD_ISSET(pnode->hSocket, &fdsetSend) || FD_ISSET(pnode->hSocket, &fdsetError)))
+            FinishConnect(pnode);
+
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode);
+        }
+
+        //
+        // Send
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                size_t nBytes = SocketSendData(pnode);
+                if (nBytes)
+                    RecordBytesSent(nBytes);
+            }
+        }
+
+        //
+        // Inactivity checking
+        //
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
     }
 }
+#endif
+
+void CConnman::WakeSocketHandler(CNode *pnode)
+{
+#ifdef USE_EPOLL
+    {
+        LOCK(cs_vNodes);
+        pnode->AddRef();
+    }
+    {
+        LOCK(cs_vWakeNodes);
+        vWakeNodes.push_back(pnode);
+    }
+    socketEvents.Wakeup();
+#endif
+}
+
 
 
 
@@ -1581,11 +2074,15 @@ void CConnman::ThreadOpenConnections()
 
     // Minimum time before next feeler connection (in microseconds).
     int64_t nNextFeeler = PoissonNextSend(nStart*1000*1000, FEELER_INTERVAL);
+    // Whether the last round started a connection attempt, which usually
+    // returns before the connection is established.
+    bool fAttempted = false;
     while (true)
     {
         ProcessOneShot();
 
-        MilliSleep(500);
+        MilliSleep(fAttempted ? OUTBOUND_CONNECT_INTERVAL : 500);
+        fAttempted = false;
 
         CSemaphoreGrant grant(*semOutbound);
         boost::this_thread::interruption_point();
@@ -1695,6 +2192,7 @@ void CConnman::ThreadOpenConnections()
             }
 
             OpenNetworkConnection(addrConnect, (int)setConnected.size() >= std::min(nMaxConnections - 1, 2), &grant, NULL, false, fFeeler);
+            fAttempted = true;
         }
     }
 }
@@ -1808,19 +2306,29 @@ bool CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
 }
 
 
-void CConnman::ThreadMessageHandler()
+void CConnman::WakeMessageHandler(const CNode* pnode)
+{
+    vMessageHandlerConditions[pnode->GetId() % nMsgHandlerThreads]->notify_one();
+}
+
+void CConnman::ThreadMessageHandler(int nWorker)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
+    boost::condition_variable& messageHandlerCondition = *vMessageHandlerConditions[nWorker];
 
     while (true)
     {
+        // Only the peers assigned to this thread, so that all messages of a
+        // peer are processed and answered in order by a single thread.
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->GetId() % nMsgHandlerThreads != nWorker)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -1832,6 +2340,7 @@ void CConnman::ThreadMessageHandler()
                 continue;
 
             // Receive messages
+            bool fWakeSocketHandler = false;
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1839,6 +2348,11 @@ void CConnman::ThreadMessageHandler()
                     if (!GetNodeSignals().ProcessMessages(pnode, *this))
                         pnode->CloseSocketDisconnect();
 
+                    if (pnode->fPauseRecv && pnode->GetTotalRecvSize() <= GetReceiveFloodSize()) {
+                        pnode->fPauseRecv = false;
+                        fWakeSocketHandler = true;
+                    }
+
                     if (pnode->nSendSize < GetSendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
@@ -1848,6 +2362,8 @@ void CConnman::ThreadMessageHandler()
                     }
                 }
             }
+            if (fWakeSocketHandler)
+                WakeSocketHandler(pnode);
             boost::this_thread::interruption_point();
 
             // Send messages
@@ -2035,7 +2551,11 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
     nMaxConnections = 0;
     nMaxOutbound = 0;
     nBestHeight = 0;
+    nMsgHandlerThreads = 1;
     clientInterface = NULL;
+#ifdef USE_EPOLL
+    fReadyNodesBusy = false;
+#endif
 }
 
 NodeId CConnman::GetNewNodeId()
@@ -2062,6 +2582,11 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
     nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
     nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
 
+    nMsgHandlerThreads = std::max(connOptions.nMsgHandlerThreads, 1);
+    vMessageHandlerConditions.clear();
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        vMessageHandlerConditions.emplace_back(new boost::condition_variable());
+
     SetBestHeight(connOptions.nBestHeight);
 
     clientInterface = connOptions.uiInterface;
@@ -2102,6 +2627,13 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
 
     fAddressesInitialized = true;
 
+#ifdef USE_EPOLL
+    if (!socketEvents.IsValid()) {
+        strNodeError = "Failed to set up epoll socket event handling";
+        return false;
+    }
+#endif
+
     if (semOutbound == NULL) {
         // initialize semaphore
         semOutbound = new CSemaphore(std::min((nMaxOutbound + nMaxFeeler), nMaxConnections));
@@ -2132,8 +2664,9 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "opencon", boost::function<void()>(boost::bind(&CConnman::ThreadOpenConnections, this))));
 
-    // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this))));
+    // Process messages, each thread owning a fixed subset of the peers
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this, i))));
 
     // Dump network addresses
     scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL);
@@ -2187,6 +2720,10 @@ void CConnman::Stop()
     }
     vNodes.clear();
     vNodesDisconnected.clear();
+#ifdef USE_EPOLL
+    vReadyNodes.clear();
+    vWakeNodes.clear();
+#endif
     vhListenSocket.clear();
     delete semOutbound;
     semOutbound = NULL;
@@ -2267,12 +2804,9 @@ bool CConnman::RemoveAddedNode(const std::string& strNode)
 size_t CConnman::GetNodeCount(NumConnections flags)
 {
     LOCK(cs_vNodes);
-    if (flags == CConnman::CONNECTIONS_ALL) // Shortcut if we want total
-        return vNodes.size();
-
     int nNum = 0;
     for(std::vector<CNode*>::const_iterator it = vNodes.begin(); it != vNodes.end(); ++it)
-        if (flags & ((*it)->fInbound ? CONNECTIONS_IN : CONNECTIONS_OUT))
+        if (!(*it)->fConnecting && (flags & ((*it)->fInbound ? CONNECTIONS_IN : CONNECTIONS_OUT)))
             nNum++;
 
     return nNum;
@@ -2285,8 +2819,11 @@ void CConnman::GetNodeStats(std::vector<CNodeStats>& vstats)
     vstats.reserve(vNodes.size());
     for(std::vector<CNode*>::iterator it = vNodes.begin(); it != vNodes.end(); ++it) {
         CNode* pnode = *it;
+        if (pnode->fConnecting)
+            continue;
         CNodeStats stats;
         pnode->copyStats(stats);
+        stats.nMsgHandler = pnode->GetId() % nMsgHandlerThreads;
         vstats.push_back(stats);
     }
 }
@@ -2447,6 +2984,74 @@ uint64_t CConnman::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+CLatencyHistogram::CLatencyHistogram()
+{
+    nCount = 0;
+    nTotal = 0;
+    nMax = 0;
+    memset(vBuckets, 0, sizeof(vBuckets));
+}
+
+void CLatencyHistogram::Add(int64_t nUsec)
+{
+    if (nUsec < 0)
+        nUsec = 0;
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && nUsec >= BucketLimit(nBucket))
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotal += nUsec;
+    nMax = std::max(nMax, nUsec);
+}
+
+void CLatencyHistogram::Merge(const CLatencyHistogram& other)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vBuckets[i] += other.vBuckets[i];
+    nCount += other.nCount;
+    nTotal += other.nTotal;
+    nMax = std::max(nMax, other.nMax);
+}
+
+int64_t CLatencyHistogram::Percentile(double dFraction) const
+{
+    if (nCount == 0)
+        return 0;
+    uint64_t nTarget = std::max((uint64_t)1, (uint64_t)ceil(dFraction * nCount));
+    uint64_t nSeen = 0;
+    for (int i = 0; i < BUCKETS - 1; i++) {
+        nSeen += vBuckets[i];
+        if (nSeen >= nTarget)
+            return std::min(BucketLimit(i), nMax);
+    }
+    return nMax;
+}
+
+/** Known message types are timed by name, anything else as NET_MESSAGE_COMMAND_OTHER. */
+static const std::string& TimedMsgCmd(const std::string& strCommand)
+{
+    static const std::set<std::string> setKnown(getAllNetMessageTypes().begin(), getAllNetMessageTypes().end());
+    return setKnown.count(strCommand) ? strCommand : NET_MESSAGE_COMMAND_OTHER;
+}
+
+void CConnman::RecordMessageTiming(CNode* pnode, const std::string& strCommand, int64_t nQueueUsec, int64_t nProcessUsec, int64_t nLockUsec)
+{
+    const std::string& strTimed = TimedMsgCmd(strCommand);
+    {
+        LOCK(pnode->cs_msgTiming);
+        pnode->mapMsgTiming[strTimed].Add(nQueueUsec, nProcessUsec, nLockUsec);
+    }
+    LOCK(cs_msgTiming);
+    mapMsgTiming[strTimed].Add(nQueueUsec, nProcessUsec, nLockUsec);
+}
+
+void CConnman::GetMessageTiming(mapMsgCmdTiming& mapTiming)
+{
+    LOCK(cs_msgTiming);
+    mapTiming = mapMsgTiming;
+}
+
 ServiceFlags CConnman::GetLocalServices() const
 {
     return nLocalServices;
@@ -2515,6 +3120,11 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
+    fRecvReady = false;
+    fReadyQueued = false;
+    fPauseRecv = false;
+    fConnecting = false;
+    nConnectDeadline = 0;
     nTimeConnected = GetTime();
     nTimeOffset = 0;
     addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
@@ -2550,6 +3160,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nPingUsecTime = 0;
     fPingQueued = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+    nQueueWaitCount = 0;
+    nQueueWaitUsecTotal = 0;
+    nQueueWaitUsecMax = 0;
     minFeeFilter = 0;
     lastSentFeeFilter = 0;
     nextSendTimeFeeFilter = 0;
@@ -2619,8 +3232,7 @@ void CNode::AskFor(const CInv& inv)
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
-    assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+    BeginSerializedMessage(ssSend, pszCommand);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2652,31 +3264,38 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+    // Serialized straight into a pooled buffer, which is queued as is
+    CSendBufferRef msg = FinishSerializedMessage(ssSend);
 
     //log total amount of bytes per command
-    mapSendBytesPerMsgCmd[std::string(pszCommand)] += nSize + CMessageHeader::HEADER_SIZE;
+    mapSendBytesPerMsgCmd[std::string(pszCommand)] += msg->size();
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + CMessageHeader::CHECKSUM_SIZE);
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], hash.begin(), CMessageHeader::CHECKSUM_SIZE);
-
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", msg->size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendMsg.push_back(std::move(msg));
+    nSendSize += vSendMsg.back()->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         nOptimisticBytesWritten += SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushSerializedMessage(const char* pszCommand, const CSendBufferRef& msg)
+{
+    LOCK(cs_vSend);
+    mapSendBytesPerMsgCmd[std::string(pszCommand)] += msg->size();
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(pszCommand), msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        nOptimisticBytesWritten += SocketSendData(this);
+}
+
 bool CConnman::ForNode(NodeId id, std::function<bool(CNode* pnode)> func)
 {
     CNode* found = nullptr;
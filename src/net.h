@@ -14,6 +14,7 @@
 #include "hash.h"
 #include "limitedmap.h"
 #include "netaddress.h"
+#include "netbase.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -47,6 +48,8 @@ static const int PING_INTERVAL = 2 * 60;
 static const int TIMEOUT_INTERVAL = 20 * 60;
 /** Run the feeler connection loop once every 2 minutes or 120 seconds. **/
 static const int FEELER_INTERVAL = 120;
+/** Time between starting outbound connection attempts while they don't block (in milliseconds). */
+static const int OUTBOUND_CONNECT_INTERVAL = 100;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
@@ -87,6 +90,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** The default number of message handler threads. Each peer is handled by exactly one of them. */
+static const int DEFAULT_MSGHANDLER_THREADS = 2;
+/** The maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -103,6 +110,61 @@ struct AddedNodeInfo
     bool fInbound;
 };
 
+/**
+ * Histogram of durations (in microseconds) with power-of-two buckets.
+ * Bucket 0 counts durations below 1us, bucket i those in [2^(i-1), 2^i) us,
+ * and the last bucket everything from about 4 seconds up.
+ */
+class CLatencyHistogram
+{
+public:
+    static const int BUCKETS = 24;
+
+    uint64_t nCount;
+    int64_t nTotal;
+    int64_t nMax;
+    uint64_t vBuckets[BUCKETS];
+
+    CLatencyHistogram();
+
+    void Add(int64_t nUsec);
+    void Merge(const CLatencyHistogram& other);
+
+    /**
+     * Upper bound (in microseconds) of the bucket in which the given fraction
+     * of the samples is reached, capped by the largest sample.
+     */
+    int64_t Percentile(double dFraction) const;
+    double Average() const { return nCount ? (double)nTotal / nCount : 0.0; }
+
+    /** Exclusive upper bound (in microseconds) of a bucket. The last bucket is open-ended. */
+    static int64_t BucketLimit(int nBucket) { return (int64_t)1 << nBucket; }
+};
+
+/** Timings of the messages of one command: queueing delay, processing time and cs_main hold time. */
+struct CMsgTiming
+{
+    CLatencyHistogram queue;
+    CLatencyHistogram process;
+    CLatencyHistogram lock;
+
+    void Add(int64_t nQueueUsec, int64_t nProcessUsec, int64_t nLockUsec)
+    {
+        queue.Add(nQueueUsec);
+        process.Add(nProcessUsec);
+        lock.Add(nLockUsec);
+    }
+
+    void Merge(const CMsgTiming& other)
+    {
+        queue.Merge(other.queue);
+        process.Merge(other.process);
+        lock.Merge(other.lock);
+    }
+};
+
+typedef std::map<std::string, CMsgTiming> mapMsgCmdTiming; //command, timings
+
 class CTransaction;
 class CNodeStats;
 class CClientUIInterface;
@@ -131,6 +193,7 @@ public:
         unsigned int nReceiveFloodSize = 0;
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
+        int nMsgHandlerThreads = 1;
     };
     CConnman(uint64_t seed0, uint64_t seed1);
     ~CConnman();
@@ -302,6 +365,11 @@ public:
     uint64_t GetTotalBytesRecv();
     uint64_t GetTotalBytesSent();
 
+    /** Record how long a message of one peer waited and was processed. */
+    void RecordMessageTiming(CNode* pnode, const std::string& strCommand, int64_t nQueueUsec, int64_t nProcessUsec, int64_t nLockUsec);
+    /** Message timings of all peers since startup. */
+    void GetMessageTiming(mapMsgCmdTiming& mapTiming);
+
     void SetBestHeight(int height);
     int GetBestHeight() const;
 
@@ -319,9 +387,24 @@ private:
     void ThreadOpenAddedConnections();
     void ProcessOneShot();
     void ThreadOpenConnections();
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int nWorker);
+    /** Wake the message handler thread that owns pnode */
+    void WakeMessageHandler(const CNode* pnode);
     void AcceptConnection(const ListenSocket& hListenSocket);
     void ThreadSocketHandler();
+    void DisconnectNodes();
+    void FinishConnect(CNode *pnode);
+    void InactivityCheck(CNode *pnode);
+    bool SocketRecvData(CNode *pnode);
+#ifdef USE_EPOLL
+    void SocketHandlerEpoll(bool fSweep);
+    bool ServiceReadyNode(CNode *pnode, bool& fBusy);
+    void QueueReadyNode(CNode *pnode);
+    bool RegisterSocket(CNode *pnode);
+#else
+    void SocketHandlerSelect();
+#endif
+    void WakeSocketHandler(CNode *pnode);
     void ThreadDNSAddressSeed();
 
     uint64_t CalculateKeyedNetGroup(const CAddress& ad);
@@ -361,6 +444,10 @@ private:
     uint64_t nTotalBytesRecv;
     uint64_t nTotalBytesSent;
 
+    // Message timings of all peers, including disconnected ones
+    CCriticalSection cs_msgTiming;
+    mapMsgCmdTiming mapMsgTiming;
+
     // outbound limit & stats
     uint64_t nMaxOutboundTotalBytesSentInCycle;
     uint64_t nMaxOutboundCycleStartTime;
@@ -389,7 +476,21 @@ private:
     std::list<CNode*> vNodesDisconnected;
     mutable CCriticalSection cs_vNodes;
     std::atomic<NodeId> nLastNodeId;
-    boost::condition_variable messageHandlerCondition;
+    /** One condition per message handler thread; peer id N is handled by thread N % nMsgHandlerThreads */
+    std::vector<std::unique_ptr<boost::condition_variable> > vMessageHandlerConditions;
+    int nMsgHandlerThreads;
+
+#ifdef USE_EPOLL
+    CSocketEvents socketEvents;
+    std::vector<CSocketEvents::Event> vSocketEvents;
+    /** Nodes with socket work left, each holding a reference (socket handler thread only) */
+    std::vector<CNode*> vReadyNodes;
+    /** Whether the nodes in vReadyNodes are only waiting for locks held by other threads */
+    bool fReadyNodesBusy;
+    /** Nodes other threads asked the socket handler to service, each holding a reference */
+    std::vector<CNode*> vWakeNodes;
+    CCriticalSection cs_vWakeNodes;
+#endif
 
     /** Services this instance offers */
     ServiceFlags nLocalServices;
@@ -414,6 +515,29 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
 size_t SocketSendData(CNode *pnode);
 
+/** A complete serialized message, header included, queued for sending. The
+ *  same buffer may be queued to any number of peers; it goes back to a pool of
+ *  send buffers once the last of them has sent it. */
+typedef std::shared_ptr<const CSerializeData> CSendBufferRef;
+
+/** Write the header of a pszCommand message to the (empty) stream ss. */
+void BeginSerializedMessage(CDataStream& ss, const char* pszCommand);
+/** Fill in the size and checksum of the message in ss and move it, without
+ *  copying, into a send buffer. ss is left empty, backed by a pooled buffer. */
+CSendBufferRef FinishSerializedMessage(CDataStream& ss);
+
+/** Serialize a message once so it can be queued to many peers with
+ *  CNode::PushSerializedMessage. */
+template<typename T>
+CSendBufferRef SerializeNetMessage(int nVersion, const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, nVersion);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(obj, SER_NETWORK, nVersion));
+    BeginSerializedMessage(ss, pszCommand);
+    ss << obj;
+    return FinishSerializedMessage(ss);
+}
+
 struct CombinerAll
 {
     typedef bool result_type;
@@ -511,6 +635,10 @@ public:
     double dPingWait;
     double dPingMin;
     std::string addrLocal;
+    int nMsgHandler;
+    double dQueueWait;
+    double dQueueWaitMax;
+    mapMsgCmdTiming mapMsgTiming;
 };
 
 
@@ -524,7 +652,7 @@ public:
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, in a buffer from the receive pool
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
@@ -536,6 +664,9 @@ public:
         nDataPos = 0;
         nTime = 0;
     }
+    CNetMessage(CNetMessage&&) = default;
+    CNetMessage& operator=(CNetMessage&&) = default;
+    ~CNetMessage();
 
     bool complete() const
     {
@@ -552,8 +683,29 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Double-SHA256 of the payload, hashed as it arrived. Requires complete(). */
+    const uint256& GetMessageHash() const
+    {
+        assert(complete());
+        return hashData;
+    }
+
+private:
+    CHash256 hasher;
+    uint256 hashData;
+};
+
+struct CRecvBufferPoolStats
+{
+    uint64_t nHits;     // buffers handed out from the pool
+    uint64_t nMisses;   // buffers that had to be allocated
+    size_t nBuffers;    // buffers currently pooled
+    size_t nBytes;      // capacity of the buffers currently pooled
 };
 
+void GetRecvBufferPoolStats(CRecvBufferPoolStats& stats);
+
 
 /** Information about a peer */
 class CNode
@@ -568,7 +720,7 @@ public:
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nOptimisticBytesWritten;
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendBufferRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -577,6 +729,20 @@ public:
     uint64_t nRecvBytes;
     int nRecvVersion;
 
+    // Edge-triggered socket state, only touched by the socket handler thread:
+    // whether the socket may still hold unread data, and whether the node is
+    // queued to be serviced.
+    bool fRecvReady;
+    bool fReadyQueued;
+    // Set when the socket handler stopped reading because the receive buffer
+    // is full. Whoever drains the buffer must wake the socket handler.
+    std::atomic<bool> fPauseRecv;
+    // Set while a non-blocking outbound connect is in progress. Nothing is
+    // sent until the socket handler sees it complete, or gives up at
+    // nConnectDeadline (in milliseconds).
+    std::atomic<bool> fConnecting;
+    int64_t nConnectDeadline;
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nTimeConnected;
@@ -624,8 +790,11 @@ public:
     int nStartingHeight;
 
     // flood relay
+    // vAddrToSend and addrKnown are filled by other peers' message handler
+    // threads, so they are protected by cs_vAddrToSend.
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -668,6 +837,25 @@ public:
     int64_t nMinPingUsecTime;
     // Whether a ping is requested.
     bool fPingQueued;
+
+    // Queueing delay measurement: time (in usec) between a message being
+    // received and its processing starting, written by the message handler.
+    std::atomic<uint64_t> nQueueWaitCount;
+    std::atomic<int64_t> nQueueWaitUsecTotal;
+    std::atomic<int64_t> nQueueWaitUsecMax;
+
+    void RecordQueueWait(int64_t nWaitUsec)
+    {
+        nQueueWaitCount++;
+        nQueueWaitUsecTotal += nWaitUsec;
+        if (nWaitUsec > nQueueWaitUsecMax)
+            nQueueWaitUsecMax = nWaitUsec;
+    }
+
+    // Per command timings of the messages processed from this peer.
+    CCriticalSection cs_msgTiming;
+    mapMsgCmdTiming mapMsgTiming;
+
     // Minimum fee rate with which to filter inv's to this node
     CAmount minFeeFilter;
     CCriticalSection cs_feeFilter;
@@ -737,6 +925,7 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(_addr.GetKey());
     }
 
@@ -745,6 +934,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (_addr.IsValid() && !addrKnown.contains(_addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = _addr;
@@ -792,6 +982,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message made by SerializeNetMessage, sharing its buffer. */
+    void PushSerializedMessage(const char* pszCommand, const CSendBufferRef& msg);
+
     void PushVersion();
 
 
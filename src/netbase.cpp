@@ -27,6 +27,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <poll.h>
+#endif
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
 #include <boost/thread.hpp>
@@ -249,6 +253,28 @@ struct timeval MillisToTimeval(int64_t nTimeout)
     return timeout;
 }
 
+/**
+ * Wait up to nTimeout milliseconds for hSocket to become readable, or
+ * writable if fWrite is set. Returns like select(). With epoll available
+ * poll() is used, as descriptors may then exceed FD_SETSIZE.
+ */
+static int WaitForSocket(SOCKET hSocket, bool fWrite, int64_t nTimeout)
+{
+#ifdef USE_EPOLL
+    struct pollfd pollfd;
+    pollfd.fd = hSocket;
+    pollfd.events = fWrite ? POLLOUT : POLLIN;
+    pollfd.revents = 0;
+    return poll(&pollfd, 1, nTimeout);
+#else
+    struct timeval tval = MillisToTimeval(nTimeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, fWrite ? NULL : &fdset, fWrite ? &fdset : NULL, NULL, &tval);
+#endif
+}
+
 /**
  * Read bytes from socket. This will either read the full number of bytes requested
  * or return False on error or timeout.
@@ -280,11 +306,7 @@ bool static InterruptibleRecv(char* data, size_t len, int timeout, SOCKET& hSock
                 if (!IsSelectableSocket(hSocket)) {
                     return false;
                 }
-                struct timeval tval = MillisToTimeval(std::min(endTime - curTime, maxWait));
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(hSocket, &fdset);
-                int nRet = select(hSocket + 1, &fdset, NULL, NULL, &tval);
+                int nRet = WaitForSocket(hSocket, false, std::min(endTime - curTime, maxWait));
                 if (nRet == SOCKET_ERROR) {
                     return false;
                 }
@@ -447,9 +469,10 @@ static bool Socks5(const std::string& strDest, int port, const ProxyCredentials
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet, bool& fPendingRet)
 {
     hSocketRet = INVALID_SOCKET;
+    fPendingRet = false;
 
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
@@ -476,8 +499,10 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
 #endif
 
     // Set to non-blocking
-    if (!SetSocketNonBlocking(hSocket, true))
-        return error("ConnectSocketDirectly: Setting socket to non-blocking failed, error %s\n", NetworkErrorString(WSAGetLastError()));
+    if (!SetSocketNonBlocking(hSocket, true)) {
+        CloseSocket(hSocket);
+        return error("StartConnectSocket: Setting socket to non-blocking failed, error %s\n", NetworkErrorString(WSAGetLastError()));
+    }
 
     if (connect(hSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR)
     {
@@ -485,40 +510,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
         {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
-                CloseSocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                LogPrintf("select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                CloseSocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
-#ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
-#else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
-#endif
-            {
-                LogPrintf("getsockopt() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                CloseSocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                LogPrintf("connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
-                CloseSocket(hSocket);
-                return false;
-            }
+            fPendingRet = true;
         }
 #ifdef WIN32
         else if (WSAGetLastError() != WSAEISCONN)
@@ -536,6 +528,62 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
     return true;
 }
 
+bool FinishConnectSocket(const CService &addrConnect, SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
+#ifdef WIN32
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+#else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+#endif
+    {
+        LogPrintf("getsockopt() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    if (nRet != 0)
+    {
+        LogPrint("net", "connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
+        return false;
+    }
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    hSocketRet = INVALID_SOCKET;
+
+    SOCKET hSocket;
+    bool fPending;
+    if (!StartConnectSocket(addrConnect, hSocket, fPending))
+        return false;
+
+    if (fPending)
+    {
+        int nRet = WaitForSocket(hSocket, true, nTimeout);
+        if (nRet == 0)
+        {
+            LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
+            CloseSocket(hSocket);
+            return false;
+        }
+        if (nRet == SOCKET_ERROR)
+        {
+            LogPrintf("select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+            CloseSocket(hSocket);
+            return false;
+        }
+        if (!FinishConnectSocket(addrConnect, hSocket))
+        {
+            CloseSocket(hSocket);
+            return false;
+        }
+    }
+
+    hSocketRet = hSocket;
+    return true;
+}
+
 bool SetProxy(enum Network net, const proxyType &addrProxy) {
     assert(net >= 0 && net < NET_MAX);
     if (!addrProxy.IsValid())
@@ -761,3 +809,71 @@ bool SetSocketNonBlocking(SOCKET& hSocket, bool fNonBlocking)
 
     return true;
 }
+
+#ifdef USE_EPOLL
+CSocketEvents::CSocketEvents() : fWakeupPending(false)
+{
+    hWakeupPipe[0] = hWakeupPipe[1] = -1;
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+        return;
+    if (pipe2(hWakeupPipe, O_NONBLOCK | O_CLOEXEC) == -1 || !Add(hWakeupPipe[0], this, false)) {
+        close(hEpoll);
+        hEpoll = -1;
+    }
+}
+
+CSocketEvents::~CSocketEvents()
+{
+    if (hEpoll != -1)
+        close(hEpoll);
+    for (int i = 0; i < 2; i++) {
+        if (hWakeupPipe[i] != -1)
+            close(hWakeupPipe[i]);
+    }
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void* ptr, bool fEdgeTriggered)
+{
+    struct epoll_event event;
+    event.events = fEdgeTriggered ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : EPOLLIN;
+    event.data.ptr = ptr;
+    return epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) == 0;
+}
+
+void CSocketEvents::Wakeup()
+{
+    // One pending byte is enough to interrupt Wait().
+    if (!fWakeupPending.exchange(true)) {
+        char c = 0;
+        if (write(hWakeupPipe[1], &c, 1) != 1)
+            fWakeupPending = false;
+    }
+}
+
+bool CSocketEvents::Wait(std::vector<Event>& vEvents, int nTimeout)
+{
+    // Sockets not returned in this batch stay ready and are picked up by
+    // the next call.
+    vBuffer.resize(256);
+    vEvents.clear();
+    int nEvents = epoll_wait(hEpoll, &vBuffer[0], vBuffer.size(), nTimeout);
+    if (nEvents == -1)
+        return errno == EINTR;
+    for (int i = 0; i < nEvents; i++) {
+        const struct epoll_event& event = vBuffer[i];
+        if (event.data.ptr == this) {
+            fWakeupPending = false;
+            char buf[64];
+            while (read(hWakeupPipe[0], buf, sizeof(buf)) > 0);
+            continue;
+        }
+        Event ev;
+        ev.ptr = event.data.ptr;
+        ev.fRecv = (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+        ev.fSend = (event.events & EPOLLOUT) != 0;
+        vEvents.push_back(ev);
+    }
+    return true;
+}
+#endif
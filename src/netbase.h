@@ -13,10 +13,15 @@
 #include "netaddress.h"
 #include "serialize.h"
 
+#include <atomic>
 #include <stdint.h>
 #include <string>
 #include <vector>
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 extern int nConnectTimeout;
 extern bool fNameLookup;
 
@@ -53,6 +58,14 @@ CService LookupNumeric(const char *pszName, int portDefault = 0);
 bool LookupSubNet(const char *pszName, CSubNet& subnet);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout, bool *outProxyConnectionFailed = 0);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault, int nTimeout, bool *outProxyConnectionFailed = 0);
+/**
+ * Start a direct (not proxied) connection without waiting for it to be established. On success
+ * hSocketRet is a non-blocking socket; if fPendingRet is set, it becomes writable once the
+ * connection attempt completes, and FinishConnectSocket() tells whether it succeeded.
+ */
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet, bool& fPendingRet);
+/** Check the outcome of a pending connection started by StartConnectSocket(). */
+bool FinishConnectSocket(const CService &addrConnect, SOCKET hSocket);
 /** Return readable error string for a network error code */
 std::string NetworkErrorString(int err);
 /** Close socket and set hSocket to INVALID_SOCKET */
@@ -64,4 +77,43 @@ bool SetSocketNonBlocking(SOCKET& hSocket, bool fNonBlocking);
  */
 struct timeval MillisToTimeval(int64_t nTimeout);
 
+#ifdef USE_EPOLL
+/**
+ * Edge-triggered readiness notification for a set of sockets (Linux epoll).
+ * A socket is only reported again once new data or buffer space arrives, so
+ * the caller must remember which sockets it has not fully drained yet.
+ * Closing a socket removes it from the set.
+ */
+class CSocketEvents
+{
+public:
+    struct Event
+    {
+        void* ptr;
+        bool fRecv; //!< readable, hung up or in error; recv() tells which
+        bool fSend; //!< writable
+    };
+
+    CSocketEvents();
+    ~CSocketEvents();
+
+    bool IsValid() const { return hEpoll != -1; }
+    /** Watch hSocket for both directions. Listening sockets should not be edge-triggered. */
+    bool Add(SOCKET hSocket, void* ptr, bool fEdgeTriggered = true);
+    /** Make the current (or next) Wait() return early. Can be called from any thread. */
+    void Wakeup();
+    /** Wait up to nTimeout milliseconds and replace vEvents with what became ready. */
+    bool Wait(std::vector<Event>& vEvents, int nTimeout);
+
+private:
+    int hEpoll;
+    int hWakeupPipe[2];
+    std::atomic<bool> fWakeupPending;
+    std::vector<struct epoll_event> vBuffer;
+
+    CSocketEvents(const CSocketEvents&);
+    CSocketEvents& operator=(const CSocketEvents&);
+};
+#endif
+
 #endif // BITCOIN_NETBASE_H
@@ -13,42 +13,59 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <algorithm>
+#include <cmath>
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
-                                unsigned int maxConfirms, double _decay, std::string _dataTypeString)
+                                unsigned int _maxConfirms, double _decay, std::string _dataTypeString)
 {
     decay = _decay;
     dataTypeString = _dataTypeString;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
-    confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
-        unconfTxs[i].resize(buckets.size());
-    }
+    buckets = defaultBuckets;
+    maxConfirms = _maxConfirms;
+    logSpacing = 0;
+    if (buckets.size() > 1 && buckets[0] > 0)
+        logSpacing = log(buckets[1] / buckets[0]);
+    confAvg.assign(maxConfirms * buckets.size(), 0);
+    curBlockConf.assign(maxConfirms * buckets.size(), 0);
+    unconfTxs.assign(maxConfirms * buckets.size(), 0);
+
+    oldUnconfTxs.assign(buckets.size(), 0);
+    curBlockTxCt.assign(buckets.size(), 0);
+    txCtAvg.assign(buckets.size(), 0);
+    curBlockVal.assign(buckets.size(), 0);
+    avg.assign(buckets.size(), 0);
+}
 
-    oldUnconfTxs.resize(buckets.size());
-    curBlockTxCt.resize(buckets.size());
-    txCtAvg.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-    avg.resize(buckets.size());
+unsigned int TxConfirmStats::FindBucketIndex(double val) const
+{
+    // The bucket bounds are exponentially spaced, so the log of the value
+    // gives its bucket directly.  The loops below only correct for rounding
+    // and for the infinite last bucket (or a differently spaced list read
+    // from the estimates file).
+    unsigned int bucketindex = 0;
+    if (logSpacing > 0 && val > buckets[0]) {
+        double guess = ceil(log(val / buckets[0]) / logSpacing);
+        bucketindex = guess < buckets.size() ? (unsigned int)guess : buckets.size() - 1;
+    }
+    while (bucketindex > 0 && buckets[bucketindex - 1] >= val)
+        bucketindex--;
+    while (bucketindex + 1 < buckets.size() && buckets[bucketindex] < val)
+        bucketindex++;
+    return bucketindex;
 }
 
 // Zero out the data for the current block
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
+    int *unconfRow = &unconfTxs[(nBlockHeight % maxConfirms) * buckets.size()];
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+        oldUnconfTxs[j] += unconfRow[j];
+        unconfRow[j] = 0;
     }
+    std::fill(curBlockConf.begin(), curBlockConf.end(), 0);
+    std::fill(curBlockTxCt.begin(), curBlockTxCt.end(), 0);
+    std::fill(curBlockVal.begin(), curBlockVal.end(), 0);
 }
 
 
@@ -57,28 +74,66 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
+    unsigned int bucketindex = FindBucketIndex(val);
+    if ((unsigned int)blocksToConfirm <= maxConfirms)
+        curBlockConf[(blocksToConfirm - 1) * buckets.size() + bucketindex]++;
     curBlockTxCt[bucketindex]++;
     curBlockVal[bucketindex] += val;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
+    // A tx confirmed in Y blocks also counts as confirmed within every
+    // larger number of blocks, so accumulate the rows first
+    for (unsigned int k = buckets.size(); k < curBlockConf.size(); k++)
+        curBlockConf[k] += curBlockConf[k - buckets.size()];
+    for (unsigned int k = 0; k < confAvg.size(); k++)
+        confAvg[k] = confAvg[k] * decay + curBlockConf[k];
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
         avg[j] = avg[j] * decay + curBlockVal[j];
         txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
     }
 }
 
+void TxConfirmStats::CountUnconfirmed(unsigned int nBlockHeight, std::vector<int>& unconfAtLeast) const
+{
+    const unsigned int numBuckets = buckets.size();
+    unconfAtLeast.resize(maxConfirms * numBuckets);
+    // Txs that have waited maxConfirms blocks or more were moved to oldUnconfTxs
+    std::copy(oldUnconfTxs.begin(), oldUnconfTxs.end(), unconfAtLeast.begin() + (maxConfirms - 1) * numBuckets);
+    for (unsigned int confct = maxConfirms - 1; confct > 0; confct--) {
+        const int *unconfRow = &unconfTxs[((nBlockHeight - confct) % maxConfirms) * numBuckets];
+        const int *nextRow = &unconfAtLeast[confct * numBuckets];
+        int *row = &unconfAtLeast[(confct - 1) * numBuckets];
+        for (unsigned int j = 0; j < numBuckets; j++)
+            row[j] = nextRow[j] + unconfRow[j];
+    }
+}
+
 // returns -1 on error conditions
 double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
                                          double successBreakPoint, bool requireGreater,
-                                         unsigned int nBlockHeight)
+                                         unsigned int nBlockHeight) const
+{
+    std::vector<int> unconfAtLeast;
+    CountUnconfirmed(nBlockHeight, unconfAtLeast);
+    return EstimateMedianVal(confTarget, sufficientTxVal, successBreakPoint, requireGreater, unconfAtLeast);
+}
+
+void TxConfirmStats::EstimateMedianVals(double sufficientTxVal, double successBreakPoint,
+                                        bool requireGreater, unsigned int nBlockHeight,
+                                        std::vector<double>& medians) const
+{
+    std::vector<int> unconfAtLeast;
+    CountUnconfirmed(nBlockHeight, unconfAtLeast);
+    medians.resize(maxConfirms);
+    for (unsigned int confTarget = 1; confTarget <= maxConfirms; confTarget++)
+        medians[confTarget - 1] = EstimateMedianVal(confTarget, sufficientTxVal, successBreakPoint, requireGreater, unconfAtLeast);
+}
+
+double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
+                                         double successBreakPoint, bool requireGreater,
+                                         const std::vector<int>& unconfAtLeast) const
 {
     // Counters for a bucket (or range of buckets)
     double nConf = 0; // Number of tx's confirmed within the confTarget
@@ -105,16 +160,15 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     unsigned int bestFarBucket = startbucket;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
+    const double *confRow = &confAvg[(confTarget - 1) * buckets.size()];
+    const int *unconfRow = &unconfAtLeast[(confTarget - 1) * buckets.size()];
 
     // Start counting from highest(default) or lowest fee/pri transactions
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
+        nConf += confRow[bucket];
         totalNum += txCtAvg[bucket];
-        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
-        extraNum += oldUnconfTxs[bucket];
+        extraNum += unconfRow[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
         // (Only count the confirmed data points, so that each confirmation count
@@ -176,11 +230,15 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
 void TxConfirmStats::Write(CAutoFile& fileout)
 {
+    // The file keeps the nested confAvg[Y][X] layout
+    std::vector<std::vector<double> > fileConfAvg(maxConfirms);
+    for (unsigned int i = 0; i < maxConfirms; i++)
+        fileConfAvg[i].assign(confAvg.begin() + i * buckets.size(), confAvg.begin() + (i + 1) * buckets.size());
     fileout << decay;
     fileout << buckets;
     fileout << avg;
     fileout << txCtAvg;
-    fileout << confAvg;
+    fileout << fileConfAvg;
 }
 
 void TxConfirmStats::Read(CAutoFile& filein)
@@ -191,7 +249,7 @@ void TxConfirmStats::Read(CAutoFile& filein)
     std::vector<std::vector<double> > fileConfAvg;
     std::vector<double> fileTxCtAvg;
     double fileDecay;
-    size_t maxConfirms;
+    size_t fileMaxConfirms;
     size_t numBuckets;
 
     filein >> fileDecay;
@@ -208,39 +266,22 @@ void TxConfirmStats::Read(CAutoFile& filein)
     if (fileTxCtAvg.size() != numBuckets)
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     filein >> fileConfAvg;
-    maxConfirms = fileConfAvg.size();
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) // one week
+    fileMaxConfirms = fileConfAvg.size();
+    if (fileMaxConfirms <= 0 || fileMaxConfirms > 6 * 24 * 7) // one week
         throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    for (unsigned int i = 0; i < maxConfirms; i++) {
+    for (unsigned int i = 0; i < fileMaxConfirms; i++) {
         if (fileConfAvg[i].size() != numBuckets)
             throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
     }
     // Now that we've processed the entire fee estimate data file and not
-    // thrown any errors, we can copy it to our data structures
-    decay = fileDecay;
-    buckets = fileBuckets;
+    // thrown any errors, we can copy it to our data structures.
+    // The current block and mempool state isn't stored in the data file and
+    // starts out empty, sized to match the number of confirms and buckets
+    Initialize(fileBuckets, fileMaxConfirms, fileDecay, dataTypeString);
     avg = fileAvg;
-    confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
-
-    // Resize the current block variables which aren't stored in the data file
-    // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        unconfTxs[i].resize(buckets.size());
-    }
-    oldUnconfTxs.resize(buckets.size());
-
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+    for (unsigned int i = 0; i < maxConfirms; i++)
+        std::copy(fileConfAvg[i].begin(), fileConfAvg[i].end(), confAvg.begin() + i * numBuckets);
 
     LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
              numBuckets, dataTypeString, maxConfirms);
@@ -248,9 +289,9 @@ void TxConfirmStats::Read(CAutoFile& filein)
 
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
+    unsigned int bucketindex = FindBucketIndex(val);
+    unsigned int blockIndex = nBlockHeight % maxConfirms;
+    unconfTxs[blockIndex * buckets.size() + bucketindex]++;
     LogPrint("estimatefee", "adding to %s", dataTypeString);
     return bucketindex;
 }
@@ -266,7 +307,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (blocksAgo >= (int)maxConfirms) {
         if (oldUnconfTxs[bucketindex] > 0)
             oldUnconfTxs[bucketindex]--;
         else
@@ -274,30 +315,27 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
                      bucketindex);
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
-            unconfTxs[blockIndex][bucketindex]--;
+        unsigned int blockIndex = entryHeight % maxConfirms;
+        int& unconf = unconfTxs[blockIndex * buckets.size() + bucketindex];
+        if (unconf > 0)
+            unconf--;
         else
             LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
     }
 }
 
-void CBlockPolicyEstimator::removeTx(uint256 hash)
+bool CBlockPolicyEstimator::removeTx(const uint256& hash)
 {
-    std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
-    if (pos == mapMemPoolTxs.end()) {
-        LogPrint("estimatefee", "Blockpolicy error mempool tx %s not found for removeTx\n",
-                 hash.ToString().c_str());
-        return;
-    }
-    TxConfirmStats *stats = pos->second.stats;
-    unsigned int entryHeight = pos->second.blockHeight;
-    unsigned int bucketIndex = pos->second.bucketIndex;
-
-    if (stats != NULL)
-        stats->removeTx(entryHeight, nBestSeenHeight, bucketIndex);
-    mapMemPoolTxs.erase(hash);
+    // Only transactions that count as fee or priority data points are in
+    // the map, so most lookups for untracked txs are expected to miss
+    boost::unordered_map<uint256, TxStatsInfo, SaltedTxidHasher>::iterator pos = mapMemPoolTxs.find(hash);
+    if (pos == mapMemPoolTxs.end())
+        return false;
+    pos->second.stats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex);
+    mapMemPoolTxs.erase(pos);
+    fEstimatesStale = true;
+    return true;
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
@@ -323,6 +361,7 @@ CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
     feeLikely = CFeeRate(INF_FEERATE);
     priUnlikely = 0;
     priLikely = INF_PRIORITY;
+    fEstimatesStale = true;
 }
 
 bool CBlockPolicyEstimator::isFeeDataPoint(const CFeeRate &fee, double pri)
@@ -346,8 +385,8 @@ bool CBlockPolicyEstimator::isPriDataPoint(const CFeeRate &fee, double pri)
 void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
 {
     unsigned int txHeight = entry.GetHeight();
-    uint256 hash = entry.GetTx().GetHash();
-    if (mapMemPoolTxs[hash].stats != NULL) {
+    const uint256& hash = entry.GetTx().GetHash();
+    if (mapMemPoolTxs.count(hash)) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n",
                  hash.ToString().c_str());
 	return;
@@ -378,22 +417,28 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     // what that will be and its too hard to continue updating it
     // so use starting priority as a proxy
     double curPri = entry.GetPriority(txHeight);
-    mapMemPoolTxs[hash].blockHeight = txHeight;
+    TxStatsInfo info;
+    info.blockHeight = txHeight;
 
     LogPrint("estimatefee", "Blockpolicy mempool tx %s ", hash.ToString().substr(0,10));
     // Record this as a priority estimate
     if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &priStats;
-        mapMemPoolTxs[hash].bucketIndex =  priStats.NewTx(txHeight, curPri);
+        info.stats = &priStats;
+        info.bucketIndex = priStats.NewTx(txHeight, curPri);
     }
     // Record this as a fee estimate
     else if (isFeeDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &feeStats;
-        mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+        info.stats = &feeStats;
+        info.bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
     }
     else {
         LogPrint("estimatefee", "not adding");
     }
+    // Untracked transactions are left out of the map altogether
+    if (info.stats != NULL) {
+        mapMemPoolTxs.insert(std::make_pair(hash, info));
+        fEstimatesStale = true;
+    }
     LogPrint("estimatefee", "\n");
 }
 
@@ -435,8 +480,13 @@ void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
 }
 
 void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
-                                         std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
+                                         std::vector<const CTxMemPoolEntry*>& entries, bool fCurrentEstimate)
 {
+    // Stop tracking the block's transactions as unconfirmed mempool txs
+    // before nBestSeenHeight moves on to the new block.
+    for (unsigned int i = 0; i < entries.size(); i++)
+        removeTx(entries[i]->GetTx().GetHash());
+
     if (nBlockHeight <= nBestSeenHeight) {
         // Ignore side chains and re-orgs; assuming they are random
         // they don't affect the estimate.
@@ -446,6 +496,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
         return;
     }
     nBestSeenHeight = nBlockHeight;
+    fEstimatesStale = true;
 
     // Only want to be updating estimates when our blockchain is synced,
     // otherwise we'll miscalculate how many blocks its taking to get included.
@@ -482,7 +533,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
 
     // Repopulate the current block states
     for (unsigned int i = 0; i < entries.size(); i++)
-        processBlockTx(nBlockHeight, entries[i]);
+        processBlockTx(nBlockHeight, *entries[i]);
 
     // Update all exponential averages with the current block states
     feeStats.UpdateMovingAverages();
@@ -492,13 +543,22 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
              entries.size(), mapMemPoolTxs.size());
 }
 
+void CBlockPolicyEstimator::UpdateEstimates()
+{
+    feeStats.EstimateMedianVals(SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight, feeEstimates);
+    priStats.EstimateMedianVals(SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight, priEstimates);
+    fEstimatesStale = false;
+}
+
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
+    if (fEstimatesStale)
+        UpdateEstimates();
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > feeEstimates.size())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median = feeEstimates[confTarget - 1];
 
     if (median < 0)
         return CFeeRate(0);
@@ -508,15 +568,17 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 
 CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
+    if (fEstimatesStale)
+        UpdateEstimates();
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > feeEstimates.size())
         return CFeeRate(0);
 
     double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
-        median = feeStats.EstimateMedianVal(confTarget++, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    while (median < 0 && (unsigned int)confTarget <= feeEstimates.size()) {
+        median = feeEstimates[confTarget++ - 1];
     }
 
     if (answerFoundAtTarget)
@@ -535,19 +597,23 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
 
 double CBlockPolicyEstimator::estimatePriority(int confTarget)
 {
+    if (fEstimatesStale)
+        UpdateEstimates();
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > priEstimates.size())
         return -1;
 
-    return priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    return priEstimates[confTarget - 1];
 }
 
 double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
+    if (fEstimatesStale)
+        UpdateEstimates();
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > priEstimates.size())
         return -1;
 
     // If mempool is limiting txs, no priority txs are allowed
@@ -556,8 +622,8 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerF
         return INF_PRIORITY;
 
     double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= priStats.GetMaxConfirms()) {
-        median = priStats.EstimateMedianVal(confTarget++, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    while (median < 0 && (unsigned int)confTarget <= priEstimates.size()) {
+        median = priEstimates[confTarget++ - 1];
     }
 
     if (answerFoundAtTarget)
@@ -580,6 +646,7 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein)
     feeStats.Read(filein);
     priStats.Read(filein);
     nBestSeenHeight = nFileBestSeenHeight;
+    fEstimatesStale = true;
 }
 
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
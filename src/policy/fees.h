@@ -6,12 +6,15 @@
 #define BITCOIN_POLICYESTIMATOR_H
 
 #include "amount.h"
+#include "coins.h"
 #include "uint256.h"
 
-#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 class CAutoFile;
 class CFeeRate;
 class CTxMemPoolEntry;
@@ -81,7 +84,11 @@ class TxConfirmStats
 private:
     //Define the buckets we will group transactions into (both fee buckets and priority buckets)
     std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    double logSpacing;                        // log of the ratio between the first two bucket bounds
+
+    // Tables indexed by [Y][X] below are flat arrays of maxConfirms rows of
+    // buckets.size() entries, i.e. table[Y * buckets.size() + X]
+    unsigned int maxConfirms;
 
     // For each bucket X:
     // Count the total # of txs in each bucket
@@ -92,9 +99,10 @@ private:
 
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calculate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
+    std::vector<double> confAvg; // confAvg[Y][X]
+    // and count the txs confirmed in exactly Y blocks in the current block;
+    // these are summed up into "within Y blocks" when the averages are updated
+    std::vector<int> curBlockConf; // curBlockConf[Y][X]
 
     // Sum the total priority/fee of all tx's in each bucket
     // Track the historical moving average of this total over blocks
@@ -111,11 +119,26 @@ private:
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    std::vector<int> unconfTxs;  //unconfTxs[Y][X]
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    /** Return the index of the lowest bucket whose upper bound is >= val */
+    unsigned int FindBucketIndex(double val) const;
+
+    /**
+     * Fill unconfAtLeast[Y][X] with the number of mempool transactions in
+     * bucket X that have been waiting Y+1 blocks or more at nBlockHeight.
+     */
+    void CountUnconfirmed(unsigned int nBlockHeight, std::vector<int>& unconfAtLeast) const;
+
+    /** EstimateMedianVal using a table filled by CountUnconfirmed */
+    double EstimateMedianVal(int confTarget, double sufficientTxVal, double minSuccess,
+                             bool requireGreater, const std::vector<int>& unconfAtLeast) const;
+
 public:
+    TxConfirmStats() : logSpacing(0), maxConfirms(0), decay(0) {}
+
     /**
      * Initialize the data structures.  This is called by BlockPolicyEstimator's
      * constructor with default values.
@@ -160,10 +183,18 @@ public:
      * @param nBlockHeight the current block height
      */
     double EstimateMedianVal(int confTarget, double sufficientTxVal,
-                             double minSuccess, bool requireGreater, unsigned int nBlockHeight);
+                             double minSuccess, bool requireGreater, unsigned int nBlockHeight) const;
+
+    /**
+     * Calculate the estimate for every target from 1 to GetMaxConfirms() at
+     * once, sharing the mempool counts between targets.
+     * @param medians set to the estimates, medians[confTarget - 1]
+     */
+    void EstimateMedianVals(double sufficientTxVal, double minSuccess, bool requireGreater,
+                            unsigned int nBlockHeight, std::vector<double>& medians) const;
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() { return confAvg.size(); }
+    unsigned int GetMaxConfirms() const { return maxConfirms; }
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout);
@@ -221,9 +252,10 @@ public:
     /** Create new BlockPolicyEstimator and initialize stats tracking classes with default values */
     CBlockPolicyEstimator(const CFeeRate& minRelayFee);
 
-    /** Process all the transactions that have been included in a block */
+    /** Process all the transactions that have been included in a block.
+     *  The entries are still in the mempool and stop being tracked here. */
     void processBlock(unsigned int nBlockHeight,
-                      std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate);
+                      std::vector<const CTxMemPoolEntry*>& entries, bool fCurrentEstimate);
 
     /** Process a transaction confirmed in a block*/
     void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry);
@@ -231,8 +263,8 @@ public:
     /** Process a transaction accepted to the mempool*/
     void processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate);
 
-    /** Remove a transaction from the mempool tracking stats*/
-    void removeTx(uint256 hash);
+    /** Remove a transaction from the mempool tracking stats, return whether it was tracked */
+    bool removeTx(const uint256& hash);
 
     /** Is this transaction likely included in a block because of its fee?*/
     bool isFeeDataPoint(const CFeeRate &fee, double pri);
@@ -276,12 +308,23 @@ private:
         TxStatsInfo() : stats(NULL), blockHeight(0), bucketIndex(0) {}
     };
 
-    // map of txids to information about that transaction
-    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
+    // map of txids to information about the transactions being tracked
+    boost::unordered_map<uint256, TxStatsInfo, SaltedTxidHasher> mapMemPoolTxs;
 
     /** Classes to track historical data on transaction confirmations */
     TxConfirmStats feeStats, priStats;
 
+    /**
+     * Estimates for every target, index is confTarget - 1.  They are
+     * recalculated together on the first request after a block or a change
+     * in the tracked mempool txs, so repeated requests are just lookups.
+     */
+    std::vector<double> feeEstimates, priEstimates;
+    bool fEstimatesStale;
+
+    /** Recalculate feeEstimates and priEstimates at nBestSeenHeight */
+    void UpdateEstimates();
+
     /** Breakpoints to help determine whether a transaction was confirmed by priority or Fee */
     CFeeRate feeLikely, feeUnlikely;
     double priLikely, priUnlikely;
@@ -67,14 +67,62 @@ uint256 CMutableTransaction::GetHash() const
     return SerializeHash(*this, SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS);
 }
 
-void CTransaction::UpdateHash() const
+namespace {
+/** Writes serialized data to the txid hash, and also to the wtxid hash if there is one. */
+class CTxHashesWriter
 {
-    *const_cast<uint256*>(&hash) = SerializeHash(*this, SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS);
+private:
+    CHashWriter& ssHash;
+    CHashWriter* pssWitnessHash;
+
+public:
+    CTxHashesWriter(CHashWriter& ssHashIn, CHashWriter* pssWitnessHashIn) : ssHash(ssHashIn), pssWitnessHash(pssWitnessHashIn) {}
+
+    int GetType() const { return SER_GETHASH; }
+    int GetVersion() const { return SERIALIZE_TRANSACTION_NO_WITNESS; }
+
+    CTxHashesWriter& write(const char *pch, size_t size) {
+        ssHash.write(pch, size);
+        if (pssWitnessHash)
+            pssWitnessHash->write(pch, size);
+        return (*this);
+    }
+
+    template<typename T>
+    CTxHashesWriter& operator<<(const T& obj) {
+        ::Serialize(*this, obj, GetType(), GetVersion());
+        return (*this);
+    }
+};
 }
 
-uint256 CTransaction::GetWitnessHash() const
+void CTransaction::UpdateHash() const
 {
-    return SerializeHash(*this, SER_GETHASH, 0);
+    // Serialize once, as SerializeTransaction does: the witness marker and the
+    // witnesses only go into the wtxid, everything else into both hashes.
+    // Without witnesses both serializations are the same, and so are the hashes.
+    const bool fWitness = !wit.IsNull();
+    CHashWriter ssHash(SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS);
+    CHashWriter ssWitnessHash(SER_GETHASH, 0);
+    CTxHashesWriter ssBoth(ssHash, fWitness ? &ssWitnessHash : NULL);
+    ssBoth << nVersion;
+    if (fWitness) {
+        const unsigned char flags = 1;
+        ssWitnessHash << std::vector<CTxIn>() << flags;
+    }
+    ssBoth << vin << vout;
+    if (fWitness) {
+        // Inputs without an entry in vtxinwit have an empty witness
+        for (size_t i = 0; i < vin.size(); i++) {
+            if (i < wit.vtxinwit.size())
+                ssWitnessHash << wit.vtxinwit[i];
+            else
+                ssWitnessHash << CTxInWitness();
+        }
+    }
+    ssBoth << nLockTime;
+    *const_cast<uint256*>(&hash) = ssHash.GetHash();
+    *const_cast<uint256*>(&witnessHash) = fWitness ? ssWitnessHash.GetHash() : hash;
 }
 
 CTransaction::CTransaction() : nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) { }
@@ -90,6 +138,7 @@ CTransaction& CTransaction::operator=(const CTransaction &tx) {
     *const_cast<CTxWitness*>(&wit) = tx.wit;
     *const_cast<unsigned int*>(&nLockTime) = tx.nLockTime;
     *const_cast<uint256*>(&hash) = tx.hash;
+    *const_cast<uint256*>(&witnessHash) = tx.witnessHash;
     return *this;
 }
 
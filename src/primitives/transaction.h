@@ -354,6 +354,7 @@ class CTransaction
 private:
     /** Memory only. */
     const uint256 hash;
+    const uint256 witnessHash;
 
 public:
     // Default transaction version.
@@ -373,7 +374,7 @@ public:
     const int32_t nVersion;
     const std::vector<CTxIn> vin;
     const std::vector<CTxOut> vout;
-    CTxWitness wit; // Not const: can change without invalidating the txid cache
+    CTxWitness wit; // Not const: can change without invalidating the txid cache, but call UpdateHash() for the wtxid
     const uint32_t nLockTime;
 
     /** Construct a CTransaction that qualifies as IsNull() */
@@ -402,8 +403,10 @@ public:
         return hash;
     }
 
-    // Compute a hash that includes both transaction and witness data
-    uint256 GetWitnessHash() const;
+    // Hash that includes both transaction and witness data, cached like GetHash()
+    const uint256& GetWitnessHash() const {
+        return witnessHash;
+    }
 
     // Return sum of txouts.
     CAmount GetValueOut() const;
@@ -39,6 +39,9 @@ const char *SENDCMPCT="sendcmpct";
 const char *CMPCTBLOCK="cmpctblock";
 const char *GETBLOCKTXN="getblocktxn";
 const char *BLOCKTXN="blocktxn";
+const char *SENDSHORTTX="sendshorttx";
+const char *SHORTTXINV="shorttxinv";
+const char *GETSHORTTX="getshorttx";
 };
 
 /** All known message types. Keep this in the same order as the list of
@@ -71,6 +74,9 @@ const static std::string allNetMessageTypes[] = {
     NetMsgType::CMPCTBLOCK,
     NetMsgType::GETBLOCKTXN,
     NetMsgType::BLOCKTXN,
+    NetMsgType::SENDSHORTTX,
+    NetMsgType::SHORTTXINV,
+    NetMsgType::GETSHORTTX,
 };
 const static std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes+ARRAYLEN(allNetMessageTypes));
 
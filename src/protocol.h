@@ -243,6 +243,26 @@ extern const char *GETBLOCKTXN;
  * @since protocol version 70014 as described by BIP 152
  */
 extern const char *BLOCKTXN;
+/**
+ * Contains an 8-byte LE version number and an 8-byte LE salt.
+ * Indicates that a node wants transactions announced to it via "shorttxinv"
+ * messages, with short ids salted by the given salt.
+ * @since protocol version 110015
+ */
+extern const char *SENDSHORTTX;
+/**
+ * Contains a TransactionShortIDs object, announcing transactions by their
+ * short ids salted as the receiving peer asked for in "sendshorttx".
+ * @since protocol version 110015
+ */
+extern const char *SHORTTXINV;
+/**
+ * Contains a TransactionShortIDs object, requesting transactions announced
+ * in earlier "shorttxinv" messages.
+ * Peer should respond with "tx" messages.
+ * @since protocol version 110015
+ */
+extern const char *GETSHORTTX;
 };
 
 /* Get a vector of all valid message types (see above) */
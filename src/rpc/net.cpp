@@ -65,6 +65,39 @@ UniValue ping(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+static UniValue LatencyToJSON(const CLatencyHistogram& hist, bool fBuckets)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("avg", hist.Average() / 1e6));
+    obj.push_back(Pair("max", hist.nMax / 1e6));
+    obj.push_back(Pair("p50", hist.Percentile(0.5) / 1e6));
+    obj.push_back(Pair("p90", hist.Percentile(0.9) / 1e6));
+    obj.push_back(Pair("p99", hist.Percentile(0.99) / 1e6));
+    if (fBuckets) {
+        UniValue buckets(UniValue::VARR);
+        for (int i = 0; i < CLatencyHistogram::BUCKETS; i++)
+            buckets.push_back(hist.vBuckets[i]);
+        obj.push_back(Pair("histogram", buckets));
+    }
+    return obj;
+}
+
+static UniValue MsgTimingToJSON(const mapMsgCmdTiming& mapTiming, bool fBuckets)
+{
+    UniValue ret(UniValue::VOBJ);
+    BOOST_FOREACH(const mapMsgCmdTiming::value_type &i, mapTiming) {
+        if (i.second.process.nCount == 0)
+            continue;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("count", i.second.process.nCount));
+        obj.push_back(Pair("process", LatencyToJSON(i.second.process, fBuckets)));
+        obj.push_back(Pair("queue", LatencyToJSON(i.second.queue, fBuckets)));
+        obj.push_back(Pair("cs_main", LatencyToJSON(i.second.lock, fBuckets)));
+        ret.push_back(Pair(i.first, obj));
+    }
+    return ret;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -88,6 +121,9 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"pingtime\": n,             (numeric) ping time (if available)\n"
             "    \"minping\": n,              (numeric) minimum observed ping time (if any at all)\n"
             "    \"pingwait\": n,             (numeric) ping wait (if non-zero)\n"
+            "    \"msghandler\": n,           (numeric) Index of the message handler thread serving this peer\n"
+            "    \"queuewait\": n,            (numeric) Average time in seconds a received message waited before processing\n"
+            "    \"maxqueuewait\": n,         (numeric) Longest time in seconds a received message waited before processing\n"
             "    \"version\": v,              (numeric) The peer version, such as 7001\n"
             "    \"subver\": \"/Satoshi:0.8.5/\",  (string) The string version\n"
             "    \"inbound\": true|false,     (boolean) Inbound (true) or Outbound (false)\n"
@@ -99,6 +135,10 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ]\n"
+            "    \"blocklatency\": n,         (numeric) Average time in seconds between requesting a block from this peer and receiving it\n"
+            "    \"blockinterval\": n,        (numeric) Average time in seconds this peer takes to deliver each next requested block\n"
+            "    \"blockthroughput\": n,      (numeric) Estimated block download rate from this peer in bytes per second\n"
+            "    \"blockquota\": n,           (numeric) The number of blocks we allow in flight from this peer at once\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,             (numeric) The total bytes sent aggregated by message type\n"
             "       ...\n"
@@ -107,6 +147,14 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       \"addr\": n,             (numeric) The total bytes received aggregated by message type\n"
             "       ...\n"
             "    }\n"
+            "    \"timing_per_msg\": {\n"
+            "       \"addr\": {            (object) Timings of the messages of this type processed so far, in seconds\n"
+            "         \"count\": n,         (numeric) The number of messages processed\n"
+            "         \"process\": {...},   (object) Time spent processing: avg, max, p50, p90 and p99\n"
+            "         \"queue\": {...},     (object) Time waited before processing started, same fields\n"
+            "         \"cs_main\": {...}    (object) Time cs_main was held while processing, same fields\n"
+            "       }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -145,6 +193,9 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(Pair("minping", stats.dPingMin));
         if (stats.dPingWait > 0.0)
             obj.push_back(Pair("pingwait", stats.dPingWait));
+        obj.push_back(Pair("msghandler", stats.nMsgHandler));
+        obj.push_back(Pair("queuewait", stats.dQueueWait));
+        obj.push_back(Pair("maxqueuewait", stats.dQueueWaitMax));
         obj.push_back(Pair("version", stats.nVersion));
         // Use the sanitized form of subver here, to avoid tricksy remote peers from
         // corrupting or modifiying the JSON output by putting special characters in
@@ -161,6 +212,10 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blocklatency", statestats.nBlockLatencyAvg * 0.000001));
+            obj.push_back(Pair("blockinterval", statestats.nBlockIntervalAvg * 0.000001));
+            obj.push_back(Pair("blockthroughput", statestats.nBlockIntervalAvg ? statestats.nBlockSizeAvg * 1000000 / statestats.nBlockIntervalAvg : 0));
+            obj.push_back(Pair("blockquota", statestats.nBlocksInTransitQuota));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -177,6 +232,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 recvPerMsgCmd.push_back(Pair(i.first, i.second));
         }
         obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
+        obj.push_back(Pair("timing_per_msg", MsgTimingToJSON(stats.mapMsgTiming, false)));
 
         ret.push_back(obj);
     }
@@ -365,6 +421,51 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetstats\n"
+            "\nReturns timings of the p2p messages processed since startup, by message type.\n"
+            "All times are in seconds. Percentiles are the upper bound of the histogram bucket they fall into.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"bucketlimits\": [ n, ... ],  (array) The exclusive upper bound of each histogram bucket but the last, which is unbounded\n"
+            "  \"messages\": {\n"
+            "    \"tx\": {                    (object) Timings of one message type\n"
+            "      \"count\": n,              (numeric) The number of messages processed\n"
+            "      \"process\": {             (object) Time spent processing the message\n"
+            "        \"avg\": n,              (numeric) Average\n"
+            "        \"max\": n,              (numeric) Maximum\n"
+            "        \"p50\": n,              (numeric) Median\n"
+            "        \"p90\": n,              (numeric) 90th percentile\n"
+            "        \"p99\": n,              (numeric) 99th percentile\n"
+            "        \"histogram\": [ n, ... ] (array) The number of messages in each bucket\n"
+            "      },\n"
+            "      \"queue\": {...},          (object) Time waited before processing started, same fields\n"
+            "      \"cs_main\": {...}         (object) Time cs_main was held while processing, same fields\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetstats", "")
+            + HelpExampleRpc("getnetstats", "")
+       );
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    mapMsgCmdTiming mapTiming;
+    g_connman->GetMessageTiming(mapTiming);
+
+    UniValue obj(UniValue::VOBJ);
+    UniValue limits(UniValue::VARR);
+    for (int i = 0; i < CLatencyHistogram::BUCKETS - 1; i++)
+        limits.push_back(CLatencyHistogram::BucketLimit(i) / 1e6);
+    obj.push_back(Pair("bucketlimits", limits));
+    obj.push_back(Pair("messages", MsgTimingToJSON(mapTiming, true)));
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -411,6 +512,24 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
             "  ,...\n"
             "  ],\n"
             "  \"relayfee\": x.xxxxxxxx,                (numeric) minimum relay fee for non-free transactions in " + CURRENCY_UNIT + "/kB\n"
+            "  \"recvbufferpool\": {                    (json object) pool of reusable message receive buffers\n"
+            "    \"buffers\": xxx,                      (numeric) buffers currently pooled\n"
+            "    \"bytes\": xxx,                        (numeric) total capacity of the pooled buffers\n"
+            "    \"hits\": xxx,                         (numeric) received messages that reused a pooled buffer\n"
+            "    \"misses\": xxx                        (numeric) received messages that needed a new buffer\n"
+            "  },\n"
+            "  \"compactblocks\": {                     (json object) reconstruction of received compact blocks\n"
+            "    \"blocks\": xxx,                       (numeric) compact blocks reconstructed\n"
+            "    \"withoutrequest\": xxx,               (numeric) ... of which without requesting missing transactions\n"
+            "    \"roundtripssaved\": xxx,              (numeric) ... of which only thanks to the extra transaction pool\n"
+            "    \"transactions\": xxx,                 (numeric) transactions in those blocks\n"
+            "    \"prefilled\": xxx,                    (numeric) ... sent along with the compact block\n"
+            "    \"mempool\": xxx,                      (numeric) ... found in the mempool\n"
+            "    \"extrapool\": xxx,                    (numeric) ... found in the extra transaction pool\n"
+            "    \"requested\": xxx,                    (numeric) ... requested from the peer\n"
+            "    \"hitrate\": x.xxx,                    (numeric) fraction of transactions we didn't need to request\n"
+            "    \"extrapoolsize\": xxx                 (numeric) transactions currently in the extra transaction pool\n"
+            "  },\n"
             "  \"localaddresses\": [                    (array) list of local addresses\n"
             "  {\n"
             "    \"address\": \"xxxx\",                 (string) network address\n"
@@ -439,6 +558,28 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
         obj.push_back(Pair("connections",   (int)g_connman->GetNodeCount(CConnman::CONNECTIONS_ALL)));
     obj.push_back(Pair("networks",      GetNetworksInfo()));
     obj.push_back(Pair("relayfee",      ValueFromAmount(::minRelayTxFee.GetFeePerK())));
+    CRecvBufferPoolStats poolStats;
+    GetRecvBufferPoolStats(poolStats);
+    UniValue recvBufferPool(UniValue::VOBJ);
+    recvBufferPool.push_back(Pair("buffers", (uint64_t)poolStats.nBuffers));
+    recvBufferPool.push_back(Pair("bytes", (uint64_t)poolStats.nBytes));
+    recvBufferPool.push_back(Pair("hits", poolStats.nHits));
+    recvBufferPool.push_back(Pair("misses", poolStats.nMisses));
+    obj.push_back(Pair("recvbufferpool", recvBufferPool));
+    CCompactBlockStats cmpctStats;
+    GetCompactBlockStats(cmpctStats);
+    UniValue compactBlocks(UniValue::VOBJ);
+    compactBlocks.push_back(Pair("blocks", cmpctStats.nBlocks));
+    compactBlocks.push_back(Pair("withoutrequest", cmpctStats.nBlocksWithoutRequest));
+    compactBlocks.push_back(Pair("roundtripssaved", cmpctStats.nRoundTripsSaved));
+    compactBlocks.push_back(Pair("transactions", cmpctStats.nTxTotal));
+    compactBlocks.push_back(Pair("prefilled", cmpctStats.nTxPrefilled));
+    compactBlocks.push_back(Pair("mempool", cmpctStats.nTxFromMempool));
+    compactBlocks.push_back(Pair("extrapool", cmpctStats.nTxFromExtra));
+    compactBlocks.push_back(Pair("requested", cmpctStats.nTxRequested));
+    compactBlocks.push_back(Pair("hitrate", cmpctStats.nTxTotal ? 1.0 - (double)cmpctStats.nTxRequested / cmpctStats.nTxTotal : 0.0));
+    compactBlocks.push_back(Pair("extrapoolsize", (uint64_t)cmpctStats.nExtraTxn));
+    obj.push_back(Pair("compactblocks", compactBlocks));
     UniValue localAddresses(UniValue::VARR);
     {
         LOCK(cs_mapLocalHost);
@@ -581,6 +722,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         true  },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
+    { "network",            "getnetstats",            &getnetstats,            true  },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
     { "network",            "setban",                 &setban,                 true  },
     { "network",            "listbanned",             &listbanned,             true  },
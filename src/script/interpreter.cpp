@@ -11,6 +11,7 @@
 #include "crypto/sha256.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1156,6 +1157,105 @@ uint256 GetOutputsHash(const CTransaction& txTo) {
     return ss.GetHash();
 }
 
+/** Size of an input in a legacy signature hash serialization with its scriptSig blanked */
+const size_t LEGACY_BLANK_INPUT_SIZE = 36 + 1 + 4;
+/** Number of inputs between two SHA256 midstates in PrecomputedTransactionData */
+const unsigned int LEGACY_MIDSTATE_INTERVAL = 8;
+/** Fewest legacy inputs for which the precomputed serialization pays for itself */
+const unsigned int LEGACY_MIDSTATE_MIN_INPUTS = 4;
+
+/** Stream that feeds a double SHA256 started from a given midstate, like CHashWriter. */
+class CMidstateHashWriter
+{
+private:
+    CSHA256 sha;
+
+public:
+    explicit CMidstateHashWriter(const CSHA256& shaIn) : sha(shaIn) {}
+
+    int GetType() const { return SER_GETHASH; }
+    int GetVersion() const { return 0; }
+
+    CMidstateHashWriter& write(const char *pch, size_t size) {
+        sha.Write((const unsigned char*)pch, size);
+        return (*this);
+    }
+
+    template<typename T>
+    CMidstateHashWriter& operator<<(const T& obj) {
+        ::Serialize(*this, obj, SER_GETHASH, 0);
+        return (*this);
+    }
+
+    uint256 GetHash() {
+        unsigned char buf[CSHA256::OUTPUT_SIZE];
+        sha.Finalize(buf);
+        uint256 result;
+        CSHA256().Write(buf, CSHA256::OUTPUT_SIZE).Finalize(result.begin());
+        return result;
+    }
+};
+
+void PrecomputeLegacySerialization(const CTransaction& txTo, PrecomputedTransactionData& txdata)
+{
+    unsigned int nLegacyInputs = 0;
+    for (unsigned int n = 0; n < txTo.vin.size(); n++) {
+        if (n >= txTo.wit.vtxinwit.size() || txTo.wit.vtxinwit[n].IsNull())
+            nLegacyInputs++;
+    }
+    if (nLegacyInputs < LEGACY_MIDSTATE_MIN_INPUTS)
+        return;
+
+    CDataStream ssInputs(SER_GETHASH, 0);
+    ssInputs << txTo.nVersion;
+    ::WriteCompactSize(ssInputs, txTo.vin.size());
+    size_t nHeaderSize = ssInputs.size();
+    for (unsigned int n = 0; n < txTo.vin.size(); n++) {
+        ssInputs << txTo.vin[n].prevout << CScriptBase() << txTo.vin[n].nSequence;
+    }
+    assert(ssInputs.size() == nHeaderSize + txTo.vin.size() * LEGACY_BLANK_INPUT_SIZE);
+    txdata.vchLegacyInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    txdata.vchLegacyOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+
+    CSHA256 sha;
+    sha.Write(&txdata.vchLegacyInputs[0], nHeaderSize);
+    txdata.vLegacyMidstates.reserve(txTo.vin.size() / LEGACY_MIDSTATE_INTERVAL + 1);
+    txdata.vLegacyMidstates.push_back(sha);
+    for (unsigned int n = LEGACY_MIDSTATE_INTERVAL; n < txTo.vin.size(); n += LEGACY_MIDSTATE_INTERVAL) {
+        sha.Write(&txdata.vchLegacyInputs[nHeaderSize + (n - LEGACY_MIDSTATE_INTERVAL) * LEGACY_BLANK_INPUT_SIZE], LEGACY_MIDSTATE_INTERVAL * LEGACY_BLANK_INPUT_SIZE);
+        txdata.vLegacyMidstates.push_back(sha);
+    }
+}
+
+/**
+ * Legacy SIGHASH_ALL signature hash from the precomputed serialization:
+ * starts from the midstate closest before input nIn, and copies everything
+ * but the scriptCode from the precomputed bytes. Identical to hashing
+ * CTransactionSignatureSerializer's output.
+ */
+uint256 LegacySignatureHashAll(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData& txdata)
+{
+    const size_t nHeaderSize = txdata.vchLegacyInputs.size() - txTo.vin.size() * LEGACY_BLANK_INPUT_SIZE;
+    const unsigned int nMidstate = nIn / LEGACY_MIDSTATE_INTERVAL;
+    const unsigned char* pInputs = &txdata.vchLegacyInputs[nHeaderSize];
+
+    CMidstateHashWriter ss(txdata.vLegacyMidstates[nMidstate]);
+    // The blank inputs since the midstate, and the prevout of the input being signed
+    size_t nFrom = nMidstate * LEGACY_MIDSTATE_INTERVAL * LEGACY_BLANK_INPUT_SIZE;
+    size_t nTo = nIn * LEGACY_BLANK_INPUT_SIZE + 36;
+    ss.write((const char*)pInputs + nFrom, nTo - nFrom);
+    CTransactionSignatureSerializer(txTo, scriptCode, nIn, nHashType).SerializeScriptCode(ss, SER_GETHASH, 0);
+    // Its nSequence and the blank inputs after it, then the outputs and nLockTime
+    nFrom = nTo + 1;
+    ss.write((const char*)pInputs + nFrom, txTo.vin.size() * LEGACY_BLANK_INPUT_SIZE - nFrom);
+    ss.write((const char*)&txdata.vchLegacyOutputs[0], txdata.vchLegacyOutputs.size());
+    ss << nHashType;
+    return ss.GetHash();
+}
+
 } // anon namespace
 
 PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
@@ -1163,6 +1263,7 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
     hashPrevouts = GetPrevoutHash(txTo);
     hashSequence = GetSequenceHash(txTo);
     hashOutputs = GetOutputsHash(txTo);
+    PrecomputeLegacySerialization(txTo, *this);
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1226,6 +1327,13 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    // SIGHASH_ALL without SIGHASH_ANYONECANPAY serializes every input the same way
+    // except the one being signed, so reuse the work done for the whole transaction
+    if (cache && !cache->vLegacyMidstates.empty() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        return LegacySignatureHashAll(scriptCode, txTo, nIn, nHashType, *cache);
+    }
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
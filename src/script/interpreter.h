@@ -8,6 +8,7 @@
 
 #include "script_error.h"
 #include "primitives/transaction.h"
+#include "crypto/sha256.h"
 
 #include <vector>
 #include <stdint.h>
@@ -110,6 +111,16 @@ struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
 
+    /**
+     * For legacy SIGHASH_ALL signatures of transactions with several legacy
+     * inputs: the signature hash serialization with every scriptSig blanked,
+     * as the header and inputs, and the outputs and nLockTime, plus SHA256
+     * states after the header and every LEGACY_MIDSTATE_INTERVAL inputs.
+     * Empty if not worth computing.
+     */
+    std::vector<unsigned char> vchLegacyInputs, vchLegacyOutputs;
+    std::vector<CSHA256> vLegacyMidstates;
+
     PrecomputedTransactionData(const CTransaction& tx);
 };
 
@@ -20,10 +20,9 @@ typedef vector<unsigned char> valtype;
 unsigned int HaveKeys(const vector<valtype>& pubkeys, const CKeyStore& keystore)
 {
     unsigned int nResult = 0;
-    BOOST_FOREACH(const valtype& pubkey, pubkeys)
+    BOOST_FOREACH(const uint160& hash, Hash160Many(pubkeys))
     {
-        CKeyID keyID = CPubKey(pubkey).GetID();
-        if (keystore.HaveKey(keyID))
+        if (keystore.HaveKey(CKeyID(hash)))
             ++nResult;
     }
     return nResult;
@@ -10,9 +10,11 @@
 
 #include <vector>
 
-// DoS prevention: limit cache size to less than 40MB (over 500000
-// entries on 64-bit systems).
-static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
+// DoS prevention: limit cache size to 40MB (over 1000000 entries on all
+// systems). The cache is allocated up front, at startup.
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 40;
+// Maximum sig cache size allowed, in MiB
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
 
 class CPubKey;
 
@@ -27,4 +29,7 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Allocate the signature cache, sized by -maxsigcachesize. Must be called before any script checks. */
+void InitSignatureCache();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -222,15 +222,17 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
     if (typeRet == TX_MULTISIG)
     {
         nRequiredRet = vSolutions.front()[0];
+        std::vector<CPubKey> vPubKeys;
         for (unsigned int i = 1; i < vSolutions.size()-1; i++)
         {
             CPubKey pubKey(vSolutions[i]);
             if (!pubKey.IsValid())
                 continue;
 
-            CTxDestination address = pubKey.GetID();
-            addressRet.push_back(address);
+            vPubKeys.push_back(pubKey);
         }
+        BOOST_FOREACH(const uint160& hash, Hash160Many(vPubKeys))
+            addressRet.push_back(CKeyID(hash));
 
         if (addressRet.empty())
             return false;
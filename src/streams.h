@@ -149,6 +149,7 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -332,6 +333,12 @@ public:
         clear();
     }
 
+    /** Exchange the unread contents of the stream with data, without copying. */
+    void Swap(CSerializeData &data) {
+        Compact();
+        vch.swap(data);
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
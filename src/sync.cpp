@@ -6,12 +6,61 @@
 
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 
 #include <stdio.h>
 
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+struct LockHoldTimer {
+    void* cs;
+    int nDepth;
+    int64_t nStart;
+    int64_t nTotal;
+};
+
+static boost::thread_specific_ptr<LockHoldTimer> lockholdtimer;
+
+void StartLockHoldTimer(void* cs)
+{
+    LockHoldTimer* timer = lockholdtimer.get();
+    if (!timer) {
+        timer = new LockHoldTimer();
+        lockholdtimer.reset(timer);
+    }
+    timer->cs = cs;
+    timer->nDepth = 0;
+    timer->nStart = 0;
+    timer->nTotal = 0;
+}
+
+int64_t StopLockHoldTimer()
+{
+    LockHoldTimer* timer = lockholdtimer.get();
+    if (!timer || !timer->cs)
+        return 0;
+    int64_t nTotal = timer->nTotal;
+    if (timer->nDepth > 0)
+        nTotal += GetTimeMicros() - timer->nStart;
+    timer->cs = NULL;
+    return nTotal;
+}
+
+void LockHoldTimerEnter(void* cs)
+{
+    LockHoldTimer* timer = lockholdtimer.get();
+    if (timer && timer->cs == cs && timer->nDepth++ == 0)
+        timer->nStart = GetTimeMicros();
+}
+
+void LockHoldTimerLeave(void* cs)
+{
+    LockHoldTimer* timer = lockholdtimer.get();
+    if (timer && timer->cs == cs && timer->nDepth > 0 && --timer->nDepth == 0)
+        timer->nTotal += GetTimeMicros() - timer->nStart;
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
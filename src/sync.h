@@ -8,6 +8,8 @@
 
 #include "threadsafety.h"
 
+#include <stdint.h>
+
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -85,6 +87,17 @@ void static inline DeleteLock(void* cs) {}
 #endif
 #define AssertLockHeld(cs) AssertLockHeldInternal(#cs, __FILE__, __LINE__, &cs)
 
+/**
+ * Lock hold timing: measure how long the calling thread holds one lock, e.g.
+ * cs_main while it processes a message. Only locks taken through LOCK and
+ * TRY_LOCK are seen, and recursive locking is counted once.
+ */
+void StartLockHoldTimer(void* cs);
+/** Stop the calling thread's timer, and return how long (in microseconds) the lock was held. */
+int64_t StopLockHoldTimer();
+void LockHoldTimerEnter(void* cs);
+void LockHoldTimerLeave(void* cs);
+
 /**
  * Wrapped boost mutex: supports recursive locking, but no waiting
  * TODO: We should move away from using the recursive lock by default.
@@ -126,6 +139,7 @@ private:
 #ifdef DEBUG_LOCKCONTENTION
         }
 #endif
+        LockHoldTimerEnter((void*)(lock.mutex()));
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
@@ -134,6 +148,8 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        else
+            LockHoldTimerEnter((void*)(lock.mutex()));
         return lock.owns_lock();
     }
 
@@ -159,8 +175,10 @@ public:
 
     ~CMutexLock() UNLOCK_FUNCTION()
     {
-        if (lock.owns_lock())
+        if (lock.owns_lock()) {
+            LockHoldTimerLeave((void*)(lock.mutex()));
             LeaveCritical();
+        }
     }
 
     operator bool()
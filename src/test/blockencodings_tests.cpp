@@ -16,6 +16,8 @@ struct RegtestingSetup : public TestingSetup {
     RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
 };
 
+std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > empty_extra_txn;
+
 BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, RegtestingSetup)
 
 static void SetBlockVersion(CPureBlockHeader& header, int32_t baseVersion) {
@@ -79,7 +81,7 @@ BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, empty_extra_txn) == READ_STATUS_OK);
         BOOST_CHECK( partialBlock.IsTxAvailable(0));
         BOOST_CHECK(!partialBlock.IsTxAvailable(1));
         BOOST_CHECK( partialBlock.IsTxAvailable(2));
@@ -177,7 +179,7 @@ BOOST_AUTO_TEST_CASE(NonCoinbasePreforwardRTTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, empty_extra_txn) == READ_STATUS_OK);
         BOOST_CHECK(!partialBlock.IsTxAvailable(0));
         BOOST_CHECK( partialBlock.IsTxAvailable(1));
         BOOST_CHECK( partialBlock.IsTxAvailable(2));
@@ -230,7 +232,7 @@ BOOST_AUTO_TEST_CASE(SufficientPreforwardRTTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, empty_extra_txn) == READ_STATUS_OK);
         BOOST_CHECK( partialBlock.IsTxAvailable(0));
         BOOST_CHECK( partialBlock.IsTxAvailable(1));
         BOOST_CHECK( partialBlock.IsTxAvailable(2));
@@ -250,6 +252,55 @@ BOOST_AUTO_TEST_CASE(SufficientPreforwardRTTest)
     BOOST_CHECK_EQUAL(pool.mapTx.find(block.vtx[1].GetHash())->GetSharedTx().use_count(), SHARED_TX_OFFSET + 0);
 }
 
+BOOST_AUTO_TEST_CASE(ExtraTxnRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(block.vtx[2]));
+
+    // tx 1 is only among the extra transactions, tx 2 is both there and in the mempool
+    std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > extra_txn(4);
+    extra_txn[1] = std::make_pair(block.vtx[1].GetHash(), std::make_shared<const CTransaction>(block.vtx[1]));
+    extra_txn[2] = std::make_pair(block.vtx[2].GetHash(), std::make_shared<const CTransaction>(block.vtx[2]));
+
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, extra_txn) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(partialBlock.IsTxAvailable(1));
+        BOOST_CHECK(partialBlock.IsTxAvailable(2));
+        BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1);
+        BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1);
+        BOOST_CHECK_EQUAL(partialBlock.GetExtraCount(), 1);
+
+        CBlock block2;
+        std::vector<CTransaction> vtx_missing;
+        BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+        bool mutated;
+        BOOST_CHECK_EQUAL(block.hashMerkleRoot.ToString(), BlockMerkleRoot(block2, &mutated).ToString());
+        BOOST_CHECK(!mutated);
+    }
+
+    // Without the extra transactions, tx 1 has to be requested
+    {
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(CBlockHeaderAndShortTxIDs(block), empty_extra_txn) == READ_STATUS_OK);
+        BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+        BOOST_CHECK_EQUAL(partialBlock.GetExtraCount(), 0);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
 {
     CTxMemPool pool(CFeeRate(0));
@@ -282,7 +333,7 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, empty_extra_txn) == READ_STATUS_OK);
         BOOST_CHECK(partialBlock.IsTxAvailable(0));
 
         CBlock block2;
@@ -317,4 +368,28 @@ BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
     BOOST_CHECK_EQUAL(req1.indexes[3], req2.indexes[3]);
 }
 
+BOOST_AUTO_TEST_CASE(TransactionShortIDsSerializationTest) {
+    uint64_t k0, k1, k0b, k1b;
+    TransactionShortIDs::GetShortIDKeys(42, k0, k1);
+    TransactionShortIDs::GetShortIDKeys(43, k0b, k1b);
+    BOOST_CHECK(k0 != k0b || k1 != k1b);
+
+    TransactionShortIDs ids1;
+    for (int i = 0; i < 1500; i++) {
+        uint256 hash = GetRandHash();
+        uint64_t shortid = TransactionShortIDs::GetShortID(k0, k1, hash);
+        BOOST_CHECK_EQUAL(shortid, TransactionShortIDs::GetShortID(k0, k1, hash));
+        BOOST_CHECK_EQUAL(shortid >> 48, 0U);
+        ids1.shorttxids.push_back(shortid);
+    }
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << ids1;
+    BOOST_CHECK_EQUAL(stream.size(), 3 + 6 * ids1.shorttxids.size());
+
+    TransactionShortIDs ids2;
+    stream >> ids2;
+    BOOST_CHECK(ids1.shorttxids == ids2.shorttxids);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "key.h"
 #include "merkleblock.h"
 #include "random.h"
+#include "script/standard.h"
 #include "serialize.h"
 #include "streams.h"
 #include "uint256.h"
@@ -465,6 +466,74 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256S("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(bloom_match_shared_elements)
+{
+    // Pays to a pubkey, a pubkey hash and a bare multisig
+    CKey key1, key2;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    CPubKey pubkey1 = key1.GetPubKey(), pubkey2 = key2.GetPubKey();
+    CMutableTransaction mtx;
+    mtx.vin.resize(2);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vin[0].scriptSig << vector<unsigned char>(72, 1) << ToByteVector(pubkey1);
+    mtx.vin[1].prevout = COutPoint(GetRandHash(), 3);
+    mtx.vin[1].scriptSig << OP_0 << vector<unsigned char>(71, 2);
+    mtx.vout.resize(3);
+    mtx.vout[0].scriptPubKey << ToByteVector(pubkey1) << OP_CHECKSIG;
+    mtx.vout[1].scriptPubKey = GetScriptForDestination(pubkey2.GetID());
+    mtx.vout[2].scriptPubKey = GetScriptForMultisig(1, {pubkey1, pubkey2});
+    CTransaction tx(mtx);
+    CBloomTxElements txElements(tx);
+    BOOST_CHECK(txElements.hash == tx.GetHash());
+    BOOST_CHECK(txElements.vOutputIsP2PubKey == std::vector<bool>({true, false, true}));
+
+    CBlock block;
+    block.vtx.push_back(tx);
+    std::vector<CBloomTxElements> vTxElements(1, txElements);
+
+    // The txid, every kind of element in the transaction, and one that is not in it
+    vector<vector<unsigned char> > vKeys;
+    vKeys.push_back(vector<unsigned char>(tx.GetHash().begin(), tx.GetHash().end()));
+    vKeys.push_back(ToByteVector(pubkey1));
+    vKeys.push_back(ToByteVector(pubkey2.GetID()));
+    vKeys.push_back(vector<unsigned char>(71, 2));
+    {
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << mtx.vin[1].prevout;
+        vKeys.push_back(vector<unsigned char>(stream.begin(), stream.end()));
+    }
+    vKeys.push_back(vector<unsigned char>(20, 3));
+
+    unsigned char vFlags[] = {BLOOM_UPDATE_NONE, BLOOM_UPDATE_ALL, BLOOM_UPDATE_P2PUBKEY_ONLY};
+    for (unsigned int f = 0; f < sizeof(vFlags); f++) {
+        for (unsigned int i = 0; i < vKeys.size(); i++) {
+            CBloomFilter filter(10, 0.000001, insecure_rand(), vFlags[f]);
+            filter.insert(vKeys[i]);
+            CBloomFilter filterShared = filter;
+
+            // Same match, and the same outputs added to the filter
+            bool fMatch = filter.IsRelevantAndUpdate(tx);
+            BOOST_CHECK_EQUAL(fMatch, i + 1 < vKeys.size());
+            BOOST_CHECK_EQUAL(filterShared.IsRelevantAndUpdate(txElements), fMatch);
+            CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+            ss1 << filter;
+            ss2 << filterShared;
+            BOOST_CHECK(ss1.str() == ss2.str());
+
+            // And the same merkle block
+            CMerkleBlock merkleBlock(block, filter);
+            CMerkleBlock merkleBlockShared(block, filterShared, vTxElements);
+            BOOST_CHECK(merkleBlock.vMatchedTxn == merkleBlockShared.vMatchedTxn);
+            ss1.clear();
+            ss2.clear();
+            ss1 << merkleBlock;
+            ss2 << merkleBlockShared;
+            BOOST_CHECK(ss1.str() == ss2.str());
+        }
+    }
+}
+
 static std::vector<unsigned char> RandomData()
 {
     uint256 r = GetRandHash();
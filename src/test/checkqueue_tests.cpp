@@ -0,0 +1,124 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+static std::atomic<uint64_t> nChecksRun(0);
+
+/** Counts how often it ran, and fails if told to. */
+struct CountingCheck
+{
+    bool fPass;
+
+    CountingCheck(bool fPassIn = true) : fPass(fPassIn) {}
+
+    bool operator()()
+    {
+        nChecksRun++;
+        return fPass;
+    }
+
+    void swap(CountingCheck& check) { std::swap(fPass, check.fPass); }
+};
+
+typedef CCheckQueue<CountingCheck> CountingCheckQueue;
+
+/** A queue with nWorkers threads, stopped again on destruction. */
+struct QueueWithWorkers
+{
+    CountingCheckQueue queue;
+    boost::thread_group threads;
+
+    QueueWithWorkers(unsigned int nWorkers, unsigned int nBatchSize = 128) : queue(nBatchSize, nWorkers + 1)
+    {
+        for (unsigned int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CountingCheckQueue::Thread, &queue));
+    }
+
+    ~QueueWithWorkers()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+};
+
+/** Add nChecks checks, in batches of increasing size, then wait for them. With fFailOne, the middle one fails. */
+static bool RunChecks(CountingCheckQueue& queue, size_t nChecks, bool fFailOne = false)
+{
+    CCheckQueueControl<CountingCheck> control(&queue);
+    size_t nAdded = 0;
+    for (size_t nBatch = 1; nAdded < nChecks; nBatch = nBatch % 50 + 1) {
+        std::vector<CountingCheck> vChecks(std::min(nBatch, nChecks - nAdded));
+        if (fFailOne && nAdded <= nChecks / 2 && nChecks / 2 < nAdded + vChecks.size())
+            vChecks[nChecks / 2 - nAdded].fPass = false;
+        nAdded += vChecks.size();
+        control.Add(vChecks);
+    }
+    return control.Wait();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    // Without workers, the master runs everything in Wait()
+    QueueWithWorkers workers(0);
+    nChecksRun = 0;
+    BOOST_CHECK(RunChecks(workers.queue, 1000));
+    BOOST_CHECK_EQUAL(nChecksRun.load(), 1000U);
+    BOOST_CHECK(workers.queue.IsIdle());
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_checks_run)
+{
+    QueueWithWorkers workers(4);
+    for (int i = 0; i < 20; i++) {
+        nChecksRun = 0;
+        size_t nChecks = 1 + i * 997;
+        BOOST_CHECK(RunChecks(workers.queue, nChecks));
+        BOOST_CHECK_EQUAL(nChecksRun.load(), nChecks);
+        BOOST_CHECK(workers.queue.IsIdle());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    QueueWithWorkers workers(4);
+    // A single failing check fails the whole round, and only that round
+    BOOST_CHECK(!RunChecks(workers.queue, 10000, true));
+    BOOST_CHECK(workers.queue.IsIdle());
+    BOOST_CHECK(RunChecks(workers.queue, 10000));
+    BOOST_CHECK(!RunChecks(workers.queue, 10, true));
+    BOOST_CHECK(RunChecks(workers.queue, 10));
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_many_workers)
+{
+    // More threads than there used to be room for, with small batches to make them steal
+    QueueWithWorkers workers(40, 8);
+    nChecksRun = 0;
+    BOOST_CHECK(RunChecks(workers.queue, 50000));
+    BOOST_CHECK_EQUAL(nChecksRun.load(), 50000U);
+
+    // Every check was counted by exactly one thread
+    std::vector<CCheckQueueWorkerStats> vStats = workers.queue.GetWorkerStats();
+    BOOST_CHECK(vStats.size() <= 41U);
+    uint64_t nChecks = 0;
+    for (size_t i = 0; i < vStats.size(); i++) {
+        nChecks += vStats[i].nChecks;
+        BOOST_CHECK(vStats[i].nIdleMicros >= 0);
+    }
+    BOOST_CHECK_EQUAL(nChecks, 50000U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -233,7 +234,7 @@ BOOST_AUTO_TEST_CASE(sha1_testvectors) {
     TestSHA1(test1, "b7755760681cbfd971451668f32af5774f4656b5");
 }
 
-BOOST_AUTO_TEST_CASE(sha256_testvectors) {
+static void TestSHA256Vectors() {
     TestSHA256("", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
     TestSHA256("abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
     TestSHA256("message digest",
@@ -255,6 +256,37 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256_testvectors) {
+    TestSHA256Vectors();
+}
+
+BOOST_AUTO_TEST_CASE(sha256_implementations) {
+    std::vector<std::string> names = SHA256Implementations();
+    BOOST_CHECK(names.size() >= 1 && names[0] == "standard");
+    BOOST_CHECK_EQUAL(SHA256AutoDetect("nonexistent"), "");
+
+    std::vector<unsigned char> in(64 * 35);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = insecure_rand();
+    for (size_t i = 0; i < names.size(); i++) {
+        BOOST_TEST_MESSAGE("Testing the '" << names[i] << "' SHA256 implementation");
+        BOOST_CHECK_EQUAL(SHA256AutoDetect(names[i]), names[i]);
+        TestSHA256Vectors();
+
+        // Batches of every size, so that each lane count and the single-hash tail are used
+        for (size_t blocks = 0; blocks <= 35; blocks++) {
+            std::vector<unsigned char> out(32 * blocks);
+            SHA256D64(out.data(), in.data(), blocks);
+            for (size_t j = 0; j < blocks; j++) {
+                unsigned char expected[32];
+                CHash256().Write(&in[64 * j], 64).Finalize(expected);
+                BOOST_CHECK(memcmp(&out[32 * j], expected, 32) == 0);
+            }
+        }
+    }
+    BOOST_CHECK(!SHA256AutoDetect().empty());
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
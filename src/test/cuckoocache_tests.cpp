@@ -0,0 +1,132 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+static std::vector<uint256> RandomEntries(size_t nCount)
+{
+    std::vector<uint256> vEntries(nCount);
+    for (size_t i = 0; i < nCount; i++)
+        vEntries[i] = GetRandHash();
+    return vEntries;
+}
+
+static double HitRate(CCuckooCache& cache, const std::vector<uint256>& vEntries, size_t nBegin, size_t nEnd)
+{
+    size_t nHits = 0;
+    for (size_t i = nBegin; i < nEnd; i++)
+        nHits += cache.contains(vEntries[i], false);
+    return (double)nHits / (nEnd - nBegin);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_setup)
+{
+    CCuckooCache cache;
+    uint256 entry = GetRandHash();
+
+    // Without memory, nothing is stored
+    BOOST_CHECK_EQUAL(cache.setup_bytes(0), 0U);
+    cache.insert(entry);
+    BOOST_CHECK(!cache.contains(entry, false));
+
+    // The memory used is preallocated, and never more than asked for
+    uint32_t nSlots = cache.setup_bytes(1 << 20);
+    BOOST_CHECK(nSlots > 0);
+    BOOST_CHECK_EQUAL(cache.size(), nSlots);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= (1 << 20));
+    BOOST_CHECK(cache.DynamicMemoryUsage() > (1 << 20) - cache.DynamicMemoryUsage() / nSlots);
+    size_t nUsage = cache.DynamicMemoryUsage();
+    cache.insert(entry);
+    BOOST_CHECK(cache.contains(entry, false));
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), nUsage);
+
+    // Setting up again drops all entries
+    cache.setup_bytes(1 << 20);
+    BOOST_CHECK(!cache.contains(entry, false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_insert_erase)
+{
+    CCuckooCache cache;
+    uint32_t nSlots = cache.setup_bytes(1 << 20);
+    std::vector<uint256> vEntries = RandomEntries(nSlots / 2);
+    for (size_t i = 0; i < vEntries.size(); i++)
+        cache.insert(vEntries[i]);
+
+    // Half full, everything fits
+    BOOST_CHECK_EQUAL(HitRate(cache, vEntries, 0, vEntries.size()), 1.0);
+
+    // Entries that were never inserted are not found
+    std::vector<uint256> vOthers = RandomEntries(1000);
+    BOOST_CHECK_EQUAL(HitRate(cache, vOthers, 0, vOthers.size()), 0.0);
+
+    // Erasing on lookup removes the entry, and only that one
+    BOOST_CHECK(cache.contains(vEntries[0], true));
+    BOOST_CHECK(!cache.contains(vEntries[0], false));
+    BOOST_CHECK(!cache.contains(vEntries[0], true));
+    BOOST_CHECK(cache.contains(vEntries[1], false));
+
+    // Inserting again is a no-op for present entries, and restores erased ones
+    cache.insert(vEntries[1]);
+    cache.insert(vEntries[0]);
+    BOOST_CHECK_EQUAL(HitRate(cache, vEntries, 0, vEntries.size()), 1.0);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_generations)
+{
+    // Overfill the cache four times over: the most recent entries are kept
+    CCuckooCache cache;
+    uint32_t nSlots = cache.setup_bytes(1 << 20);
+    std::vector<uint256> vEntries = RandomEntries(nSlots * 4);
+    for (size_t i = 0; i < vEntries.size(); i++)
+        cache.insert(vEntries[i]);
+
+    double nRecent = HitRate(cache, vEntries, vEntries.size() - nSlots / 2, vEntries.size());
+    double nFull = HitRate(cache, vEntries, vEntries.size() - nSlots, vEntries.size());
+    double nOld = HitRate(cache, vEntries, 0, nSlots);
+    BOOST_TEST_MESSAGE("CuckooCache kept " << nRecent << " of the last size()/2 entries, " << nFull << " of the last size(), and " << nOld << " of the first size()");
+    BOOST_CHECK(nRecent > 0.99);
+    BOOST_CHECK(nFull > 0.95);
+    BOOST_CHECK(nOld < 0.01);
+}
+
+static void InsertAndCheck(CCuckooCache* pcache, const std::vector<uint256>* pvEntries, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        pcache->insert((*pvEntries)[i]);
+        pcache->contains((*pvEntries)[nBegin + (i - nBegin) / 2], false);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_threads)
+{
+    // Concurrent inserts and lookups of disjoint entries
+    static const int THREADS = 4;
+    CCuckooCache cache;
+    uint32_t nSlots = cache.setup_bytes(1 << 20);
+    std::vector<uint256> vEntries = RandomEntries(nSlots / 2);
+    boost::thread_group threads;
+    size_t nPerThread = vEntries.size() / THREADS;
+    for (int i = 0; i < THREADS; i++)
+        threads.create_thread(boost::bind(&InsertAndCheck, &cache, &vEntries, i * nPerThread, (i + 1) * nPerThread));
+    threads.join_all();
+
+    // Inserts only get dropped when two threads race for the same slot
+    BOOST_CHECK(HitRate(cache, vEntries, 0, nPerThread * THREADS) > 0.99);
+    std::vector<uint256> vOthers = RandomEntries(1000);
+    BOOST_CHECK_EQUAL(HitRate(cache, vOthers, 0, vOthers.size()), 0.0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -47,6 +48,68 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_multi)
+{
+    // Every seed count around the lane width, and every data length around the block size
+    for (unsigned int nSeeds = 0; nSeeds <= 3 * MURMURHASH3_LANES + 1; nSeeds++) {
+        for (unsigned int nLen = 0; nLen <= 41; nLen++) {
+            std::vector<unsigned char> vData(nLen);
+            for (unsigned int i = 0; i < nLen; i++)
+                vData[i] = insecure_rand();
+            std::vector<unsigned int> vSeeds(nSeeds), vHashes(nSeeds);
+            for (unsigned int i = 0; i < nSeeds; i++)
+                vSeeds[i] = i * 0xFBA4C795 + insecure_rand();
+            MurmurHash3Multi(vSeeds.data(), nSeeds, vData.data(), vData.size(), vHashes.data());
+            for (unsigned int i = 0; i < nSeeds; i++)
+                BOOST_CHECK_EQUAL(vHashes[i], MurmurHash3(vSeeds[i], vData));
+        }
+    }
+
+    // Known values from above, with seeds spanning two batches
+    std::vector<unsigned char> vData = ParseHex("00");
+    unsigned int vSeeds[] = {0x00000000, 0xFBA4C795, 0x00000000, 0xFBA4C795, 0x00000000, 0xFBA4C795};
+    unsigned int vHashes[6];
+    MurmurHash3Multi(vSeeds, 6, vData.data(), vData.size(), vHashes);
+    for (unsigned int i = 0; i < 6; i++)
+        BOOST_CHECK_EQUAL(vHashes[i], i % 2 ? 0xea3f0b17U : 0x514e28b7U);
+}
+
+BOOST_AUTO_TEST_CASE(hash160_many)
+{
+    // Lengths on both sides of the single-block limit, in counts filling every lane width
+    std::vector<std::vector<unsigned char> > vItems;
+    for (unsigned int i = 0; i < 83; i++) {
+        std::vector<unsigned char> vData(i % 2 ? 33 : i % 67);
+        for (unsigned int j = 0; j < vData.size(); j++)
+            vData[j] = insecure_rand();
+        vItems.push_back(vData);
+    }
+
+    std::vector<std::string> vNames = SHA256Implementations();
+    for (unsigned int n = 0; n < vNames.size(); n++) {
+        BOOST_CHECK_EQUAL(SHA256AutoDetect(vNames[n]), vNames[n]);
+        for (unsigned int nCount = 0; nCount <= vItems.size(); nCount += 1 + nCount / 8) {
+            std::vector<std::vector<unsigned char> > vSome(vItems.begin(), vItems.begin() + nCount);
+            std::vector<uint160> vHashes = Hash160Many(vSome);
+            BOOST_CHECK_EQUAL(vHashes.size(), nCount);
+            for (unsigned int i = 0; i < nCount; i++)
+                BOOST_CHECK(vHashes[i] == Hash160(vSome[i]));
+        }
+    }
+    SHA256AutoDetect();
+
+    // RIPEMD-160 lanes on their own, against the streaming hasher
+    std::vector<unsigned char> vIn(32 * 19), vOut(20 * 19);
+    for (unsigned int i = 0; i < vIn.size(); i++)
+        vIn[i] = insecure_rand();
+    RIPEMD160_32(vOut.data(), vIn.data(), 19);
+    for (unsigned int i = 0; i < 19; i++) {
+        unsigned char expected[CRIPEMD160::OUTPUT_SIZE];
+        CRIPEMD160().Write(&vIn[32 * i], 32).Finalize(expected);
+        BOOST_CHECK(memcmp(&vOut[20 * i], expected, 20) == 0);
+    }
+}
+
 /*
    SipHash-2-4 output with
    k = 00 01 02 ...
@@ -103,6 +103,81 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolRemoveForBlockTest)
+{
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(3);
+    for (int i = 0; i < 3; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[3];
+    CMutableTransaction txGrandChild[3];
+    for (int i = 0; i < 3; i++)
+    {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout.hash = txParent.GetHash();
+        txChild[i].vin[0].prevout.n = i;
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+
+        txGrandChild[i].vin.resize(1);
+        txGrandChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txGrandChild[i].vin[0].prevout.hash = txChild[i].GetHash();
+        txGrandChild[i].vin[0].prevout.n = 0;
+        txGrandChild[i].vout.resize(1);
+        txGrandChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txGrandChild[i].vout[0].nValue = 11000LL;
+    }
+    // Not in the mempool; double-spends the output spent by txChild[0]
+    CMutableTransaction txDoubleSpend = txChild[0];
+    txDoubleSpend.vout[0].nValue = 10000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    for (int i = 0; i < 3; i++)
+    {
+        testPool.addUnchecked(txChild[i].GetHash(), entry.FromTx(txChild[i]));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), entry.FromTx(txGrandChild[i]));
+    }
+    BOOST_CHECK_EQUAL(testPool.size(), 7);
+
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    vtx.push_back(txDoubleSpend);
+    std::vector<std::shared_ptr<const CTransaction> > conflicts;
+    testPool.removeForBlock(vtx, 1, conflicts, false);
+
+    // The block's transaction and the conflicting branch are gone, the
+    // other descendants stay and no longer count the parent as an ancestor.
+    BOOST_CHECK_EQUAL(testPool.size(), 4);
+    BOOST_CHECK(!testPool.exists(txParent.GetHash()));
+    BOOST_CHECK(!testPool.exists(txChild[0].GetHash()));
+    BOOST_CHECK(!testPool.exists(txGrandChild[0].GetHash()));
+    BOOST_CHECK_EQUAL(conflicts.size(), 2);
+    std::set<uint256> conflictHashes;
+    for (unsigned int i = 0; i < conflicts.size(); i++)
+        conflictHashes.insert(conflicts[i]->GetHash());
+    BOOST_CHECK(conflictHashes.count(txChild[0].GetHash()));
+    BOOST_CHECK(conflictHashes.count(txGrandChild[0].GetHash()));
+    for (int i = 1; i < 3; i++)
+    {
+        CTxMemPool::txiter it = testPool.mapTx.find(txChild[i].GetHash());
+        BOOST_CHECK(it != testPool.mapTx.end());
+        BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 1);
+        BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2);
+        it = testPool.mapTx.find(txGrandChild[i].GetHash());
+        BOOST_CHECK(it != testPool.mapTx.end());
+        BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 2);
+    }
+}
+
 template<typename name>
 void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
 {
@@ -315,7 +390,13 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
         sortedOrder.push_back(tx3.GetHash().ToString());
         sortedOrder.push_back(tx6.GetHash().ToString());
     }
-    CheckSort<mining_score>(pool, sortedOrder);
+    // The mining score is no longer indexed; sort on demand as the miner does.
+    std::vector<CTxMemPoolEntry> vSorted(pool.mapTx.begin(), pool.mapTx.end());
+    std::sort(vSorted.begin(), vSorted.end(), CompareTxMemPoolEntryByScore());
+    BOOST_CHECK_EQUAL(vSorted.size(), sortedOrder.size());
+    for (size_t i = 0; i < vSorted.size(); i++) {
+        BOOST_CHECK_EQUAL(vSorted[i].GetTx().GetHash().ToString(), sortedOrder[i]);
+    }
 }
 
 BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
@@ -413,7 +494,7 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     /* after tx6 is mined, tx7 should move up in the sort */
     std::vector<CTransaction> vtx;
     vtx.push_back(tx6);
-    std::list<CTransaction> dummy;
+    std::vector<std::shared_ptr<const CTransaction> > dummy;
     pool.removeForBlock(vtx, 1, dummy, false);
 
     sortedOrder.erase(sortedOrder.begin()+1);
@@ -549,7 +630,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
     std::vector<CTransaction> vtx;
-    std::list<CTransaction> conflicts;
+    std::vector<std::shared_ptr<const CTransaction> > conflicts;
     SetMockTime(42);
     SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
     BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
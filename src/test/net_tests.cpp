@@ -174,4 +174,177 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(cnode_queue_wait_stats)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, "", true);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.dQueueWait, 0.0);
+    BOOST_CHECK_EQUAL(stats.dQueueWaitMax, 0.0);
+
+    node.RecordQueueWait(1000);
+    node.RecordQueueWait(5000);
+    node.RecordQueueWait(3000);
+    node.copyStats(stats);
+    BOOST_CHECK_CLOSE(stats.dQueueWait, 0.003, 1e-6);
+    BOOST_CHECK_CLOSE(stats.dQueueWaitMax, 0.005, 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(cnode_shared_message)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, "", true);
+    node.ssSend.SetVersion(PROTOCOL_VERSION);
+
+    // A message serialized once for many peers is identical to one pushed
+    // to a single peer, header and checksum included.
+    std::vector<uint256> vHashes(100, GetRandHash());
+    node.PushMessage(NetMsgType::GETDATA, vHashes);
+    CSendBufferRef msg = SerializeNetMessage(PROTOCOL_VERSION, NetMsgType::GETDATA, vHashes);
+    node.PushSerializedMessage(NetMsgType::GETDATA, msg);
+
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 2U);
+    BOOST_CHECK(*node.vSendMsg[0] == *msg);
+    BOOST_CHECK(node.vSendMsg[1] == msg);
+    BOOST_CHECK_EQUAL(node.nSendSize, 2 * msg->size());
+    BOOST_CHECK_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE + ::GetSerializeSize(vHashes, SER_NETWORK, PROTOCOL_VERSION));
+}
+
+BOOST_AUTO_TEST_CASE(cnode_receive_pooled)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, "", true);
+
+    std::vector<uint256> vHashes(1000, GetRandHash());
+    CSendBufferRef msg = SerializeNetMessage(PROTOCOL_VERSION, NetMsgType::GETDATA, vHashes);
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << vHashes;
+
+    CRecvBufferPoolStats statsBefore;
+    GetRecvBufferPoolStats(statsBefore);
+    for (int nRound = 0; nRound < 2; nRound++) {
+        // Arrives in odd sized pieces, the checksum is hashed along the way
+        bool fComplete = false;
+        for (size_t nPos = 0; nPos < msg->size(); nPos += 1000) {
+            size_t nLen = std::min((size_t)1000, msg->size() - nPos);
+            BOOST_CHECK(!fComplete);
+            BOOST_REQUIRE(node.ReceiveMsgBytes(&(*msg)[nPos], nLen, fComplete));
+        }
+        BOOST_REQUIRE(fComplete);
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+        const CNetMessage& netmsg = node.vRecvMsg.front();
+        BOOST_CHECK(netmsg.GetMessageHash() == Hash(ssPayload.begin(), ssPayload.end()));
+        BOOST_CHECK(memcmp(netmsg.GetMessageHash().begin(), netmsg.hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) == 0);
+        BOOST_CHECK(netmsg.vRecv.str() == ssPayload.str());
+        node.vRecvMsg.clear();
+    }
+
+    // The second message reused the buffer the first one gave back
+    CRecvBufferPoolStats statsAfter;
+    GetRecvBufferPoolStats(statsAfter);
+    BOOST_CHECK(statsAfter.nHits > statsBefore.nHits);
+}
+
+BOOST_AUTO_TEST_CASE(latency_histogram)
+{
+    CLatencyHistogram hist;
+    BOOST_CHECK_EQUAL(hist.Percentile(0.5), 0);
+    BOOST_CHECK_EQUAL(hist.Average(), 0.0);
+
+    hist.Add(0);
+    hist.Add(1);
+    hist.Add(3);
+    hist.Add(1000);
+    hist.Add(10000000);
+    BOOST_CHECK_EQUAL(hist.nCount, 5U);
+    BOOST_CHECK_EQUAL(hist.nTotal, 10001004);
+    BOOST_CHECK_EQUAL(hist.nMax, 10000000);
+    BOOST_CHECK_EQUAL(hist.vBuckets[0], 1U);
+    BOOST_CHECK_EQUAL(hist.vBuckets[1], 1U);
+    BOOST_CHECK_EQUAL(hist.vBuckets[2], 1U);
+    BOOST_CHECK_EQUAL(hist.vBuckets[10], 1U);
+    BOOST_CHECK_EQUAL(hist.vBuckets[CLatencyHistogram::BUCKETS - 1], 1U);
+
+    BOOST_CHECK_EQUAL(hist.Percentile(0.5), 4);
+    BOOST_CHECK_EQUAL(hist.Percentile(0.8), 1024);
+    BOOST_CHECK_EQUAL(hist.Percentile(1.0), 10000000);
+
+    CLatencyHistogram other;
+    other.Add(2);
+    other.Add(20000000);
+    hist.Merge(other);
+    BOOST_CHECK_EQUAL(hist.nCount, 7U);
+    BOOST_CHECK_EQUAL(hist.vBuckets[2], 2U);
+    BOOST_CHECK_EQUAL(hist.nMax, 20000000);
+}
+
+BOOST_AUTO_TEST_CASE(cnode_message_timing)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, "", true);
+    CConnman connman(0x1337, 0x1337);
+
+    connman.RecordMessageTiming(&node, NetMsgType::TX, 100, 2000, 500);
+    connman.RecordMessageTiming(&node, NetMsgType::TX, 300, 4000, 0);
+    connman.RecordMessageTiming(&node, "nonsense", 10, 10, 10);
+
+    // Unknown commands are lumped together, so peers can't grow the map
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.mapMsgTiming.size(), 2U);
+    BOOST_CHECK(stats.mapMsgTiming.count("nonsense") == 0);
+    const CMsgTiming& timing = stats.mapMsgTiming[NetMsgType::TX];
+    BOOST_CHECK_EQUAL(timing.process.nCount, 2U);
+    BOOST_CHECK_EQUAL(timing.process.nTotal, 6000);
+    BOOST_CHECK_EQUAL(timing.queue.nMax, 300);
+    BOOST_CHECK_EQUAL(timing.lock.nTotal, 500);
+
+    mapMsgCmdTiming mapTotal;
+    connman.GetMessageTiming(mapTotal);
+    BOOST_CHECK_EQUAL(mapTotal[NetMsgType::TX].process.nCount, 2U);
+}
+
+BOOST_AUTO_TEST_CASE(lock_hold_timer)
+{
+    CCriticalSection cs;
+    CCriticalSection csOther;
+    BOOST_CHECK_EQUAL(StopLockHoldTimer(), 0);
+
+    int64_t nStart = GetTimeMicros();
+    StartLockHoldTimer(&cs);
+    {
+        LOCK(cs);
+        {
+            LOCK(cs);
+        }
+        MilliSleep(20);
+    }
+    {
+        LOCK(csOther);
+        MilliSleep(50);
+    }
+    int64_t nHeld = StopLockHoldTimer();
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    // Only the time cs was held counts, recursive locking included once
+    BOOST_CHECK(nHeld >= 20000);
+    BOOST_CHECK(nHeld <= nElapsed - 50000);
+
+    // Stopped timers no longer count
+    {
+        LOCK(cs);
+    }
+    BOOST_CHECK_EQUAL(StopLockHoldTimer(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "netbase.h"
 #include "test/test_bitcoin.h"
+#include "utiltime.h"
 
 #include <string>
 
@@ -286,4 +287,100 @@ BOOST_AUTO_TEST_CASE(netbase_getgroup)
 
 }
 
+#ifndef WIN32
+static bool WaitWritable(SOCKET hSocket, int64_t nTimeout)
+{
+    fd_set fdsetSend;
+    FD_ZERO(&fdsetSend);
+    FD_SET(hSocket, &fdsetSend);
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    return select(hSocket + 1, NULL, &fdsetSend, NULL, &timeout) == 1;
+}
+
+BOOST_AUTO_TEST_CASE(netbase_connect_nonblocking)
+{
+    // A listening socket on an ephemeral loopback port
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, len) == 0);
+    BOOST_REQUIRE(listen(hListen, 1) == 0);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) == 0);
+    CService addr;
+    BOOST_REQUIRE(addr.SetSockAddr((struct sockaddr*)&sockaddr));
+
+    // Connecting returns right away, and completes once the socket is writable.
+    SOCKET hSocket;
+    bool fPending;
+    BOOST_CHECK(StartConnectSocket(addr, hSocket, fPending));
+    BOOST_REQUIRE(hSocket != INVALID_SOCKET);
+    if (fPending)
+        BOOST_CHECK(WaitWritable(hSocket, 5000));
+    BOOST_CHECK(FinishConnectSocket(addr, hSocket));
+    CloseSocket(hSocket);
+
+    // Once nobody listens on the port any more, the attempt fails.
+    CloseSocket(hListen);
+    if (StartConnectSocket(addr, hSocket, fPending)) {
+        BOOST_CHECK(fPending);
+        BOOST_CHECK(WaitWritable(hSocket, 5000));
+        BOOST_CHECK(!FinishConnectSocket(addr, hSocket));
+        CloseSocket(hSocket);
+    }
+}
+#endif
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(netbase_socketevents)
+{
+    CSocketEvents events;
+    BOOST_CHECK(events.IsValid());
+    int fds[2];
+    BOOST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    SOCKET sv[2] = {(SOCKET)fds[0], (SOCKET)fds[1]};
+    BOOST_CHECK(SetSocketNonBlocking(sv[0], true));
+    BOOST_CHECK(events.Add(sv[0], &sv[0]));
+
+    // A fresh socket is writable but has nothing to read.
+    std::vector<CSocketEvents::Event> vEvents;
+    BOOST_CHECK(events.Wait(vEvents, 0));
+    BOOST_CHECK_EQUAL(vEvents.size(), 1U);
+    BOOST_CHECK(vEvents[0].ptr == &sv[0]);
+    BOOST_CHECK(vEvents[0].fSend);
+    BOOST_CHECK(!vEvents[0].fRecv);
+
+    // Edge-triggered: nothing new, nothing reported.
+    BOOST_CHECK(events.Wait(vEvents, 0));
+    BOOST_CHECK(vEvents.empty());
+
+    char c = 'x';
+    BOOST_CHECK_EQUAL(send(sv[1], &c, 1, MSG_NOSIGNAL), 1);
+    BOOST_CHECK(events.Wait(vEvents, 1000));
+    BOOST_CHECK_EQUAL(vEvents.size(), 1U);
+    BOOST_CHECK(vEvents[0].fRecv);
+
+    // The data was not read, yet no further event arrives until more does.
+    BOOST_CHECK(events.Wait(vEvents, 0));
+    BOOST_CHECK(vEvents.empty());
+
+    // Wakeup() interrupts a wait without reporting an event.
+    events.Wakeup();
+    int64_t nStart = GetTimeMillis();
+    BOOST_CHECK(events.Wait(vEvents, 10000));
+    BOOST_CHECK(vEvents.empty());
+    BOOST_CHECK(GetTimeMillis() - nStart < 5000);
+
+    // Closing the peer reports the socket as readable.
+    CloseSocket(sv[1]);
+    BOOST_CHECK(events.Wait(vEvents, 1000));
+    BOOST_CHECK_EQUAL(vEvents.size(), 1U);
+    BOOST_CHECK(vEvents[0].fRecv);
+    CloseSocket(sv[0]);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
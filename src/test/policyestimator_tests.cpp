@@ -2,8 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "policy/policy.h"
 #include "policy/fees.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
@@ -46,7 +48,7 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     for (unsigned int i = 0; i < 128; i++)
         garbage.push_back('X');
     CMutableTransaction tx;
-    std::list<CTransaction> dummyConflicted;
+    std::vector<std::shared_ptr<const CTransaction> > dummyConflicted;
     tx.vin.resize(1);
     tx.vin[0].scriptSig = garbage;
     tx.vout.resize(1);
@@ -206,6 +208,17 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
         BOOST_CHECK(mpool.estimateSmartFee(i).GetFeePerK() >= mpool.GetMinFee(1).GetFeePerK());
         BOOST_CHECK(mpool.estimateSmartPriority(i) == INF_PRIORITY);
     }
+
+    // Estimates read back from a saved estimates file match the originals
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(mpool.WriteFeeEstimates(file));
+    rewind(file.Get());
+    CTxMemPool mpoolRead(CFeeRate(1000));
+    BOOST_CHECK(mpoolRead.ReadFeeEstimates(file));
+    for (int i = 1; i < 10; i++) {
+        BOOST_CHECK(mpoolRead.estimateFee(i) == mpool.estimateFee(i));
+        BOOST_CHECK(mpoolRead.estimatePriority(i) == mpool.estimatePriority(i));
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -213,4 +213,40 @@ BOOST_AUTO_TEST_CASE(sighash_from_data)
         BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
     }
 }
+
+BOOST_AUTO_TEST_CASE(sighash_precomputed_legacy)
+{
+    // Legacy signature hashes from PrecomputedTransactionData match the ones serialized from scratch
+    seed_insecure_rand(false);
+    for (int i = 0; i < 500; i++) {
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, false);
+        int nExtraInputs = insecure_rand() % 40;
+        for (int in = 0; in < nExtraInputs; in++) {
+            txTo.vin.push_back(txTo.vin[in % txTo.vin.size()]);
+            txTo.vin.back().prevout.n = insecure_rand();
+            txTo.vin.back().nSequence = insecure_rand();
+        }
+        // Inputs with a witness do not count towards the threshold
+        if (insecure_rand() % 4 == 0) {
+            txTo.wit.vtxinwit.resize(txTo.vin.size());
+            txTo.wit.vtxinwit[0].scriptWitness.stack.push_back(std::vector<unsigned char>(1, 1));
+        }
+        CTransaction tx(txTo);
+        PrecomputedTransactionData txdata(tx);
+        BOOST_CHECK_EQUAL(txdata.vLegacyMidstates.empty(), tx.vin.size() - !tx.wit.IsNull() < 4);
+
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            int nHashType = (insecure_rand() % 2) ? (int)SIGHASH_ALL : (int)insecure_rand();
+            CScript scriptCode;
+            RandomScript(scriptCode);
+            uint256 sh = SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE, &txdata);
+            BOOST_CHECK(sh == SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE));
+            // SignatureHashOld drops inputs without dropping their witnesses
+            if (tx.wit.IsNull())
+                BOOST_CHECK(sh == SignatureHashOld(scriptCode, tx, nIn, nHashType));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,7 @@
 #include "keystore.h"
 #include "main.h" // For CheckTransaction
 #include "policy/policy.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/sign.h"
 #include "script/script_error.h"
@@ -787,4 +788,50 @@ BOOST_AUTO_TEST_CASE(test_IsStandard)
     BOOST_CHECK(!IsStandardTx(t, reason));
 }
 
+BOOST_AUTO_TEST_CASE(test_cached_hashes)
+{
+    // The txid and wtxid computed together match the ones serialized separately
+    CMutableTransaction t;
+    t.vin.resize(3);
+    t.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    t.vin[1].prevout = COutPoint(GetRandHash(), 2);
+    t.vin[2].prevout = COutPoint(GetRandHash(), 3);
+    t.vin[1].scriptSig = CScript() << OP_1;
+    t.vout.resize(2);
+    t.vout[0].nValue = 90*CENT;
+    t.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    t.nLockTime = 1234;
+
+    for (int i = 0; i < 3; i++) {
+        if (i == 1) {
+            // A witness on the middle input only, so the last one has no entry in vtxinwit
+            t.wit.vtxinwit.resize(2);
+            t.wit.vtxinwit[1].scriptWitness.stack.push_back(ParseHex("0102"));
+        } else if (i == 2) {
+            t.wit.vtxinwit.resize(3);
+            t.wit.vtxinwit[2].scriptWitness.stack.push_back(std::vector<unsigned char>(100, 0xff));
+        }
+        CTransaction tx(t);
+        BOOST_CHECK(tx.GetHash() == SerializeHash(tx, SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS));
+        BOOST_CHECK(tx.GetWitnessHash() == SerializeHash(tx, SER_GETHASH, 0));
+        BOOST_CHECK_EQUAL(tx.GetHash() == tx.GetWitnessHash(), i == 0);
+
+        // Also after deserialization and assignment
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << tx;
+        CTransaction tx2;
+        ss >> tx2;
+        BOOST_CHECK(tx2.GetWitnessHash() == tx.GetWitnessHash());
+        CTransaction tx3;
+        tx3 = tx;
+        BOOST_CHECK(tx3.GetWitnessHash() == tx.GetWitnessHash());
+    }
+
+    // Changing the witness needs an UpdateHash()
+    CTransaction tx(t);
+    tx.wit.SetNull();
+    tx.UpdateHash();
+    BOOST_CHECK(tx.GetWitnessHash() == tx.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "coins.h"
 #include "consensus/validation.h"
 #include "key.h"
 #include "main.h"
@@ -9,6 +10,7 @@
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/interpreter.h"
 #include "script/standard.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
@@ -83,4 +85,81 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+static bool
+CheckSpend(const CTransaction& tx, const CCoinsViewCache& view, unsigned int flags, bool cacheFullScriptStore, bool& fScriptsCached)
+{
+    LOCK(cs_main);
+
+    CValidationState state;
+    PrecomputedTransactionData txdata(tx);
+    return CheckInputs(tx, state, view, true, flags, false, cacheFullScriptStore, txdata, NULL, &fScriptsCached);
+}
+
+BOOST_FIXTURE_TEST_CASE(checkinputs_script_execution_cache, TestingSetup)
+{
+    // Spend a P2PK output with a valid and with an invalid signature
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction funding;
+    funding.vin.resize(1);
+    funding.vin[0].prevout.hash = GetRandHash();
+    funding.vin[0].prevout.n = 0;
+    funding.vout.resize(1);
+    funding.vout[0].nValue = 11*CENT;
+    funding.vout[0].scriptPubKey = scriptPubKey;
+
+    CCoinsViewCache view(pcoinsTip);
+    view.ModifyNewCoins(funding.GetHash(), false)->FromTx(funding, 1);
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = funding.GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 10*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    CMutableTransaction badSpend = spend;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    vchSig[vchSig.size() / 2] ^= 1;
+    badSpend.vin[0].scriptSig << vchSig;
+
+    const unsigned int flags = SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    bool fScriptsCached = true;
+
+    // Without storing, nothing is remembered
+    BOOST_CHECK(CheckSpend(spend, view, flags, false, fScriptsCached));
+    BOOST_CHECK(!fScriptsCached);
+    BOOST_CHECK(CheckSpend(spend, view, flags, true, fScriptsCached));
+    BOOST_CHECK(!fScriptsCached);
+
+    // Once stored, the scripts are skipped, but only for the same flags
+    BOOST_CHECK(CheckSpend(spend, view, flags, true, fScriptsCached));
+    BOOST_CHECK(fScriptsCached);
+    BOOST_CHECK(CheckSpend(spend, view, flags | SCRIPT_VERIFY_NULLDUMMY, false, fScriptsCached));
+    BOOST_CHECK(!fScriptsCached);
+
+    // A lookup without storing uses up the entry, as ConnectBlock does
+    BOOST_CHECK(CheckSpend(spend, view, flags, false, fScriptsCached));
+    BOOST_CHECK(fScriptsCached);
+    BOOST_CHECK(CheckSpend(spend, view, flags, false, fScriptsCached));
+    BOOST_CHECK(!fScriptsCached);
+
+    // Failing scripts are never cached
+    BOOST_CHECK(!CheckSpend(badSpend, view, flags, true, fScriptsCached));
+    BOOST_CHECK(!CheckSpend(badSpend, view, flags, true, fScriptsCached));
+    BOOST_CHECK(!fScriptsCached);
+
+    // A cached transaction still has its inputs checked
+    BOOST_CHECK(CheckSpend(spend, view, flags, true, fScriptsCached));
+    view.ModifyCoins(funding.GetHash())->Spend(0);
+    BOOST_CHECK(!CheckSpend(spend, view, flags, true, fScriptsCached));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -20,13 +20,18 @@
 
 using namespace std;
 
+// Estimate the overhead of a mapTx node to be 12 pointers, as no exact formula
+// for boost::multi_index_contained is implemented: three per ordered index and
+// two for the hashed index node plus its bucket slot.
+static const size_t MAPTX_NODE_OVERHEAD = 12 * sizeof(void*);
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                                  bool poolHasNoInputsOf, CAmount _inChainInputValue,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
-    tx(std::make_shared<CTransaction>(_tx)), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority), entryHeight(_entryHeight),
-    hadNoDependencies(poolHasNoInputsOf), inChainInputValue(_inChainInputValue),
-    spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp)
+    tx(std::make_shared<CTransaction>(_tx)), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority),
+    inChainInputValue(_inChainInputValue), sigOpCost(_sigOpsCost), lockPoints(lp), entryHeight(_entryHeight),
+    hadNoDependencies(poolHasNoInputsOf), spendsCoinbase(_spendsCoinbase)
 {
     nTxWeight = GetTransactionWeight(_tx);
     nModSize = _tx.CalculateModifiedSize(GetTxSize());
@@ -44,6 +49,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    vTxHashesIdx = 0;
+    nEpochMarker = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -83,42 +91,48 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
-
-    while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        BOOST_FOREACH(const txiter childEntry, setChildren) {
-            cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
-            if (cacheIt != cachedDescendants.end()) {
-                // We've already calculated this one, just add the entries for this set
-                // but don't traverse again.
-                BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
-                }
-            } else if (!setAllDescendants.count(childEntry)) {
-                // Schedule for later processing
-                stageEntries.insert(childEntry);
-            }
-        }
+    EpochGuard epoch(*this);
+    std::vector<txiter> &stage = vWalk;
+    std::vector<txiter> &descendants = cachedDescendants[updateIt];
+    stage.clear();
+    visited(updateIt);
+    BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(updateIt)) {
+        const txiter childEntry = mapTx.iterator_to(*child);
+        if (!visited(childEntry))
+            stage.push_back(childEntry);
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
-    // Update and add to cached descendant map
+
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
+    while (!stage.empty()) {
+        const txiter cit = stage.back();
+        stage.pop_back();
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            descendants.push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(cit)) {
+            const txiter childEntry = mapTx.iterator_to(*child);
+            if (visited(childEntry))
+                continue;
+            cacheMap::const_iterator cacheIt = cachedDescendants.find(childEntry);
+            if (cacheIt != cachedDescendants.end()) {
+                // We've already calculated this one, so schedule its cached
+                // descendants directly; marking them visited up front means
+                // walking their children again only costs an epoch check.
+                BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
+                    if (!visited(cacheEntry))
+                        stage.push_back(cacheEntry);
+                }
+            } else {
+                stage.push_back(childEntry);
+            }
+        }
     }
     mapTx.modify(updateIt, update_descendant_state(modifySize, modifyFee, modifyCount));
 }
@@ -146,35 +160,37 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // setMemPoolChildren will be updated, an assumption made in
     // UpdateForDescendants.
     BOOST_REVERSE_FOREACH(const uint256 &hash, vHashesToUpdate) {
-        // we cache the in-mempool children to avoid duplicate updates
-        setEntries setChildren;
         // calculate children from mapNextTx
         txiter it = mapTx.find(hash);
         if (it == mapTx.end()) {
             continue;
         }
-        auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
-        // First calculate the children, and update setMemPoolChildren to
-        // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
-            const uint256 &childHash = iter->second->GetHash();
-            txiter childIter = mapTx.find(childHash);
-            assert(childIter != mapTx.end());
-            // We can skip updating entries we've encountered before or that
-            // are in the block (which are already accounted for).
-            if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
-                UpdateChild(it, childIter, true);
-                UpdateParent(childIter, it, true);
+        {
+            // we mark the in-mempool children to avoid duplicate updates
+            EpochGuard epoch(*this);
+            auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
+            // First calculate the children, and update setMemPoolChildren to
+            // include them, and update their setMemPoolParents to include this tx.
+            for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
+                const uint256 &childHash = iter->second->GetHash();
+                txiter childIter = mapTx.find(childHash);
+                assert(childIter != mapTx.end());
+                // We can skip updating entries we've encountered before or that
+                // are in the block (which are already accounted for).
+                if (!visited(childIter) && !setAlreadyIncluded.count(childHash)) {
+                    UpdateChild(it, childIter, true);
+                    UpdateParent(childIter, it, true);
+                }
             }
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
 }
 
-bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
+bool CTxMemPool::CalculateAncestors(const CTxMemPoolEntry &entry, std::vector<txiter> &vAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents) const
 {
-    setEntries parentHashes;
     const CTransaction &tx = entry.GetTx();
+    vAncestors.clear();
 
     if (fSearchForParents) {
         // Get parents of this transaction that are in the mempool
@@ -182,9 +198,9 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && !visited(piter)) {
+                vAncestors.push_back(piter);
+                if (vAncestors.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -194,16 +210,19 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(it)) {
+            const txiter piter = mapTx.iterator_to(*parent);
+            if (!visited(piter))
+                vAncestors.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
-    while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
-
-        setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
+    // vAncestors doubles as the work queue: everything before i has been
+    // checked, everything from i onwards is staged.
+    for (size_t i = 0; i < vAncestors.size(); i++) {
+        const txiter stageit = vAncestors[i];
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -217,15 +236,15 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(stageit)) {
+            const txiter phash = mapTx.iterator_to(*parent);
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
-            }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
-                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
-                return false;
+            if (!visited(phash)) {
+                vAncestors.push_back(phash);
+                if (vAncestors.size() + 1 > limitAncestorCount) {
+                    errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                    return false;
+                }
             }
         }
     }
@@ -233,17 +252,27 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
     return true;
 }
 
-void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
+{
+    EpochGuard epoch(*this);
+    if (!CalculateAncestors(entry, vWalk, limitAncestorCount, limitAncestorSize, limitDescendantCount, limitDescendantSize, errString, fSearchForParents)) {
+        return false;
+    }
+    setAncestors.insert(vWalk.begin(), vWalk.end());
+    return true;
+}
+
+template <typename Container>
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, const Container &ancestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
-    BOOST_FOREACH(txiter piter, parentIters) {
-        UpdateChild(piter, it, add);
+    BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(it)) {
+        UpdateChild(mapTx.iterator_to(*parent), it, add);
     }
     const int64_t updateCount = (add ? 1 : -1);
     const int64_t updateSize = updateCount * it->GetTxSize();
     const CAmount updateFee = updateCount * it->GetModifiedFee();
-    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+    BOOST_FOREACH(txiter ancestorIt, ancestors) {
         mapTx.modify(ancestorIt, update_descendant_state(updateSize, updateFee, updateCount));
     }
 }
@@ -264,9 +293,8 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    BOOST_FOREACH(txiter updateIt, setMemPoolChildren) {
-        UpdateParent(updateIt, it, false);
+    BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(it)) {
+        UpdateParent(mapTx.iterator_to(*child), it, false);
     }
 }
 
@@ -279,23 +307,24 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
+        // Here we only update statistics and not the entry links (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
         BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-            setEntries setDescendants;
-            CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
+            EpochGuard epoch(*this);
+            vWalk.clear();
+            CalculateDescendants(removeIt, vWalk);
             int64_t modifySize = -((int64_t)removeIt->GetTxSize());
             CAmount modifyFee = -removeIt->GetModifiedFee();
             int modifySigOps = -removeIt->GetSigOpCost();
-            BOOST_FOREACH(txiter dit, setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+            // vWalk[0] is removeIt itself; don't update state for self
+            for (size_t i = 1; i < vWalk.size(); i++) {
+                mapTx.modify(vWalk[i], update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
             }
         }
     }
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-        setEntries setAncestors;
+        EpochGuard epoch(*this);
         const CTxMemPoolEntry &entry = *removeIt;
         std::string dummy;
         // Since this is a tx that is already in the mempool, we can call CMPA
@@ -304,21 +333,21 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // should be a bit faster.
         // However, if we happen to be in the middle of processing a reorg, then
         // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of 
+        // of ancestors reachable via the entry links will be the same as the set of
         // ancestors whose packages include this transaction, because when we
         // add a new transaction to the mempool in addUnchecked(), we assume it
         // has no children, and in the case of a reorg where that assumption is
         // false, the in-mempool children aren't linked to the in-block tx's
         // until UpdateTransactionsFromBlock() is called.
         // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
+        // UpdateTransactionsFromBlock() has been called, then the entry links will
         // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
+        // and it's important that we use the linked notion of ancestor
         // transactions as the set of things to update for removal.
-        CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        CalculateAncestors(entry, vWalk, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
         // Note that UpdateAncestorsOf severs the child links that point to
         // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+        UpdateAncestorsOf(false, removeIt, vWalk);
     }
     // After updating all the ancestor sizes, we can now sever the link between each
     // transaction being removed and any mempool children (ie, update setMemPoolParents
@@ -349,7 +378,7 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nEpoch(0), fEpochGuarded(false)
 {
     _clear(); //lock free clear
 
@@ -399,7 +428,6 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // all the appropriate checks.
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -450,7 +478,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     return true;
 }
 
-void CTxMemPool::removeUnchecked(txiter it)
+void CTxMemPool::removeUnchecked(txiter it, bool fInBlock)
 {
     const uint256 hash = it->GetTx().GetHash();
     BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
@@ -467,11 +495,13 @@ void CTxMemPool::removeUnchecked(txiter it)
 
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    cachedInnerUsage -= memusage::DynamicUsage(it->vMemPoolParents) + memusage::DynamicUsage(it->vMemPoolChildren);
     mapTx.erase(it);
     nTransactionsUpdated++;
-    minerPolicyEstimator->removeTx(hash);
+    // Transactions confirmed in a block were already handed to the fee
+    // estimator by processBlock().
+    if (!fInBlock)
+        minerPolicyEstimator->removeTx(hash);
 }
 
 // Calculates descendants of entry that are not already in setDescendants, and adds to
@@ -482,22 +512,45 @@ void CTxMemPool::removeUnchecked(txiter it)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    if (setDescendants.count(entryit) != 0) {
+        return;
     }
+    EpochGuard epoch(*this);
+    std::vector<txiter> &stage = vWalk;
+    stage.clear();
+    visited(entryit);
+    stage.push_back(entryit);
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
     while (!stage.empty()) {
-        txiter it = *stage.begin();
+        txiter it = stage.back();
+        stage.pop_back();
         setDescendants.insert(it);
-        stage.erase(it);
 
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        BOOST_FOREACH(const txiter &childiter, setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(it)) {
+            const txiter childiter = mapTx.iterator_to(*child);
+            if (!visited(childiter) && !setDescendants.count(childiter)) {
+                stage.push_back(childiter);
+            }
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, std::vector<txiter> &vDescendants) const
+{
+    if (visited(entryit)) {
+        return;
+    }
+    // Entries from the start index onwards are both the result and the
+    // queue of entries whose children still need to be walked.
+    size_t i = vDescendants.size();
+    vDescendants.push_back(entryit);
+    for (; i < vDescendants.size(); i++) {
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(vDescendants[i])) {
+            const txiter childiter = mapTx.iterator_to(*child);
+            if (!visited(childiter)) {
+                vDescendants.push_back(childiter);
             }
         }
     }
@@ -573,59 +626,54 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
     }
 }
 
-void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed)
-{
-    // Remove transactions which depend on inputs of tx, recursively
-    LOCK(cs);
-    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        auto it = mapNextTx.find(txin.prevout);
-        if (it != mapNextTx.end()) {
-            const CTransaction &txConflict = *it->second;
-            if (txConflict != tx)
-            {
-                removeRecursive(txConflict, removed);
-                ClearPrioritisation(txConflict.GetHash());
-            }
-        }
-    }
-}
-
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
 void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                                std::list<CTransaction>& conflicts, bool fCurrentEstimate)
+                                std::vector<std::shared_ptr<const CTransaction> >& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
-    std::vector<CTxMemPoolEntry> entries;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        uint256 hash = tx.GetHash();
-
-        indexed_transaction_set::iterator i = mapTx.find(hash);
-        if (i != mapTx.end())
-            entries.push_back(*i);
-    }
+    std::vector<const CTxMemPoolEntry*> entries;
+    setEntries stageBlock, stageConflicts;
+    // A single pass over the block finds both the in-mempool block
+    // transactions and, through the spent outpoints in mapNextTx, the
+    // transactions that conflict with them.
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        txiter it = mapTx.find(tx.GetHash());
+        const uint256& hash = tx.GetHash();
+        txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
-            setEntries stage;
-            stage.insert(it);
-            RemoveStaged(stage, true);
+            entries.push_back(&*it);
+            stageBlock.insert(it);
         }
-        removeConflicts(tx, conflicts);
-        ClearPrioritisation(tx.GetHash());
+        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+            auto itConflict = mapNextTx.find(txin.prevout);
+            if (itConflict == mapNextTx.end() || itConflict->second->GetHash() == hash)
+                continue;
+            const uint256& hashConflict = itConflict->second->GetHash();
+            txiter conflictit = mapTx.find(hashConflict);
+            assert(conflictit != mapTx.end());
+            CalculateDescendants(conflictit, stageConflicts);
+            ClearPrioritisation(hashConflict);
+        }
+        ClearPrioritisation(hash);
     }
-    // After the txs in the new block have been removed from the mempool, update policy estimates
+
+    // Before the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
+
+    RemoveStaged(stageBlock, true);
+    conflicts.reserve(conflicts.size() + stageConflicts.size());
+    BOOST_FOREACH(txiter it, stageConflicts) {
+        conflicts.push_back(it->GetSharedTx());
+    }
+    RemoveStaged(stageConflicts, false);
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = true;
 }
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
@@ -665,10 +713,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks &links = linksiter->second;
-        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        innerUsage += memusage::DynamicUsage(it->vMemPoolParents) + memusage::DynamicUsage(it->vMemPoolChildren);
         bool fDependsWait = false;
         setEntries setParentCheck;
         int64_t parentSizes = 0;
@@ -695,7 +740,10 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(setParentCheck.size() == GetMemPoolParents(it).size());
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(it)) {
+            assert(setParentCheck.count(mapTx.iterator_to(*parent)));
+        }
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -728,7 +776,10 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(setChildrenCheck.size() == GetMemPoolChildren(it).size());
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(it)) {
+            assert(setChildrenCheck.count(mapTx.iterator_to(*child)));
+        }
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -929,11 +980,11 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         if (it != mapTx.end()) {
             mapTx.modify(it, update_fee_delta(deltas.second));
             // Now update all ancestors' modified fees with descendants
-            setEntries setAncestors;
+            EpochGuard epoch(*this);
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
             std::string dummy;
-            CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-            BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+            CalculateAncestors(*it, vWalk, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH(txiter ancestorIt, vWalk) {
                 mapTx.modify(ancestorIt, update_descendant_state(0, nFeeDelta, 0));
             }
         }
@@ -986,19 +1037,18 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + MAPTX_NODE_OVERHEAD) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
     BOOST_FOREACH(const txiter& it, stage) {
-        removeUnchecked(it);
+        removeUnchecked(it, updateDescendants);
     }
 }
 
-int CTxMemPool::Expire(int64_t time) {
+int CTxMemPool::Expire(int64_t time, std::vector<std::shared_ptr<const CTransaction> >* pvRemovedTxs) {
     LOCK(cs);
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
     setEntries toremove;
@@ -1010,6 +1060,10 @@ int CTxMemPool::Expire(int64_t time) {
     BOOST_FOREACH(txiter removeit, toremove) {
         CalculateDescendants(removeit, stage);
     }
+    if (pvRemovedTxs) {
+        BOOST_FOREACH(txiter removeit, stage)
+            pvRemovedTxs->push_back(removeit->GetSharedTx());
+    }
     RemoveStaged(stage, false);
     return stage.size();
 }
@@ -1024,40 +1078,56 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
     return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::UpdateLinks(CTxMemPoolEntry::vecLinks &links, txiter link, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    // The package limits keep these lists short, so a linear scan beats
+    // keeping them sorted. Capacity is never released before the entry
+    // itself is removed, so usage only grows here.
+    const size_t nUsageBefore = memusage::DynamicUsage(links);
+    CTxMemPoolEntry::vecLinks::iterator it = std::find(links.begin(), links.end(), &*link);
+    if (add && it == links.end()) {
+        links.push_back(&*link);
+    } else if (!add && it != links.end()) {
+        *it = links.back();
+        links.pop_back();
     }
+    cachedInnerUsage += memusage::DynamicUsage(links) - nUsageBefore;
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLinks(entry->vMemPoolChildren, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLinks(entry->vMemPoolParents, parent, add);
+}
+
+CTxMemPool::EpochGuard::EpochGuard(const CTxMemPool& in) : pool(in)
+{
+    assert(!pool.fEpochGuarded);
+    ++pool.nEpoch;
+    pool.fEpochGuarded = true;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+CTxMemPool::EpochGuard::~EpochGuard()
+{
+    // prevents stale results ever being used
+    ++pool.nEpoch;
+    pool.fEpochGuarded = false;
+}
+
+const CTxMemPoolEntry::vecLinks & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    return entry->vMemPoolParents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPoolEntry::vecLinks & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    return entry->vMemPoolChildren;
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
@@ -1092,47 +1162,85 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
-void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining) {
+size_t CTxMemPool::EvictionMemoryUsage(txiter it) const
+{
+    // Upper bound on how much DynamicMemoryUsage() drops when this entry is
+    // removed. Only the entry's own link lists are freed; the lists of its
+    // parents and children keep their capacity.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + MAPTX_NODE_OVERHEAD) + it->DynamicMemoryUsage() +
+        sizeof(std::pair<uint256, txiter>) +
+        it->GetTx().vin.size() * memusage::IncrementalDynamicUsage(mapNextTx) +
+        memusage::DynamicUsage(it->vMemPoolParents) + memusage::DynamicUsage(it->vMemPoolChildren);
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining, std::vector<std::shared_ptr<const CTransaction> >* pvRemovedTxs) {
     LOCK(cs);
 
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
-
-        // We set the new mempool min fee to the feerate of the removed set, plus the
-        // "minimum reasonable fee rate" (ie some value under which we consider txn
-        // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
-        // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
-        removed += minReasonableRelayFee;
-        trackPackageRemoved(removed);
-        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
-
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
-        nTxnRemoved += stage.size();
+    std::vector<std::shared_ptr<const CTransaction> > vRemovedTxs;
+    size_t nUsage;
+    while (!mapTx.empty() && (nUsage = DynamicMemoryUsage()) > sizelimit) {
+        // Walk the descendant_score index once from the bottom, staging whole
+        // packages until they account for enough memory, and remove them all
+        // with a single RemoveStaged(). Since EvictionMemoryUsage() is an
+        // upper bound we never stage a package the one-at-a-time approach
+        // would have kept; if we fall short, the next pass picks up from the
+        // new bottom of the index.
+        const size_t nToFree = nUsage - sizelimit;
+        size_t nFreed = 0;
+        {
+            EpochGuard epoch(*this);
+            vWalk.clear();
+            indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+            for (; it != mapTx.get<descendant_score>().end() && nFreed < nToFree; ++it) {
+                const size_t nStart = vWalk.size();
+                CalculateDescendants(mapTx.project<0>(it), vWalk);
+                if (vWalk.size() == nStart) {
+                    // Already staged as a descendant of an earlier package.
+                    continue;
+                }
 
-        std::vector<CTransaction> txn;
-        if (pvNoSpendsRemaining) {
-            txn.reserve(stage.size());
+                // We set the new mempool min fee to the feerate of the removed set, plus the
+                // "minimum reasonable fee rate" (ie some value under which we consider txn
+                // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
+                // equal to txn which were removed with no block in between.
+                CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+                removed += minReasonableRelayFee;
+                maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+                for (size_t i = nStart; i < vWalk.size(); i++) {
+                    nFreed += EvictionMemoryUsage(vWalk[i]);
+                }
+            }
+        }
+
+        setEntries stage(vWalk.begin(), vWalk.end());
+        nTxnRemoved += stage.size();
+        if (pvNoSpendsRemaining || pvRemovedTxs) {
             BOOST_FOREACH(txiter iter, stage)
-                txn.push_back(iter->GetTx());
+                vRemovedTxs.push_back(iter->GetSharedTx());
         }
         RemoveStaged(stage, false);
-        if (pvNoSpendsRemaining) {
-            BOOST_FOREACH(const CTransaction& tx, txn) {
-                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-                    if (exists(txin.prevout.hash))
-                        continue;
-                    auto iter = mapNextTx.lower_bound(COutPoint(txin.prevout.hash, 0));
-                    if (iter == mapNextTx.end() || iter->first->hash != txin.prevout.hash)
-                        pvNoSpendsRemaining->push_back(txin.prevout.hash);
-                }
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0)) {
+        trackPackageRemoved(maxFeeRateRemoved);
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+    }
+
+    if (pvNoSpendsRemaining) {
+        BOOST_FOREACH(const std::shared_ptr<const CTransaction>& tx, vRemovedTxs) {
+            BOOST_FOREACH(const CTxIn& txin, tx->vin) {
+                if (mapTx.count(txin.prevout.hash))
+                    continue;
+                auto iter = mapNextTx.lower_bound(COutPoint(txin.prevout.hash, 0));
+                if (iter == mapNextTx.end() || iter->first->hash != txin.prevout.hash)
+                    pvNoSpendsRemaining->push_back(txin.prevout.hash);
             }
         }
     }
 
-    if (maxFeeRateRemoved > CFeeRate(0))
-        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+    if (pvRemovedTxs)
+        pvRemovedTxs->insert(pvRemovedTxs->end(), vRemovedTxs.begin(), vRemovedTxs.end());
 }
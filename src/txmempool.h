@@ -6,9 +6,11 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <algorithm>
 #include <list>
 #include <memory>
 #include <set>
+#include <vector>
 
 #include "amount.h"
 #include "coins.h"
@@ -75,37 +77,47 @@ class CTxMemPool;
 
 class CTxMemPoolEntry
 {
+public:
+    /** Direct in-mempool parents or children of an entry */
+    typedef std::vector<const CTxMemPoolEntry*> vecLinks;
+
 private:
+    // Fields are grouped by size so the entry packs tightly; every byte here
+    // is paid once per mempool transaction.
     std::shared_ptr<const CTransaction> tx;
     CAmount nFee;              //!< Cached to avoid expensive parent-transaction lookups
-    size_t nTxWeight;          //!< ... and avoid recomputing tx weight (also used for GetTxSize())
-    size_t nModSize;           //!< ... and modified size for priority
-    size_t nUsageSize;         //!< ... and total memory usage
     int64_t nTime;             //!< Local time when entering the mempool
     double entryPriority;      //!< Priority when entering the mempool
-    unsigned int entryHeight;  //!< Chain height when entering the mempool
-    bool hadNoDependencies;    //!< Not dependent on any other txs when it entered the mempool
     CAmount inChainInputValue; //!< Sum of all txin values that are already in blockchain
-    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
     int64_t sigOpCost;         //!< Total sigop cost
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
+    uint32_t nTxWeight;        //!< ... and avoid recomputing tx weight (also used for GetTxSize())
+    uint32_t nModSize;         //!< ... and modified size for priority
+    uint32_t nUsageSize;       //!< ... and total memory usage
+    unsigned int entryHeight;  //!< Chain height when entering the mempool
 
     // Information about descendants of this transaction that are in the
     // mempool; if we remove this transaction we must remove all of these
     // descendants as well.  if nCountWithDescendants is 0, treat this entry as
     // dirty, and nSizeWithDescendants and nModFeesWithDescendants will not be
     // correct.
-    uint64_t nCountWithDescendants;  //!< number of descendant transactions
-    uint64_t nSizeWithDescendants;   //!< ... and size
+    uint64_t nSizeWithDescendants;   //!< size of descendant transactions
     CAmount nModFeesWithDescendants; //!< ... and total fees (all including us)
 
     // Analogous statistics for ancestor transactions
-    uint64_t nCountWithAncestors;
     uint64_t nSizeWithAncestors;
     CAmount nModFeesWithAncestors;
     int64_t nSigOpCostWithAncestors;
 
+    // Number of descendant and ancestor transactions; bounded by the package
+    // limits, so 32 bits are plenty
+    uint32_t nCountWithDescendants;
+    uint32_t nCountWithAncestors;
+
+    bool hadNoDependencies;    //!< Not dependent on any other txs when it entered the mempool
+    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
+
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
@@ -152,7 +164,14 @@ public:
     CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
-    mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint32_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpochMarker; //!< Last traversal epoch in which this entry was visited
+
+    // The entry's links in the mempool graph live in the entry itself rather
+    // than in a separate map. Only CTxMemPool maintains them; use
+    // CTxMemPool::GetMemPoolParents/GetMemPoolChildren to read them.
+    mutable vecLinks vMemPoolParents;
+    mutable vecLinks vMemPoolChildren;
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -224,7 +243,7 @@ struct mempoolentry_txid
 class CompareTxMemPoolEntryByDescendantScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         bool fUseADescendants = UseDescendantScore(a);
         bool fUseBDescendants = UseDescendantScore(b);
@@ -246,7 +265,7 @@ public:
     }
 
     // Calculate which score to use for an entry (avoiding division).
-    bool UseDescendantScore(const CTxMemPoolEntry &a)
+    bool UseDescendantScore(const CTxMemPoolEntry &a) const
     {
         double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
         double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
@@ -261,7 +280,7 @@ public:
 class CompareTxMemPoolEntryByScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
         double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
@@ -275,7 +294,7 @@ public:
 class CompareTxMemPoolEntryByEntryTime
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         return a.GetTime() < b.GetTime();
     }
@@ -284,7 +303,7 @@ public:
 class CompareTxMemPoolEntryByAncestorFee
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double aFees = a.GetModFeesWithAncestors();
         double aSize = a.GetSizeWithAncestors();
@@ -307,7 +326,6 @@ public:
 // Multi_index tag names
 struct descendant_score {};
 struct entry_time {};
-struct mining_score {};
 struct ancestor_score {};
 
 class CBlockPolicyEstimator;
@@ -346,7 +364,10 @@ struct TxMempoolInfo
  * - transaction hash
  * - feerate [we use max(feerate of tx, feerate of tx with all descendants)]
  * - time in mempool
- * - mining score (feerate modified by any fee deltas from PrioritiseTransaction)
+ * - feerate with all ancestors, modified by any fee deltas (for mining)
+ * Orders that are only needed occasionally, like the plain mining score
+ * (CompareTxMemPoolEntryByScore), are computed on demand instead of being
+ * indexed, as each index costs several pointers per entry.
  *
  * Note: the term "descendant" refers to in-mempool transactions that depend on
  * this one, while "ancestor" refers to in-mempool transactions that a given
@@ -354,8 +375,9 @@ struct TxMempoolInfo
  *
  * In order for the feerate sort to remain correct, we must update transactions
  * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
- * each CTxMemPoolEntry, we track the size and fees of all descendants.
+ * the set of in-mempool direct parents and direct children in each
+ * CTxMemPoolEntry.  Within each CTxMemPoolEntry, we also track the size and
+ * fees of all descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
  * children (because any such children would be an orphan).  So in
@@ -387,7 +409,7 @@ struct TxMempoolInfo
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * the entries' parent and child links may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
@@ -446,12 +468,6 @@ public:
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByEntryTime
             >,
-            // sorted by score (for mining prioritization)
-            boost::multi_index::ordered_unique<
-                boost::multi_index::tag<mining_score>,
-                boost::multi_index::identity<CTxMemPoolEntry>,
-                CompareTxMemPoolEntryByScore
-            >,
             // sorted by fee rate with ancestors
             boost::multi_index::ordered_non_unique<
                 boost::multi_index::tag<ancestor_score>,
@@ -474,21 +490,46 @@ public:
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
-private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    /** Direct in-mempool parents or children of an entry. The links point
+     *  at entries in mapTx; mapTx.iterator_to() turns them into a txiter. */
+    const CTxMemPoolEntry::vecLinks & GetMemPoolParents(txiter entry) const;
+    const CTxMemPoolEntry::vecLinks & GetMemPoolChildren(txiter entry) const;
 
-    struct TxLinks {
-        setEntries parents;
-        setEntries children;
+    /** \class EpochGuard
+     *
+     *  Graph walks over the entry links mark each visited entry with the current
+     *  epoch instead of collecting them in a temporary setEntries.  An
+     *  EpochGuard starts a fresh epoch for the duration of one traversal;
+     *  traversals must not be nested.
+     */
+    class EpochGuard
+    {
+        const CTxMemPool& pool;
+    public:
+        EpochGuard(const CTxMemPool& in);
+        ~EpochGuard();
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
+    /** Mark an entry as visited in the current epoch. Returns true if it had
+     *  already been visited. Requires an EpochGuard to be held. */
+    bool visited(txiter it) const
+    {
+        assert(fEpochGuarded);
+        bool ret = it->nEpochMarker >= nEpoch;
+        it->nEpochMarker = std::max(it->nEpochMarker, nEpoch);
+        return ret;
+    }
+
+private:
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
+
+    mutable uint64_t nEpoch;            //!< Current traversal epoch
+    mutable bool fEpochGuarded;         //!< Whether an EpochGuard is currently held
+    mutable std::vector<txiter> vWalk;  //!< Scratch space reused across traversals
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
+    void UpdateLinks(CTxMemPoolEntry::vecLinks &links, txiter link, bool add);
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
@@ -522,9 +563,11 @@ public:
 
     void removeRecursive(const CTransaction &tx, std::list<CTransaction>& removed);
     void removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags);
-    void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
+    /** Remove the transactions of a newly connected block, and everything
+     *  that conflicts with them, in one batched pass. The removed conflicts
+     *  are appended to conflicts. */
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                        std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
+                        std::vector<std::shared_ptr<const CTransaction> >& conflicts, bool fCurrentEstimate = true);
     void clear();
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
@@ -550,6 +593,8 @@ public:
      *  in a block.
      *  Set updateDescendants to true when removing a tx that was in a block, so
      *  that any in-mempool descendants have their ancestor state updated.
+     *  Such transactions must already have been passed to the fee estimator's
+     *  processBlock().
      */
     void RemoveStaged(setEntries &stage, bool updateDescendants);
 
@@ -572,7 +617,7 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from the entry links. Must be true for entries not in the mempool
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
 
@@ -581,6 +626,11 @@ public:
      *  already in it.  */
     void CalculateDescendants(txiter it, setEntries &setDescendants);
 
+    /** Append to vDescendants all in-mempool descendants of it (including it)
+     *  that have not yet been visited in the current epoch. Requires an
+     *  EpochGuard to be held by the caller. */
+    void CalculateDescendants(txiter it, std::vector<txiter> &vDescendants) const;
+
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
       *  The minReasonableRelayFee constructor arg is used to bound the time it
@@ -590,13 +640,17 @@ public:
     CFeeRate GetMinFee(size_t sizelimit) const;
 
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
+      *  Packages are evicted in bulk, lowest descendant score first, and the
+      *  rolling minimum fee is bumped once for the whole batch.
       *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
       *  which are not in mempool which no longer have any spends in this mempool.
+      *  pvRemovedTxs, if set, will be populated with the evicted transactions.
       */
-    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
+    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL, std::vector<std::shared_ptr<const CTransaction> >* pvRemovedTxs=NULL);
 
-    /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
-    int Expire(int64_t time);
+    /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions.
+      *  pvRemovedTxs, if set, will be populated with the expired transactions. */
+    int Expire(int64_t time, std::vector<std::shared_ptr<const CTransaction> >* pvRemovedTxs=NULL);
 
     unsigned long size()
     {
@@ -661,14 +715,22 @@ private:
     void UpdateForDescendants(txiter updateIt,
             cacheMap &cachedDescendants,
             const std::set<uint256> &setExclude);
-    /** Update ancestors of hash to add/remove it as a descendant transaction. */
-    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
+    /** Update ancestors of hash to add/remove it as a descendant transaction.
+     *  ancestors may be a setEntries or a std::vector<txiter>. */
+    template <typename Container>
+    void UpdateAncestorsOf(bool add, txiter hash, const Container &ancestors);
     /** Set ancestor state for an entry */
     void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors);
+    /** Flat-vector version of CalculateMemPoolAncestors. vAncestors is
+     *  cleared and filled with the ancestors of entry. Requires an
+     *  EpochGuard to be held by the caller. */
+    bool CalculateAncestors(const CTxMemPoolEntry &entry, std::vector<txiter> &vAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents) const;
     /** For each transaction being removed, update ancestors and any direct children.
       * If updateDescendants is true, then also update in-mempool descendants'
       * ancestor state. */
     void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants);
+    /** Upper bound on the memory freed by removing a single entry. */
+    size_t EvictionMemoryUsage(txiter it) const;
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry);
 
@@ -679,8 +741,10 @@ private:
      *  given transaction that is removed, so we can't remove intermediate
      *  transactions in a chain before we've updated all the state for the
      *  removal.
+     *  fInBlock skips fee estimator tracking for transactions that
+     *  processBlock() has already accounted for.
      */
-    void removeUnchecked(txiter entry);
+    void removeUnchecked(txiter entry, bool fInBlock = false);
 };
 
 /** 
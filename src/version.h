@@ -9,7 +9,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 110014;
+static const int PROTOCOL_VERSION = 110015;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -45,4 +45,7 @@ static const int FEEFILTER_VERSION = 110013;
 //! shord-id-based block download starts with this version
 static const int SHORT_IDS_BLOCKS_VERSION = 110014;
 
+//! "sendshorttx" and short-id-based transaction announcements start with this version
+static const int SHORT_TXIDS_RELAY_VERSION = 110015;
+
 #endif // BITCOIN_VERSION_H
@@ -3059,13 +3059,19 @@ void CWallet::GetAllReserveKeys(set<CKeyID>& setAddress) const
     CWalletDB walletdb(strWalletFile);
 
     LOCK2(cs_main, cs_wallet);
+    std::vector<CPubKey> vPubKeys;
+    vPubKeys.reserve(setKeyPool.size());
     BOOST_FOREACH(const int64_t& id, setKeyPool)
     {
         CKeyPool keypool;
         if (!walletdb.ReadPool(id, keypool))
             throw runtime_error(std::string(__func__) + ": read failed");
         assert(keypool.vchPubKey.IsValid());
-        CKeyID keyID = keypool.vchPubKey.GetID();
+        vPubKeys.push_back(keypool.vchPubKey);
+    }
+    BOOST_FOREACH(const uint160& hash, Hash160Many(vPubKeys))
+    {
+        CKeyID keyID(hash);
         if (!HaveKey(keyID))
             throw runtime_error(std::string(__func__) + ": unknown key in key pool");
         setAddress.insert(keyID);